@@ -5,11 +5,29 @@
 #include <stdbool.h>
 #include <string.h>
 #include <stdlib.h>
+#include <fnmatch.h>
+#include <poll.h>
 
 #define MAXBUFFERSIZE   80
+#define LISTBATCHSIZE   64
+#define MAXTOKENS       8
+
+/* Running totals for the du command */
+typedef struct DiskUsage {
+    uint32_t totalBytes;
+    uint32_t numFiles;
+    uint32_t numDirectories;
+} DiskUsage;
 
 void cleartoendofline( void );  /* ANSI function prototype */
 bool isValidCommand(char* userInput, char* command);
+void listDirectory(Superblock *sb, char *path, bool longFormat);
+void formatMode(uint16_t flags, char *mode);
+int addDiskUsage(const char *path, const V6DirectoryEntry *entry, int depth, void *userData);
+int printIfNameMatches(const char *path, const V6DirectoryEntry *entry, int depth, void *userData);
+void reportWarmup(bool *reported);
+void printDefragFile(const V6DefragFile *file, void *userData);
+void waitForInput(Superblock *sb);
 
 void cleartoendofline( void )
 {
@@ -24,6 +42,120 @@ bool isValidCommand(char* userInput, char* command) {
     return (strcmp(userInput, command) == 0);
 }
 
+/* Prints the entries of a v6 directory, one per line */
+void listDirectory(Superblock *sb, char *path, bool longFormat) {
+    V6DirectoryEntry entries[LISTBATCHSIZE];
+    size_t numEntries;
+    char mode[11];
+    V6Directory *directory = v6_opendir(sb, path);
+
+    if (directory == NULL) {
+        printf("ls: %s: no such directory\n", path);
+        return;
+    }
+
+    do {
+        if (v6_readdir(directory, entries, LISTBATCHSIZE, longFormat, &numEntries) != 0) {
+            printf("ls: %s: read error\n", path);
+            break;
+        }
+
+        for (size_t i = 0; i < numEntries; i++) {
+            if (longFormat) {
+                formatMode(entries[i].inode.flags, mode);
+                printf("%s %5u %8u %s\n", mode, entries[i].inodeNumber, entries[i].size, entries[i].name);
+            } else {
+                printf("%s\n", entries[i].name);
+            }
+        }
+    } while (numEntries > 0);
+
+    v6_closedir(directory);
+}
+
+/* Builds an "ls -l" style mode string, e.g. drwxr-xr-x */
+void formatMode(uint16_t flags, char *mode) {
+    const char *permissions = "rwxrwxrwx";
+
+    mode[0] = (flags & FLAG_FILE_TYPE) == FILE_TYPE_DIRECTORY ? 'd' : '-';
+    for (int i = 0; i < 9; i++) {
+        mode[i + 1] = (flags & (0400 >> i)) ? permissions[i] : '-';
+    }
+    mode[10] = 0x00;
+}
+
+/* v6_walk callback for du: adds up the size of everything below the starting path */
+int addDiskUsage(const char *path, const V6DirectoryEntry *entry, int depth, void *userData) {
+    DiskUsage *usage = userData;
+
+    (void) path;
+    (void) depth;
+    usage->totalBytes += entry->size;
+    if ((entry->inode.flags & FLAG_FILE_TYPE) == FILE_TYPE_DIRECTORY) {
+        usage->numDirectories++;
+    } else {
+        usage->numFiles++;
+    }
+    return 0;
+}
+
+/* v6_walk callback for find -name: prints every path whose last component matches the pattern */
+int printIfNameMatches(const char *path, const V6DirectoryEntry *entry, int depth, void *userData) {
+    const char *pattern = userData;
+
+    (void) depth;
+    if (fnmatch(pattern, entry->name, 0) == 0) {
+        printf("%s\n", path);
+    }
+    return 0;
+}
+
+/* Prints how the cache warmup went, once it has finished */
+void reportWarmup(bool *reported) {
+    V6WarmupReport report;
+
+    v6_warmup_report(&report);
+    if (report.state == WARMUP_FINISHED) {
+        printf("warmup: read %u blocks in %.1f ms, %u now cached\n",
+               report.blocksRead, report.seconds * 1000.0, report.blocksCached);
+        *reported = true;
+    }
+}
+
+/* v6_defrag callback: prints how one fragmented file came out */
+void printDefragFile(const V6DefragFile *file, void *userData) {
+    (void) userData;
+    if (file->moved) {
+        printf("i-node %u: %u blocks, %.1f%% -> %.1f%% fragmented\n",
+               file->inodeNumber, file->numBlocks, file->scoreBefore, file->scoreAfter);
+    } else {
+        printf("i-node %u: %u blocks, %.1f%% fragmented, left in place (no free run long enough)\n",
+               file->inodeNumber, file->numBlocks, file->scoreBefore);
+    }
+}
+
+/* Waits for the next line, committing the journal whenever an interval passes in the meantime */
+void waitForInput(Superblock *sb) {
+    struct pollfd fds[2];
+    int8_t result;
+
+    fds[0].fd = 0;
+    fds[0].events = POLLIN;
+    fds[1].events = POLLIN;
+
+    while ((fds[1].fd = v6_durability_fd()) >= 0) {
+        if (poll(fds, 2, -1) < 0 || (fds[0].revents & (POLLIN | POLLHUP)) != 0) {
+            return;
+        }
+        if ((fds[1].revents & POLLIN) != 0) {
+            result = v6_durability_commit(sb);
+            if (result != 0) {
+                printf("Res: %d\n", result);
+            }
+        }
+    }
+}
+
 int main(int argc, char *argv[])
 {
     char    ch;                     /* handles user input */
@@ -32,15 +164,34 @@ int main(int argc, char *argv[])
     int     exit_flag = 0;
     int     valid_choice;
     char*   token;
-    char*   tokens[3];
+    char*   tokens[MAXTOKENS];
+    char    lower[MAXBUFFERSIZE + 1];   /* lower case copy of the command */
     Superblock *sb;
+    bool    warmupReported = true;
 
     //Load the filesystem
     sb = v6_loadfs(argv[1]);
+    if (sb == NULL) {
+        // A new file, or a clone whose base is gone. Only initfs makes sense from here.
+        printf("Could not load a file system from %s, use initfs to make one\n", argv[1]);
+    }
+
+    // -w warms the cache with the root directory, -W with every directory.
+    if (sb != NULL && argc > 2 && (strcmp(argv[2], "-w") == 0 || strcmp(argv[2], "-W") == 0)) {
+        warmupReported = v6_warmup(sb, argv[2][1] == 'W') != 0;
+    }
     //sb = v6_loadfs("/Users/jon/UTD/CS5348/Project_2/v6fs/test.v6fs");
 
+    // Unbuffered, so waiting on the descriptor never misses a line stdio has already read.
+    setvbuf(stdin, NULL, _IONBF, 0);
+
     while( exit_flag  == 0 ) {
+        if (!warmupReported) {
+            reportWarmup(&warmupReported);
+        }
         printf("%s", "v6fs: \n");
+        fflush(stdout);
+        waitForInput(sb);
         ch = getchar();
         char_count = 0;
         while( (ch != '\n')  &&  (char_count < MAXBUFFERSIZE)) {
@@ -54,9 +205,8 @@ int main(int argc, char *argv[])
         tokens[0] = token;
 
         // Convert the command call to lower case
-        char* token1 = tokens[0];
-        const int length = strlen(tokens[0]);
-        char* lower = (char*)malloc(length + 1);
+        char* token1 = tokens[0] != NULL ? tokens[0] : "";
+        const int length = strlen(token1);
         lower[length] = 0;
 
         for (int i = 0; i < length; i++){
@@ -68,16 +218,68 @@ int main(int argc, char *argv[])
         int tokenIndex = 1;
         while(token != NULL) {
             token = strtok(NULL, " ");
-            if(token != NULL){
+            if(token != NULL && tokenIndex < MAXTOKENS){
                 tokens[tokenIndex++] = token;
             }
         }
 
         // Command execution
         if (isValidCommand(tokens[0], "initfs")){
-            __uint32_t numBlocks = atoi(tokens[1]);
-            __uint32_t numInodes = atoi(tokens[2]);
-            sb = v6_initfs(numBlocks, numInodes);
+            Superblock *oldSb = sb;
+            int argIndex = 1;
+            __uint8_t extended = 0, grouped = 0;
+            __uint32_t numGroups = 0;
+
+            // -x makes an extended image, which can be far larger than a V6 one, optionally
+            // with bigger blocks. -g splits either kind into allocation groups.
+            while (argIndex < tokenIndex && tokens[argIndex][0] == '-') {
+                if (isValidCommand(tokens[argIndex], "-x")) {
+                    extended = 1;
+                    argIndex++;
+                } else if (isValidCommand(tokens[argIndex], "-g") && argIndex + 1 < tokenIndex) {
+                    grouped = 1;
+                    numGroups = strtoul(tokens[argIndex + 1], NULL, 10);
+                    argIndex += 2;
+                } else {
+                    break;
+                }
+            }
+
+            if (argIndex + 1 >= tokenIndex) {
+                printf("initfs: usage: initfs [-x] [-g groups] blocks inodes [blocksize]\n");
+            } else if (strtoul(tokens[argIndex + 1], NULL, 10) > UINT16_MAX
+                       || (extended == 0 && strtoul(tokens[argIndex], NULL, 10) > UINT16_MAX)) {
+                // Checked before the counts are narrowed, so an oversized one can't wrap to a small one.
+                printf("initfs: failed, an image has at most %u i-nodes, and without -x at most %u blocks\n",
+                       UINT16_MAX, UINT16_MAX);
+            } else {
+                __uint32_t numBlocks = strtoul(tokens[argIndex], NULL, 10);
+                __uint32_t numInodes = atoi(tokens[argIndex + 1]);
+                __uint32_t blockSize = extended && argIndex + 2 < tokenIndex
+                                       ? strtoul(tokens[argIndex + 2], NULL, 10) : BLOCK_SIZE;
+
+                if (grouped) {
+                    sb = numGroups <= 65535 ? v6_initfs_grouped(extended, numBlocks, (uint16_t) numInodes, blockSize, (uint16_t) numGroups) : NULL;
+                } else if (extended) {
+                    sb = v6_initfs_extended(numBlocks, (uint16_t) numInodes, blockSize);
+                } else {
+                    sb = v6_initfs((uint16_t) numBlocks, (uint16_t) numInodes);
+                }
+                if (sb == NULL) {
+                    // Unusable sizes are turned down before anything is written.
+                    if (grouped) {
+                        printf("initfs: failed, the block size must be a power of two from %d to %d, and every "
+                               "allocation group needs at least one i-node and one data block\n",
+                               MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+                    } else {
+                        printf("initfs: failed, the block size must be a power of two from %d to %d\n",
+                               MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+                    }
+                    sb = oldSb;
+                } else {
+                    free(oldSb);
+                }
+            }
         }
 
         if (isValidCommand(tokens[0], "cpin")){
@@ -94,7 +296,219 @@ int main(int argc, char *argv[])
         }
 
         if (isValidCommand(tokens[0], "rm")){
-            v6_rm(sb, tokens[1]);
+            if (tokenIndex > 2 && isValidCommand(tokens[1], "-r")) {
+                v6_rm_recursive(sb, tokens[2]);
+            } else {
+                v6_rm(sb, tokens[1]);
+            }
+        }
+
+        if (isValidCommand(tokens[0], "cp")){
+            if (tokenIndex < 3) {
+                printf("usage: cp /v6filename /v6newfilename\n");
+            } else {
+                v6_cp(sb, tokens[1], tokens[2]);
+            }
+        }
+
+        if (isValidCommand(tokens[0], "mv")){
+            if (tokenIndex < 3) {
+                printf("usage: mv /v6path /v6newpath\n");
+            } else {
+                v6_mv(sb, tokens[1], tokens[2]);
+            }
+        }
+
+        if (isValidCommand(tokens[0], "ls")){
+            char rootPath[] = "/";
+            if (tokenIndex > 1 && isValidCommand(tokens[1], "-l")) {
+                listDirectory(sb, tokenIndex > 2 ? tokens[2] : rootPath, true);
+            } else {
+                listDirectory(sb, tokenIndex > 1 ? tokens[1] : rootPath, false);
+            }
+        }
+
+        if (isValidCommand(tokens[0], "du")){
+            char rootPath[] = "/";
+            DiskUsage usage = { 0 };
+            if (v6_walk(sb, tokenIndex > 1 ? tokens[1] : rootPath, addDiskUsage, &usage) == 0) {
+                printf("%u bytes in %u files and %u directories\n",
+                       usage.totalBytes, usage.numFiles, usage.numDirectories);
+            }
+        }
+
+        if (isValidCommand(tokens[0], "find")){
+            if (tokenIndex > 3 && isValidCommand(tokens[2], "-name")) {
+                v6_walk(sb, tokens[1], printIfNameMatches, tokens[3]);
+            } else {
+                printf("usage: find /v6dir -name pattern\n");
+            }
+        }
+
+        if (isValidCommand(tokens[0], "journal")){
+            int8_t journalResult = -1;
+            if (tokenIndex > 1 && isValidCommand(tokens[1], "on")) {
+                journalResult = v6_journal_enable(sb);
+            } else if (tokenIndex > 1 && isValidCommand(tokens[1], "off")) {
+                journalResult = v6_journal_disable(sb);
+            } else if (tokenIndex > 1 && isValidCommand(tokens[1], "commit")) {
+                journalResult = v6_journal_commit(sb);
+            } else {
+                printf("usage: journal on|off|commit\n");
+            }
+            if (journalResult > 0) {
+                printf("Res: %d\n", journalResult);
+            }
+        }
+
+        if (isValidCommand(tokens[0], "sync")){
+            int8_t syncResult = v6_sync(sb);
+            if (syncResult != 0) {
+                printf("Res: %d\n", syncResult);
+            }
+        }
+
+        if (isValidCommand(tokens[0], "clone")){
+            if (tokenIndex < 3) {
+                printf("usage: clone baseimage cloneimage\n");
+            } else {
+                int8_t cloneResult = v6_clone(tokens[1], tokens[2]);
+                if (cloneResult != 0) {
+                    printf("Res: %d\n", cloneResult);
+                }
+            }
+        }
+
+        if (isValidCommand(tokens[0], "commit")){
+            int8_t commitResult = v6_commit(sb);
+            if (commitResult != 0) {
+                printf("Res: %d\n", commitResult);
+            }
+        }
+
+        if (isValidCommand(tokens[0], "checkpoint")){
+            if (tokenIndex < 2) {
+                printf("usage: checkpoint name\n");
+            } else {
+                int8_t checkpointResult = v6_checkpoint(sb, tokens[1]);
+                if (checkpointResult != 0) {
+                    printf("Res: %d\n", checkpointResult);
+                }
+            }
+        }
+
+        if (isValidCommand(tokens[0], "export-delta")){
+            if (tokenIndex < 2) {
+                printf("usage: export-delta deltafile\n");
+            } else {
+                V6DeltaReport report;
+                int8_t exportResult = v6_export_delta(sb, tokens[1], &report);
+                if (exportResult != 0) {
+                    printf("Res: %d\n", exportResult);
+                } else {
+                    printf("since checkpoint %s: %u of %u blocks changed in %u runs, %llu bytes written\n",
+                           report.checkpoint, report.changedBlocks, report.numBlocks, report.runs,
+                           (unsigned long long) report.bytes);
+                }
+            }
+        }
+
+        if (isValidCommand(tokens[0], "apply-delta")){
+            if (tokenIndex < 3) {
+                printf("usage: apply-delta deltafile image\n");
+            } else {
+                V6DeltaReport report;
+                int8_t applyResult = v6_apply_delta(tokens[1], tokens[2], &report);
+                if (applyResult != 0) {
+                    printf("Res: %d\n", applyResult);
+                } else {
+                    printf("applied the %u blocks changed since checkpoint %s to %s\n",
+                           report.changedBlocks, report.checkpoint, tokens[2]);
+                }
+            }
+        }
+
+        if (isValidCommand(tokens[0], "durability")){
+            int8_t durabilityResult = -1;
+            if (tokenIndex > 1 && isValidCommand(tokens[1], "none")) {
+                durabilityResult = v6_set_durability(sb, DURABILITY_NONE, 0);
+            } else if (tokenIndex > 1 && isValidCommand(tokens[1], "on-quit")) {
+                durabilityResult = v6_set_durability(sb, DURABILITY_ON_QUIT, 0);
+            } else if (tokenIndex > 1 && isValidCommand(tokens[1], "per-command")) {
+                durabilityResult = v6_set_durability(sb, DURABILITY_PER_COMMAND, 0);
+            } else if (tokenIndex > 2 && isValidCommand(tokens[1], "interval")) {
+                durabilityResult = v6_set_durability(sb, DURABILITY_INTERVAL, strtoul(tokens[2], NULL, 10));
+            } else {
+                printf("usage: durability none|on-quit|per-command|interval ms\n");
+            }
+            if (durabilityResult > 0) {
+                printf("Res: %d\n", durabilityResult);
+            }
+        }
+
+        if (isValidCommand(tokens[0], "warmup")){
+            bool allDirectories = tokenIndex > 1 && isValidCommand(tokens[1], "-a");
+            int8_t warmupResult = v6_warmup(sb, allDirectories);
+            if (warmupResult == 0) {
+                warmupReported = false;
+            } else {
+                printf("Res: %d\n", warmupResult);
+            }
+        }
+
+        if (isValidCommand(tokens[0], "defrag")){
+            uint32_t maxBlocks = tokenIndex > 1 ? strtoul(tokens[1], NULL, 10) : 0;
+            uint32_t pauseMs = tokenIndex > 2 ? strtoul(tokens[2], NULL, 10) : 0;
+            V6DefragReport report;
+            int8_t defragResult = v6_defrag(sb, maxBlocks, pauseMs, printDefragFile, NULL, &report);
+            if (defragResult != 0) {
+                printf("Res: %d\n", defragResult);
+            } else {
+                printf("image: %.1f%% -> %.1f%% fragmented, moved %u of %u fragmented files (%u blocks), %u files scanned\n",
+                       report.scoreBefore, report.scoreAfter, report.filesMoved, report.filesFragmented,
+                       report.blocksMoved, report.filesScanned);
+                if (!report.finished) {
+                    printf("stopped at the block budget, run defrag again to carry on from i-node %u\n",
+                           report.nextInode);
+                }
+            }
+        }
+
+        if (isValidCommand(tokens[0], "compact")){
+            V6CompactReport report;
+            int8_t compactResult = v6_compact(sb, tokenIndex > 1 ? tokens[1] : NULL, &report);
+            if (compactResult != 0) {
+                printf("Res: %d\n", compactResult);
+            } else {
+                printf("compacted %u of %u directories, moved %u entries, freed %u blocks\n",
+                       report.directoriesCompacted, report.directoriesScanned, report.entriesMoved,
+                       report.blocksFreed);
+            }
+        }
+
+        if (isValidCommand(tokens[0], "locality")){
+            V6LocalityReport report;
+            int8_t localityResult = v6_locality(sb, tokenIndex > 1 ? tokens[1] : NULL, &report);
+            if (localityResult != 0) {
+                printf("Res: %d\n", localityResult);
+            } else {
+                printf("%u directories, %u files: %llu blocks read, %llu seeks, %.1f blocks per seek\n",
+                       report.directories, report.files, (unsigned long long) report.blocksRead,
+                       (unsigned long long) report.seeks,
+                       report.seeks > 0 ? (double) report.seekDistance / report.seeks : 0.0);
+            }
+        }
+
+        if (isValidCommand(tokens[0], "bench")){
+            size_t iterations = tokenIndex > 1 ? strtoul(tokens[1], NULL, 10) : 0;
+            if (iterations == 0) {
+                iterations = 1000000;
+            }
+            double strncmpSeconds, scalarSeconds, vectorSeconds;
+            v6_bench_dirscan(iterations, &strncmpSeconds, &scalarSeconds, &vectorSeconds);
+            printf("directory block scan, %zu lookups: strncmp %.1f ns, scalar %.1f ns, vector %.1f ns per block\n",
+                   iterations, strncmpSeconds * 1e9 / iterations, scalarSeconds * 1e9 / iterations,
+                   vectorSeconds * 1e9 / iterations);
         }
 
         if (isValidCommand(tokens[0], "q")){
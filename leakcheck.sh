@@ -0,0 +1,49 @@
+#!/bin/sh
+# Builds fsaccess with AddressSanitizer and runs a batch session of copies, moves, removals and
+# journal commits through it, failing if anything is leaked or touched out of bounds.
+# Usage: ./leakcheck.sh [rounds]
+
+ROUNDS=${1:-20}
+DIR=$(mktemp -d) || exit 1
+trap 'rm -rf "$DIR"' EXIT
+
+cd "$(dirname "$0")" || exit 1
+gcc -g -fsanitize=address -fno-omit-frame-pointer -pthread v6fs.c fsaccess.c -o "$DIR/fsaccess" || exit 1
+
+head -c 3000 /dev/urandom > "$DIR/small"
+head -c 150000 /dev/urandom > "$DIR/large"
+
+{
+    echo "initfs 20000 500"
+    echo "journal on"
+    echo "mkdir /keep"
+    i=1
+    while [ "$i" -le "$ROUNDS" ]; do
+        echo "mkdir /d$i"
+        echo "mkdir /d$i/sub"
+        echo "cpin $DIR/small /d$i/a"
+        echo "cpin $DIR/large /d$i/sub/b"
+        echo "cp /d$i/a /d$i/c"
+        echo "mv /d$i/c /keep/c$i"
+        echo "ls -l /d$i"
+        echo "rm /d$i/a"
+        echo "journal commit"
+        echo "rm -r /d$i"
+        i=$((i + 1))
+    done
+    echo "cpout /keep/c1 $DIR/out"
+    echo "du /"
+    echo "journal off"
+    echo "q"
+} > "$DIR/session"
+
+ASAN_OPTIONS=detect_leaks=1:exitcode=1 "$DIR/fsaccess" "$DIR/image" < "$DIR/session" > "$DIR/log" 2>&1
+status=$?
+if [ "$status" -ne 0 ] || grep -q "Sanitizer" "$DIR/log"; then
+    cat "$DIR/log"
+    echo "leakcheck: failed"
+    exit 1
+fi
+
+cmp -s "$DIR/small" "$DIR/out" || { echo "leakcheck: copied file came back different"; exit 1; }
+echo "leakcheck: $ROUNDS rounds, no leaks"
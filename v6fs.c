@@ -1,55 +1,774 @@
+#define _GNU_SOURCE
 #include "v6fs.h"
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <memory.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 
 FILE *v6FileSystem = NULL;
 
+/*
+ * Number of blocks held by the block cache, and the number of hash buckets used to find them.
+ */
+#define BLOCK_CACHE_SIZE                    512
+#define BLOCK_CACHE_BUCKETS                 1024
+
+/*
+ * The most blocks read from disk in a single request.
+ */
+#define MAX_BLOCK_RUN                       64
+
+/*
+ * Readahead for a sequential reader starts at READAHEAD_MIN_BLOCKS blocks and doubles each time
+ * the reader catches up with it, up to a full run. Well below BLOCK_CACHE_SIZE, so what was read
+ * ahead is still cached when the reader gets there.
+ */
+#define READAHEAD_MIN_BLOCKS                4
+#define READAHEAD_MAX_BLOCKS                MAX_BLOCK_RUN
+
+/*
+ * What getBlockNumberAtIndex returns when an indirect block on the way can't be read, as opposed
+ * to 0 for a hole. Never a real block number, since block numbers stay below fsize.
+ */
+#define BLOCK_NUMBER_UNREADABLE             UINT32_MAX
+
+/*
+ * Removing an entry compacts its directory once at least this percentage of the directory's
+ * blocks could be freed by it.
+ */
+#define DIRECTORY_COMPACT_PERCENT           25
+
+/*
+ * On-disk layouts, overlaid directly on block buffers so fields are read and changed in place.
+ * Packed so every field sits at its V6 byte offset. V6 words are stored little endian, which is
+ * also the host's byte order, so fields are used as they are.
+ */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "v6fs reads on-disk fields in place and needs a little endian host"
+#endif
+
+typedef struct __attribute__((packed)) DiskInode {
+    uint16_t flags;
+    uint8_t nlinks;
+    uint8_t uid;
+    uint8_t gid;
+    uint8_t size0;
+    uint16_t size1;
+    uint16_t addr[8];
+    uint16_t actime[2];
+    uint16_t modtime[2];
+} DiskInode;
+
+typedef struct __attribute__((packed)) DiskDirectoryEntry {
+    uint16_t inodeNumber;
+    char name[14];
+} DiskDirectoryEntry;
+
+typedef struct __attribute__((packed)) DiskSuperblock {
+    uint16_t isize;
+    uint16_t fsize;
+    uint16_t nfree;
+    uint16_t free[100];
+    uint16_t ninode;
+    uint16_t inode[100];
+    uint8_t flock;
+    uint8_t ilock;
+    uint8_t fmod;
+    uint16_t time[2];
+    // ALLOCATION_GROUPS_MAGIC when ngroups is set. Bytes 421-447 are unused.
+    uint32_t groupsMagic;
+    uint16_t ngroups;
+    uint8_t unused[27];
+    uint16_t nreclaim;
+    uint16_t reclaim[MAX_PENDING_RECLAIM];
+} DiskSuperblock;
+
+/*
+ * The extended format. Its superblock carries EXTENDED_SUPERBLOCK_MAGIC in bytes that are unused
+ * on a V6 image, and keeps the reclaim queue where a V6 superblock has it.
+ */
+#define EXTENDED_SUPERBLOCK_MAGIC           0x58453656U
+#define EXTENDED_FREE_ARRAY_SIZE            50
+
+/*
+ * Marks the superblock of an image made with v6_initfs_grouped, in either format. Without it the
+ * number of groups is taken to be 0.
+ */
+#define ALLOCATION_GROUPS_MAGIC             0x47413656U
+
+typedef struct __attribute__((packed)) DiskExtendedInode {
+    uint16_t flags;
+    uint8_t nlinks;
+    uint8_t uid;
+    uint8_t gid;
+    uint8_t unused0[3];
+    uint64_t size;
+    uint32_t addr[8];
+    uint16_t actime[2];
+    uint16_t modtime[2];
+    uint8_t unused1[8];
+} DiskExtendedInode;
+
+typedef struct __attribute__((packed)) DiskExtendedSuperblock {
+    uint16_t isize;
+    uint16_t ninode;
+    uint16_t nfree;
+    uint8_t flock;
+    uint8_t ilock;
+    uint32_t fsize;
+    uint8_t fmod;
+    uint8_t unused0;
+    uint16_t time[2];
+    uint16_t inode[100];
+    uint16_t unused1;
+    uint32_t free[EXTENDED_FREE_ARRAY_SIZE];
+    uint32_t groupsMagic;
+    uint16_t ngroups;
+    uint8_t unused2[16];
+    // The block size in bytes. Images from before it was configurable have 0 here, for 512.
+    uint16_t blockSize;
+    uint32_t magic;
+    uint16_t nreclaim;
+    uint16_t reclaim[MAX_PENDING_RECLAIM];
+} DiskExtendedSuperblock;
+
+// Enough for the indirect blocks of either format at any block size.
+#define MAX_ADDRESSES_PER_BLOCK             (MAX_BLOCK_SIZE / sizeof(uint32_t))
+#define MAX_ENTRIES_PER_BLOCK               (MAX_BLOCK_SIZE / sizeof(DiskDirectoryEntry))
+
+_Static_assert(sizeof(DiskInode) == 32, "an i-node is 32 bytes on disk");
+_Static_assert(offsetof(DiskInode, size1) == 6 && offsetof(DiskInode, addr) == 8 &&
+               offsetof(DiskInode, actime) == 24 && offsetof(DiskInode, modtime) == 28,
+               "i-node fields are at their V6 offsets");
+_Static_assert(sizeof(DiskDirectoryEntry) == 16 && offsetof(DiskDirectoryEntry, name) == 2,
+               "a directory entry is a 2 byte i-node number and a 14 byte name");
+_Static_assert(offsetof(DiskSuperblock, free) == 6 && offsetof(DiskSuperblock, ninode) == 206 &&
+               offsetof(DiskSuperblock, inode) == 208 && offsetof(DiskSuperblock, flock) == 408 &&
+               offsetof(DiskSuperblock, fmod) == 410 && offsetof(DiskSuperblock, time) == 411 &&
+               offsetof(DiskSuperblock, nreclaim) == 448 && offsetof(DiskSuperblock, reclaim) == 450,
+               "superblock fields are at their V6 offsets");
+_Static_assert(sizeof(DiskSuperblock) <= MIN_BLOCK_SIZE, "the superblock fits in one block");
+_Static_assert(BLOCK_SIZE / sizeof(uint16_t) <= MAX_ADDRESSES_PER_BLOCK, "V6 indirect blocks fit too");
+_Static_assert(sizeof(DiskExtendedInode) == 64 && offsetof(DiskExtendedInode, size) == 8 &&
+               offsetof(DiskExtendedInode, addr) == 16, "an extended i-node is 64 bytes on disk");
+_Static_assert(offsetof(DiskExtendedSuperblock, free) % 4 == 0 &&
+               offsetof(DiskExtendedSuperblock, blockSize) == 442 &&
+               offsetof(DiskExtendedSuperblock, magic) == 444 &&
+               offsetof(DiskExtendedSuperblock, nreclaim) == offsetof(DiskSuperblock, nreclaim) &&
+               sizeof(DiskExtendedSuperblock) == sizeof(DiskSuperblock),
+               "the extended magic sits in unused V6 bytes and the reclaim queue where V6 has it");
+
+/*
+ * A file name laid out the way it sits in a 16 byte directory entry, for matching whole entries
+ * at once. The i-node number bytes are zero.
+ */
+typedef struct DirectoryEntryKey {
+    uint8_t bytes[16];
+    // Bit i is set if byte i of an entry has to equal bytes[i] for the names to match. This covers
+    // the name up to and including its terminating zero, so it matches exactly what strncmp does.
+    uint32_t mask;
+} DirectoryEntryKey;
+
+/*
+ * What differs between the image formats. Filled in once when an image is loaded or initialized,
+ * so the code that depends on the format calls through here instead of checking it every time.
+ */
+typedef struct ImageFormat {
+    uint8_t extended;
+    // Bytes in a block, its base two logarithm, and directory entries in a block.
+    uint32_t blockSize;
+    uint8_t blockShift;
+    uint32_t entriesPerBlock;
+    // Bytes in an i-node on disk, and i-nodes in a block.
+    size_t inodeSize;
+    uint32_t inodesPerBlock;
+    // Block addresses in an indirect block.
+    uint32_t addressesPerBlock;
+    // How many levels of indirect blocks each of a large file's eight addresses goes through, and
+    // how many block indexes it covers.
+    uint8_t addressLevels[8];
+    uint32_t addressSpans[8];
+    // Block numbers the superblock's free array holds. A free list chain block holds a count
+    // followed by as many block numbers, all as wide as a block address.
+    uint16_t freeArraySize;
+    // The largest number of blocks and bytes in a file.
+    uint32_t maxFileBlocks;
+    uint32_t maxFileSize;
+    void (*superblockFromDisk)(const uint8_t *blockData, Superblock *sb);
+    void (*superblockToDisk)(Superblock *sb, uint8_t *blockData);
+    void (*inodeFromDisk)(const uint8_t *diskInode, Inode *inode);
+    void (*inodeToDisk)(Inode *inode, uint8_t *diskInode);
+    // Copy count block addresses starting at entry first of an indirect or chain block.
+    void (*readAddresses)(const uint8_t *blockData, size_t first, uint32_t *addresses, size_t count);
+    void (*writeAddresses)(uint8_t *blockData, size_t first, const uint32_t *addresses, size_t count);
+    // The versions of the whole block scans compiled for this block size.
+    uint8_t (*blockIsZero)(const uint8_t *data);
+    int (*findEntryInBlock)(const uint8_t *blockData, const DirectoryEntryKey *key);
+} ImageFormat;
+
+/*
+ * One slot of the block cache. The cache is write-through, so a cached block always matches disk.
+ */
+typedef struct CachedBlock {
+    uint32_t blockNumber;
+    uint8_t valid;
+    // Set on every use, cleared as the clock hand passes. Unreferenced blocks are evicted first.
+    uint8_t referenced;
+    // Index of the next slot in the same hash bucket, or -1.
+    int32_t nextInBucket;
+    uint8_t data[MAX_BLOCK_SIZE];
+} CachedBlock;
+
+static CachedBlock *blockCache = NULL;
+static int32_t blockCacheBuckets[BLOCK_CACHE_BUCKETS];
+static size_t blockCacheHand = 0;
+
+/*
+ * A journal transaction is committed at the start of the next operation once it holds this many
+ * operations or blocks.
+ */
+#define JOURNAL_GROUP_OPERATIONS            32
+#define JOURNAL_GROUP_BLOCKS                256
+
+/*
+ * Committed blocks are written in place and the journal emptied once there are this many of them,
+ * or the journal file grows past this many bytes.
+ */
+#define JOURNAL_CHECKPOINT_BLOCKS           1024
+#define JOURNAL_CHECKPOINT_BYTES            (4L * 1024 * 1024)
+
+#define JOURNAL_HEADER_MAGIC                0x4B483656U
+#define JOURNAL_COMMIT_MAGIC                0x43483656U
+// Transactions logged before block numbers were 32 bits wide have 16 bit block numbers.
+#define JOURNAL_HEADER_MAGIC_NARROW         0x4A483656U
+
+/*
+ * A growable list of block numbers, used to gather blocks before freeing them in bulk.
+ * Also used to gather the i-node numbers that go with them.
+ */
+typedef struct BlockList {
+    uint32_t *blocks;
+    size_t count;
+    size_t capacity;
+} BlockList;
+
+/*
+ * Size of the chunks scratch memory is carved out of. Bigger requests get a chunk of their own.
+ */
+#define SCRATCH_CHUNK_SIZE                  16384
+
+/*
+ * A chunk of scratch memory. Chunks are chained newest first.
+ */
+typedef struct ScratchChunk {
+    struct ScratchChunk *next;
+    size_t size;
+    size_t used;
+    _Alignas(max_align_t) uint8_t data[];
+} ScratchChunk;
+
+/*
+ * A metadata block that has been journaled but not yet written in place.
+ */
+typedef struct JournalBlock {
+    uint32_t blockNumber;
+    // Set once this contents is in a committed transaction.
+    uint8_t committed;
+    uint8_t data[MAX_BLOCK_SIZE];
+} JournalBlock;
+
+/*
+ * Journal state. The journal is a sidecar file next to the image, and journaling is on for as
+ * long as it exists.
+ */
+static char *journalPath = NULL;
+static int journalFd = -1;
+static Superblock *journalSb = NULL;
+// Set while metadata writes go to the journal instead of in place.
+static uint8_t journalCapturing = 0;
+static JournalBlock *journalBlocks = NULL;
+static size_t journalCount = 0;
+static size_t journalCapacity = 0;
+// Hash table of index + 1 into journalBlocks, found by block number. 0 marks an empty slot.
+// Always at least twice the size of journalBlocks, and a power of two.
+static uint32_t *journalSlots = NULL;
+static size_t journalSlotCount = 0;
+// Blocks and operations in the running, uncommitted transaction.
+static size_t journalRunningBlocks = 0;
+static size_t journalRunningOperations = 0;
+// Set when file data has been written in place since the last commit.
+static uint8_t journalDataWritten = 0;
+static uint32_t journalSequence = 0;
+static off_t journalOffset = 0;
+
+/*
+ * A clone made by v6_clone is a sparse delta file over a read-only base image. Its blocks sit at
+ * the same offsets as in the base, and the ones written since the clone was made are marked in a
+ * presence bitmap stored right after the last block. The rest are holes, read from the base. The
+ * path of the base follows the bitmap, and the file ends with an OverlayTrailer, which is how
+ * v6_loadfs tells a clone from a plain image. Keeping it all in one file means syncing the image
+ * syncs the bitmap with it.
+ */
+#define OVERLAY_MAGIC                       0x4C564F36U
+
+typedef struct OverlayTrailer {
+    // OVERLAY_MAGIC.
+    uint32_t magic;
+    uint32_t blockSize;
+    // Blocks in the base image, and so in the clone. Also how big the base has to stay.
+    uint32_t numBlocks;
+    // Length of the base image path in front of the trailer, without a terminator.
+    uint32_t pathLength;
+    // The base's i-node number and modification time when the clone was made. A base that was
+    // replaced or written since no longer matches the blocks the clone left in it.
+    uint64_t baseInode;
+    int64_t baseMtimeSeconds;
+    int64_t baseMtimeNanoseconds;
+} OverlayTrailer;
+
+// The base image opened read-only, or -1 when the loaded image isn't a clone.
+static int overlayBaseFd = -1;
+// One bit per block, set once the block is in the delta file.
+static uint8_t *overlayPresent = NULL;
+static uint32_t overlayNumBlocks = 0;
+
+/*
+ * Changed-block tracking, on for as long as the sidecar file named after the image with ".changes"
+ * appended exists. The file is a ChangesHeader followed by a bitmap with one bit per block of the
+ * image, set once the block has been written since the checkpoint. A bit reaches the file before
+ * the block it marks reaches the image, so an incremental backup never misses a block.
+ */
+#define CHANGES_MAGIC                       0x47484336U
+
+typedef struct ChangesHeader {
+    // CHANGES_MAGIC.
+    uint32_t magic;
+    uint32_t blockSize;
+    // Blocks covered by the bitmap, the size of the file system.
+    uint32_t numBlocks;
+    char checkpoint[CHECKPOINT_NAME_SIZE];
+} ChangesHeader;
+
+static char *changesPath = NULL;
+static int changesFd = -1;
+static ChangesHeader changesHeader;
+static uint8_t *changedBlocks = NULL;
+
+/*
+ * A delta made by v6_export_delta is a DeltaHeader followed by numRuns records, each a DeltaRun
+ * followed by its blocks.
+ */
+#define DELTA_MAGIC                         0x4C454436U
+
+typedef struct DeltaHeader {
+    // DELTA_MAGIC.
+    uint32_t magic;
+    uint32_t blockSize;
+    uint32_t numBlocks;
+    uint32_t numRuns;
+    char checkpoint[CHECKPOINT_NAME_SIZE];
+} DeltaHeader;
+
+typedef struct DeltaRun {
+    uint32_t firstBlock;
+    uint32_t count;
+} DeltaRun;
+
+/*
+ * Scratch memory for the short lived allocations made while serving one call into the API: loaded
+ * i-nodes, tokenized paths and the like. Nothing drawn from it is freed on its own. It all goes at
+ * once when the outermost public function returns, keeping only the first chunk for the next call.
+ */
+static ScratchChunk *scratchChunks = NULL;
+// How many public functions are running, counting ones called from a v6_walk callback.
+static unsigned int scratchDepth = 0;
+
+/*
+ * How hard the file system works to get changes onto the disk, one of the DURABILITY_ values.
+ */
+static uint8_t durabilityMode = DURABILITY_NONE;
+static uint32_t durabilityIntervalMs = 0;
+// When the journal was last committed in DURABILITY_INTERVAL mode.
+static struct timespec durabilityLastCommit;
+
+/*
+ * The background flusher used by DURABILITY_INTERVAL. Writes are handed to the OS as soon as an
+ * operation finishes, and the flusher issues one fdatasync for all of them every interval. It only
+ * ever touches the file descriptor, never the stdio stream or the cache.
+ */
+static pthread_t flusherThread;
+static uint8_t flusherRunning = 0;
+static pthread_mutex_t flusherLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusherWake = PTHREAD_COND_INITIALIZER;
+static uint8_t flusherStopping = 0;
+static int flusherFd = -1;
+// Set when there are writes the flusher hasn't synced yet.
+static atomic_int flushPending = 0;
+// Set when a background fdatasync failed, until the next operation reports it.
+static atomic_int flushFailed = 0;
+// Set when an operation left the running journal transaction for a later commit.
+static atomic_int commitPending = 0;
+// Made readable by the flusher when a journal commit is due. See v6_durability_fd.
+static int flusherWakePipe[2] = { -1, -1 };
+
+/*
+ * Set by the warmup thread when it has finished reading, until the blocks are moved into the cache.
+ * The other states are the WARMUP_ values from v6fs.h.
+ */
+#define WARMUP_LOADED                       3
+
+/*
+ * Everything the warmup thread reads, kept to the side until the main thread moves it into the
+ * block cache. Owned by the warmup thread while warmupState is WARMUP_RUNNING.
+ */
+typedef struct WarmupJob {
+    int fd;
+    // For a clone, the base and a copy of the presence bitmap taken when the warmup started.
+    // Blocks written since then are skipped by warmupInstall anyway.
+    int baseFd;
+    uint8_t *overlayPresent;
+    uint16_t isize;
+    uint8_t allDirectories;
+    // Blocks waiting to go into the cache, most important first. Holds up to BLOCK_CACHE_SIZE.
+    uint32_t *blockNumbers;
+    uint8_t *blockData;
+    size_t numStaged;
+    uint32_t blocksRead;
+    uint32_t blocksCached;
+    struct timespec start;
+    double seconds;
+} WarmupJob;
+
+static pthread_t warmupThread;
+static atomic_int warmupState = WARMUP_NOT_STARTED;
+static WarmupJob warmupJob;
+// Blocks written while the warmup was running, one bit per block number.
+static uint64_t *warmupWrittenBlocks = NULL;
+static size_t warmupWrittenWords = 0;
+
+/*
+ * Free i-nodes that aren't in the superblock's i-node array, one bit per i-node number. Built in
+ * one pass over the i-node blocks when a file system is loaded, so refilling the array never has
+ * to read the i-node table again.
+ */
+static uint64_t *freeInodeMap = NULL;
+static size_t freeInodeMapWords = 0;
+// The word repopulateInodeList resumes from.
+static size_t freeInodeMapCursor = 0;
+
+/*
+ * One allocation group of an image made with v6_initfs_grouped: a run of data blocks and a slice
+ * of the i-node table. Only the block bitmap is kept on disk, the counts are rebuilt on load.
+ */
+typedef struct AllocationGroup {
+    uint32_t firstBlock;
+    uint32_t numBlocks;
+    uint32_t freeBlocks;
+    // Every block of the group below this one is in use.
+    uint32_t cursor;
+    uint16_t firstInode;
+    uint16_t numInodes;
+    uint16_t freeInodes;
+    uint16_t directories;
+} AllocationGroup;
+
+static AllocationGroup *allocationGroups = NULL;
+static uint16_t allocationGroupCount = 0;
+// The group v6_alloc looks in first. Set by allocateNear.
+static uint16_t allocationGroupHint = 0;
+
+/*
+ * The free block bitmap of a grouped image, one bit per block with the bit set for a free block.
+ * Laid out in memory exactly as it is on disk, in the blocks right after the i-node table, and
+ * written back along with the superblock.
+ */
+static uint64_t *blockBitmap = NULL;
+static uint32_t blockBitmapBlocks = 0;
+// One bit per bitmap block, set when it has changed since it was last written.
+static uint64_t *blockBitmapDirty = NULL;
+
+/*
+ * A fragmented file found by v6_defrag.
+ */
+typedef struct DefragCandidate {
+    uint16_t inodeNumber;
+    uint32_t numDataBlocks;
+    uint32_t numBreaks;
+    // The length of the free run it needs: its data blocks and indirect blocks.
+    uint32_t numBlocksNeeded;
+} DefragCandidate;
+
+// The i-node the next v6_defrag call starts from, when the last one stopped at its budget.
+static uint16_t defragNextInode = 1;
+
+/*
+ * How far a reader has got through a file, to tell sequential reads from random ones.
+ */
+typedef struct ReadaheadState {
+    // The block index a sequential reader would read next.
+    uint32_t nextIndex;
+    // Blocks before this index have already been read ahead.
+    uint32_t readaheadEnd;
+    // How many blocks the last readahead covered, 0 after a random read.
+    uint32_t window;
+} ReadaheadState;
+
+/*
+ * A file opened with v6_open. Holds its own copy of the file's i-node.
+ */
+struct V6File {
+    Superblock *sb;
+    // Set to 0 once the file's i-node is freed, since the number may then be reused.
+    uint16_t inodeNumber;
+    Inode inode;
+    ReadaheadState readahead;
+    struct V6File *nextOpen;
+};
+
+// Every open V6File, so freeing an i-node can cut off the handles still on it.
+static V6File *openFiles = NULL;
+
+/*
+ * A directory waiting to be listed by v6_walk.
+ */
+typedef struct WalkDirectory {
+    uint16_t inodeNumber;
+    char *path;
+} WalkDirectory;
 
-static uint16_t v6_alloc(Superblock *sb);
-static int8_t v6_free(Superblock *sb, uint16_t blockNumber);
-static int8_t v6_read_block(uint16_t blockNumber, void *data, size_t size);
-static int8_t v6_write_block(uint16_t blockNumber, void *data, size_t size);
+/*
+ * An open directory being listed by v6_readdir.
+ */
+struct V6Directory {
+    Superblock *sb;
+    uint16_t inodeNumber;
+    // The directory's blocks, in order. Indirect blocks are only read when the directory is opened.
+    BlockList blocks;
+    size_t blockIndex;
+    size_t entryIndex;
+};
+
+// The i-node number of every open V6Directory, once per handle. A listing walks the block list
+// it was opened with, so these directories are never compacted or defragmented.
+static BlockList openDirectories = { 0 };
+
+static Superblock * initFileSystem(uint8_t extended, uint32_t numBlocks, uint16_t numInodes, uint32_t blockSize,
+                                   uint16_t numGroups);
+static uint32_t v6_alloc(Superblock *sb);
+static int8_t v6_free(Superblock *sb, uint32_t blockNumber);
+static int8_t v6_read_block(uint32_t blockNumber, void *data);
+static int8_t v6_write_block(uint32_t blockNumber, void *data);
+static uint8_t* getCachedBlock(uint32_t blockNumber);
+static uint8_t* blockCacheLookup(uint32_t blockNumber);
+static uint8_t* blockCacheInsert(uint32_t blockNumber);
+static void blockCacheReset(void);
+static int8_t deviceReadBlock(uint32_t blockNumber, void *data);
+static int8_t deviceWriteBlock(uint32_t blockNumber, void *data);
+static int8_t deviceReadBlocks(uint32_t blockNumber, size_t count, void *data);
+static int8_t readBlocksInBlockOrder(BlockList *blocks, uint8_t *data);
+static int8_t deviceWriteBlocks(uint32_t blockNumber, size_t count, void *data);
+static void blockCacheInvalidate(uint32_t blockNumber);
+static int8_t overlayOpen(void);
+static void overlayClose(void);
+static uint8_t overlayHasBlock(const uint8_t *present, uint32_t blockNumber);
+static int8_t overlayReadBase(const uint8_t *present, int baseFd, uint32_t blockNumber, size_t count, void *data);
+static int8_t overlayMarkBlocks(uint32_t blockNumber, size_t count);
+static int8_t overlayFlatten(void);
+static int8_t changesOpen(void);
+static void changesClose(void);
+static int8_t changesReset(uint32_t numBlocks, const char *name, uint8_t allChanged);
+static int8_t changesNoteWrite(uint32_t blockNumber, size_t count);
+static int8_t deviceSync(void);
+static void *warmupMain(void *arg);
+static void warmupStageDirectory(WarmupJob *job, uint8_t *inodeTable, uint16_t inodeNumber);
+static int8_t warmupReadBlock(WarmupJob *job, uint32_t blockNumber, void *data);
+static void warmupInstall(void);
+static void warmupStop(void);
+static void warmupNoteWrite(uint32_t blockNumber);
+static void beginOperation(Superblock *sb);
+static int8_t endOperation(Superblock *sb);
+static void *flusherMain(void *arg);
+static void *scratchAlloc(size_t size);
+static void scratchEnter(void);
+static void scratchLeave(void);
+static void scratchRelease(void);
+static int8_t flusherStart(void);
+static void flusherStop(void);
+static int8_t journalAddBlock(uint32_t blockNumber, const void *data);
+static uint32_t *journalSlotFor(uint32_t blockNumber);
+static int8_t journalGrowSlots(void);
+static uint8_t *journalLookup(uint32_t blockNumber);
+static int8_t journalCommit(void);
+static int8_t journalCheckpoint(void);
+static int8_t journalReplay(void);
+static uint8_t journalPrepareDataWrite(uint32_t blockNumber);
+static void journalDiscard(void);
+static void journalClose(void);
+static uint32_t journalChecksum(const uint8_t *data, size_t length);
+static int8_t writeDataBlock(uint32_t blockNumber, void *data);
+static int8_t readBlockMap(Inode *inode, uint32_t *blockMap, size_t numBlocks);
+static int8_t readIndirectBlockMap(uint32_t blockNumber, uint8_t level, uint32_t *blockMap, size_t numBlocks);
+static size_t countIndirectBlocks(uint32_t *blockMap, size_t numBlocks);
+static size_t countIndirectBlocksBelow(uint32_t *blockMap, size_t numBlocks, uint8_t level);
+static uint8_t blockMapRangeIsEmpty(uint32_t *blockMap, size_t numBlocks);
+static int8_t writeBlockMap(Inode *inode, uint32_t *blockMap, size_t numBlocks, uint32_t *indirectBlocks);
+static int8_t writeIndirectBlockMap(uint32_t *blockMap, size_t numBlocks, uint8_t level, uint32_t *indirectBlocks,
+                                    size_t *nextIndirectBlock, uint32_t *blockNumber);
+static int8_t copyBlockRuns(uint32_t *sourceMap, uint32_t *destinationMap, size_t numBlocks);
+static int8_t copyBlocksInKernel(uint32_t sourceBlockNumber, uint32_t destinationBlockNumber, size_t count);
+static int8_t loadEntryAttributes(Superblock *sb, V6DirectoryEntry *entries, size_t numEntries);
 static uint16_t createFile(Superblock *sb, char *filePath, uint16_t fileType);
+static int8_t copyFileIn(Superblock *sb, char *externalFilePath, char *v6FilePath);
+static int8_t copyFileOut(Superblock *sb, char *v6FilePath, char *externalFilePath);
+static int8_t copyFile(Superblock *sb, char *v6SourcePath, char *v6DestinationPath);
+static int8_t moveFile(Superblock *sb, char *v6SourcePath, char *v6DestinationPath);
+static int8_t writeFileRange(V6File *file, const void *buffer, size_t count, uint32_t offset, size_t *bytesWritten);
+static int8_t fileReloadInode(V6File *file);
 static uint16_t createDirectory(Superblock *sb, char *directoryPath);
 static uint16_t getTerminalInodeNumber(Superblock *sb, char *filename);
+static uint16_t lookupPathTokens(Superblock *sb, char **filePathTokens, size_t numTokens);
+static uint8_t directoryIsAncestor(Superblock *sb, uint16_t ancestorNumber, uint16_t directoryNumber);
 static Inode* inodeLoad(Superblock *sb, uint16_t inodeNumber);
 static int8_t inodeSave(Superblock *sb, uint16_t inodeNumber, Inode *inode);
-static uint16_t getNewInodeNumber(Superblock *sb);
-static int8_t inodeFree(Superblock *sb, uint16_t inodeNumber);
+static uint16_t getNewInodeNumber(Superblock *sb, uint16_t parentNumber, uint16_t fileType);
 static void inodeInit(Inode *inode);
 static int8_t repopulateInodeList(Superblock *sb);
-static int8_t addAllocatedBlockToInode(Superblock *sb, Inode *inode, uint16_t numBytes, uint16_t blockNumber);
+static int8_t freeInodeMapBuild(Superblock *sb);
+static void freeInodeMapAdd(uint16_t inodeNumber);
+static int8_t addAllocatedBlockToInode(Superblock *sb, Inode *inode, uint16_t numBytes, uint32_t blockNumber);
 static int8_t convertInodeToLargeFile(Superblock *sb, Inode *inode);
-static uint16_t getNextAllocatedBlockNumber(Inode *inode);
+static int8_t mapBlockAtIndex(Superblock *sb, Inode *inode, uint32_t index, uint32_t blockNumber);
+static int8_t writeFileBlock(V6File *file, uint32_t blockIndex, size_t offsetInBlock,
+                             const uint8_t *data, size_t length, uint32_t fileSize);
+static int8_t extendFileSize(Superblock *sb, Inode *inode, uint32_t fileSize);
+static inline uint8_t blockIsZeroSized(const uint8_t *data, size_t size);
+static uint8_t blockIsZero512(const uint8_t *data);
+static uint8_t blockIsZero1024(const uint8_t *data);
+static uint8_t blockIsZero2048(const uint8_t *data);
+static uint8_t blockIsZero4096(const uint8_t *data);
+static uint32_t getNextAllocatedBlockNumber(Inode *inode);
 static int8_t addDirectoryEntry(Superblock *sb, Inode *inode, char *filename, uint16_t inodeNumber);
 static int8_t removeDirectoryEntry(Inode *inode, char *filename);
+static int8_t compactDirectory(Superblock *sb, uint16_t inodeNumber, Inode *inode, uint8_t minPercentFreed,
+                               V6CompactReport *report);
+static int8_t compactDirectories(Superblock *sb, char *v6DirectoryPath, V6CompactReport *report);
+static int8_t writeBlockIfChanged(uint32_t blockNumber, void *data);
 static uint16_t findDirectoryEntry(Inode *inode, char *filename);
-static uint16_t getBlockNumberAtIndex(Inode *inode, uint16_t index);
-static int8_t setBlockNumberAtIndex(Superblock *sb, Inode *inode, uint16_t blockNumber, uint16_t index);
-static uint16_t getSinglyIndirectBlockNumberAtIndex(Inode *inode, uint16_t index);
-static void convertBytesToSuperblock(uint8_t *data, Superblock *sb);
-static void convertSuperblockToBytes(Superblock* sb, uint8_t *data);
-static void convertBytesToInode(uint8_t *data, Inode *inode);
-static void convertInodeToBytes(Inode *inode, uint8_t *data);
+static void makeDirectoryEntryKey(const char *filename, DirectoryEntryKey *key);
+static inline int findEntryInBlockSized(const uint8_t *blockData, const DirectoryEntryKey *key, int numEntries);
+static int findEntryInBlock512(const uint8_t *blockData, const DirectoryEntryKey *key);
+static int findEntryInBlock1024(const uint8_t *blockData, const DirectoryEntryKey *key);
+static int findEntryInBlock2048(const uint8_t *blockData, const DirectoryEntryKey *key);
+static int findEntryInBlock4096(const uint8_t *blockData, const DirectoryEntryKey *key);
+static int findEntryInBlockScalar(const uint8_t *blockData, const DirectoryEntryKey *key, int numEntries);
+static int findEntryInBlockStrncmp(const uint8_t *blockData, const char *filename);
+static uint8_t findAddressSlot(uint32_t index, size_t *addrIndex, uint32_t *indexInSlot);
+static uint32_t getBlockNumberAtIndex(Inode *inode, uint32_t index);
+static void readaheadNote(Inode *inode, ReadaheadState *state, uint32_t blockIndex);
+static void readaheadBlocks(Inode *inode, uint32_t firstIndex, uint32_t endIndex);
+static int8_t setBlockNumberAtIndex(Superblock *sb, Inode *inode, uint32_t blockNumber, uint32_t index);
+static uint32_t getBlockAddressAt(const uint8_t *blockData, size_t entry);
+static void setBlockAddressAt(uint8_t *blockData, size_t entry, uint32_t blockNumber);
+static void imageFormatProbe(int fd, uint8_t *extended, uint32_t *blockSize);
+static void imageFormatInit(uint8_t extended, uint32_t blockSize);
+static void superblockFromDisk(const uint8_t *blockData, Superblock *sb);
+static void superblockToDisk(Superblock *sb, uint8_t *blockData);
+static void extendedSuperblockFromDisk(const uint8_t *blockData, Superblock *sb);
+static void extendedSuperblockToDisk(Superblock *sb, uint8_t *blockData);
+static void reclaimListCheck(Superblock *sb);
+static void inodeFromDisk(const uint8_t *diskInode, Inode *inode);
+static void inodeToDisk(Inode *inode, uint8_t *diskInode);
+static void extendedInodeFromDisk(const uint8_t *diskInode, Inode *inode);
+static void extendedInodeToDisk(Inode *inode, uint8_t *diskInode);
+static void readAddresses16(const uint8_t *blockData, size_t first, uint32_t *addresses, size_t count);
+static void writeAddresses16(uint8_t *blockData, size_t first, const uint32_t *addresses, size_t count);
+static void readAddresses32(const uint8_t *blockData, size_t first, uint32_t *addresses, size_t count);
+static void writeAddresses32(uint8_t *blockData, size_t first, const uint32_t *addresses, size_t count);
+static uint32_t getInodeBlockNumber(uint16_t inodeNumber);
+static uint8_t *getInodeInBlock(uint8_t *blockData, uint16_t inodeNumber);
+static uint32_t getNumInodes(Superblock *sb);
 static uint16_t inodeIsDirectory(Inode *inode);
 static uint16_t inodeIsLargeFile(Inode *inode);
-static size_t getBlockAddress(uint16_t blockNumber);
+static size_t getBlockAddress(uint32_t blockNumber);
 static uint32_t getFileSize(Inode *inode);
 static void setFileSize(Inode *inode, uint32_t fileSize);
 static char** tokenizeFilePath(char *filePath, size_t *numPathItems);
+static int8_t superblockWrite(Superblock *sb);
+static int8_t superblockSave(Superblock *sb);
+static int8_t queueInodeForReclaim(Superblock *sb, uint16_t inodeNumber);
+static int8_t reclaimPendingInodes(Superblock *sb);
+static int8_t collectInodeBlocks(Inode *inode, BlockList *contentBlocks, BlockList *indirectBlocks);
+static int8_t collectIndirectBlocks(uint32_t blockNumber, uint8_t level, BlockList *contentBlocks,
+                                    BlockList *indirectBlocks);
+static int8_t collectReclaimableBlocks(Superblock *sb, uint16_t inodeNumber, BlockList *dataBlocks,
+                                       BlockList *metadataBlocks, BlockList *inodeNumbers);
+static int8_t removeFile(Superblock *sb, char *filePath, uint8_t recursive);
+static int8_t directoryIsEmpty(Inode *inode);
+static uint8_t directoryIsOpen(uint16_t inodeNumber);
+static int8_t freeBlockBatch(Superblock *sb, BlockList *dataBlocks, BlockList *metadataBlocks);
+static int8_t freeBlockList(Superblock *sb, BlockList *blocks);
+static int8_t clearInodes(Superblock *sb, uint32_t *inodeNumbers, size_t numInodes);
+static int8_t blockListAppend(BlockList *list, uint32_t blockNumber);
+static int compareUint32(const void *a, const void *b);
+static int compareUint64(const void *a, const void *b);
+static int8_t defragImage(Superblock *sb, uint32_t maxBlocks, uint32_t pauseMs, V6DefragCallback callback,
+                          void *userData, V6DefragReport *report);
+static int8_t defragMoveFile(Superblock *sb, uint16_t inodeNumber, uint32_t runStart, uint64_t *freeMap,
+                             uint32_t *numBreaks);
+static uint32_t countBlockMapBreaks(const uint32_t *blockMap, size_t numBlocks, uint32_t *numDataBlocks);
+static int8_t freeMapBuild(Superblock *sb, uint64_t *freeMap);
+static uint32_t freeMapFindRun(Superblock *sb, const uint64_t *freeMap, uint32_t length, uint32_t startBlock);
+static int8_t freeListRebuild(Superblock *sb, const uint64_t *freeMap);
+static int8_t allocationGroupsInit(Superblock *sb, uint8_t newImage);
+static void allocationGroupsCount(void);
+static uint32_t getFirstDataBlock(Superblock *sb);
+static uint16_t getInodeGroup(uint16_t inodeNumber);
+static uint16_t getBlockGroup(uint32_t blockNumber);
+static void allocateNear(uint16_t inodeNumber);
+static uint32_t allocateGroupBlock(Superblock *sb);
+static int8_t freeGroupBlock(Superblock *sb, uint32_t blockNumber);
+static uint16_t allocateGroupInode(uint16_t group);
+static uint16_t chooseDirectoryGroup(void);
+static void blockBitmapMarkDirty(uint32_t blockNumber);
+static int8_t blockBitmapWrite(Superblock *sb);
+static int8_t measureLocality(Superblock *sb, char *v6Path, V6LocalityReport *report);
+static void localityRead(uint32_t blockNumber, uint32_t *lastBlock, V6LocalityReport *report);
+
+/*
+ * The format of the loaded image.
+ */
+static ImageFormat imageFormat;
 
 
 Superblock * v6_loadfs(char *v6FileSystemName) {
     Superblock *sb;
     size_t sbSize = sizeof(Superblock);
-    // Array to store raw superblock data before it is assigned.
-    uint8_t sbBytes[BLOCK_SIZE];
-    int8_t blockReadSuccess;
-
+    uint8_t *sbBytes;
+    uint8_t extended;
+    uint32_t blockSize;
+
+    warmupStop();
+    flusherStop();
+    durabilityMode = DURABILITY_NONE;
+    journalClose();
+    overlayClose();
+    changesClose();
     v6FileSystem = fopen(v6FileSystemName, "r+b");
+    blockCacheReset();
+    defragNextInode = 1;
 
     if (v6FileSystem == NULL) {
         v6FileSystem = fopen(v6FileSystemName, "w+b");
@@ -58,51 +777,165 @@ Superblock * v6_loadfs(char *v6FileSystemName) {
         }
     }
 
-    blockReadSuccess = v6_read_block(1, sbBytes, 1);
+    // A clone reads through to its base from the first block on.
+    if (overlayOpen() != 0) {
+        return NULL;
+    }
+
+    // Everything that depends on the format is settled here, once. Replaying the journal already
+    // needs the block size.
+    imageFormatProbe(overlayBaseFd >= 0 ? overlayBaseFd : fileno(v6FileSystem), &extended, &blockSize);
+    imageFormatInit(extended, blockSize);
+
+    free(journalPath);
+    journalPath = malloc(strlen(v6FileSystemName) + sizeof(".journal"));
+    if (journalPath != NULL) {
+        strcpy(journalPath, v6FileSystemName);
+        strcat(journalPath, ".journal");
+        journalFd = open(journalPath, O_RDWR);
+    }
+
+    // Replaying the journal writes blocks too, so the bitmap has to be loaded first.
+    free(changesPath);
+    changesPath = malloc(strlen(v6FileSystemName) + sizeof(".changes"));
+    if (changesPath == NULL) {
+        return NULL;
+    }
+    strcpy(changesPath, v6FileSystemName);
+    strcat(changesPath, ".changes");
+    if (changesOpen() != 0) {
+        return NULL;
+    }
+
+    // Bring the image up to date with whatever was committed before the last session ended.
+    if (journalFd >= 0 && journalReplay() != 0) {
+        journalClose();
+        return NULL;
+    }
+
+    // Read straight out of the cached block.
+    sbBytes = getCachedBlock(1);
 
-    if (blockReadSuccess != 0) {
+    if (sbBytes == NULL) {
         return NULL;
     }
 
     // Allocate sb and set values.
     sb = malloc(sbSize);
 
-    convertBytesToSuperblock(sbBytes, sb);
+    imageFormat.superblockFromDisk(sbBytes, sb);
+    // Whatever an older image left here, the copy in memory now matches the one on disk.
+    sb->fmod = 0;
+
+    if (journalFd >= 0) {
+        journalSb = sb;
+        journalCapturing = 1;
+    }
+
+    // The groups have to be laid out before the i-node map can count their free i-nodes.
+    if (allocationGroupsInit(sb, 0) != 0 || freeInodeMapBuild(sb) != 0) {
+        free(sb);
+        return NULL;
+    }
+
+    // Finish reclaiming any i-nodes that were removed before the last session ended.
+    if (sb->nreclaim > 0) {
+        scratchEnter();
+        reclaimPendingInodes(sb);
+        scratchLeave();
+    }
 
     return sb;
 }
 
 Superblock * v6_initfs(uint16_t numBlocks, uint16_t numInodes) {
+    return initFileSystem(0, numBlocks, numInodes, BLOCK_SIZE, 0);
+}
+
+Superblock * v6_initfs_extended(uint32_t numBlocks, uint16_t numInodes, uint32_t blockSize) {
+    return initFileSystem(1, numBlocks, numInodes, blockSize, 0);
+}
+
+Superblock * v6_initfs_grouped(uint8_t extended, uint32_t numBlocks, uint16_t numInodes, uint32_t blockSize,
+                               uint16_t numGroups) {
+    if (numGroups == 0 || numGroups > numInodes) {
+        return NULL;
+    }
+    return initFileSystem(extended != 0, numBlocks, numInodes, blockSize, numGroups);
+}
+
+static Superblock * initFileSystem(uint8_t extended, uint32_t numBlocks, uint16_t numInodes, uint32_t blockSize,
+                                   uint16_t numGroups) {
     Superblock *sb;
-    uint8_t block[BLOCK_SIZE] = { 0 };
+    uint8_t block[MAX_BLOCK_SIZE] = { 0 };
+    Inode rootInode;
     // The number of blocks required to hold the designated number of inodes.
-    uint16_t numInodeBlocks;
+    uint32_t numInodeBlocks;
     // Total number of data blocks, including those that will be used for free list blocks.
-    uint16_t totalDataBlocks;
-    uint16_t numFreeListBlocks, numFreeBlocks;
-    uint16_t firstDataBlockNumber, firstFreeBlockNumber;
+    uint32_t totalDataBlocks;
+    uint32_t numFreeListBlocks, numFreeBlocks;
+    uint32_t firstDataBlockNumber, firstFreeBlockNumber;
 
     if (v6FileSystem == NULL) {
         return NULL;
     }
 
-    for (size_t i = 0; i < numBlocks; i++) {
-        // Write empty blocks to extend the size of the file.
-        v6_write_block((uint16_t) i, block, 1);
+    // A power of two in range. V6 images only come in one block size.
+    if (blockSize < MIN_BLOCK_SIZE || blockSize > MAX_BLOCK_SIZE || (blockSize & (blockSize - 1)) != 0
+        || (extended == 0 && blockSize != BLOCK_SIZE)) {
+        return NULL;
+    }
+
+    // Every group needs at least one data block, after the i-node table and the block bitmap.
+    if (numGroups > 0) {
+        uint32_t inodesPerBlock = blockSize / (extended ? sizeof(DiskExtendedInode) : sizeof(DiskInode));
+        uint64_t numMetadataBlocks = 2 + (numInodes + inodesPerBlock - 1) / inodesPerBlock
+                                     + (numBlocks + blockSize * 8ULL - 1) / (blockSize * 8ULL);
+
+        if ((extended == 0 && numBlocks > 65535) || numMetadataBlocks + numGroups > numBlocks) {
+            return NULL;
+        }
+    }
+
+    warmupStop();
+    blockCacheReset();
+    imageFormatInit(extended, blockSize);
+    defragNextInode = 1;
+
+    // The new file system is written in place. Anything still journaled belongs to the old one.
+    journalDiscard();
+    journalCapturing = 0;
+    if (journalFd >= 0 && ftruncate(journalFd, 0) != 0) {
+        return NULL;
+    }
+
+    // Nothing of the base is wanted any more, so a clone becomes a plain image.
+    overlayClose();
+
+    // Every block of the new file system differs from what the checkpoint saw.
+    if (changesFd >= 0 && changesReset(numBlocks, changesHeader.checkpoint, 1) != 0) {
+        return NULL;
+    }
+
+    // Size the file in one go rather than writing every block. Truncating it to nothing first
+    // zeroes whatever an old file system left behind, and the blocks stay holes until written.
+    if (fflush(v6FileSystem) != 0 || ftruncate(fileno(v6FileSystem), 0) != 0
+        || ftruncate(fileno(v6FileSystem), (off_t) getBlockAddress(numBlocks)) != 0) {
+        return NULL;
     }
 
-    if (numInodes % 16 == 0) {
-        numInodeBlocks = numInodes / 16;
+    if (numInodes % imageFormat.inodesPerBlock == 0) {
+        numInodeBlocks = numInodes / imageFormat.inodesPerBlock;
     }
     else {
-        numInodeBlocks = numInodes / 16 + 1;
+        numInodeBlocks = numInodes / imageFormat.inodesPerBlock + 1;
     }
 
     // TODO: Decide which of these you need.
     // Add two to numInodeBlocks to account for 0 and 1 block which are reserved.
     totalDataBlocks = numBlocks - (numInodeBlocks + 2);
     // +1 comes from the free array which removes one block from needing to be used for the free list.
-    numFreeBlocks = (99 * totalDataBlocks) / 100 + 1;
+    numFreeBlocks = (uint32_t) ((99ULL * totalDataBlocks) / 100 + 1);
     // Blocks initially allocated for the free list.
     numFreeListBlocks = totalDataBlocks - numFreeBlocks;
     // First block following blocks 0, 1 and i-node blocks.
@@ -112,56 +945,96 @@ Superblock * v6_initfs(uint16_t numBlocks, uint16_t numInodes) {
 
     // Create Superblock
     sb = malloc(sizeof(Superblock));
-    sb->isize = numInodeBlocks;
+    sb->isize = (uint16_t) numInodeBlocks;
     sb->fsize = numBlocks;
     sb->nfree = 1;
     // Set the pointer to the previous free list block to zero. There are no others prior to this one.
     sb->free[0] = 0;
     sb->ninode = 0;
+    sb->nreclaim = 0;
+    sb->flock = 0;
+    sb->ilock = 0;
+    sb->ngroups = numGroups;
+    // Nothing of the new superblock is on disk yet.
+    sb->fmod = 1;
 
     // TODO: set time?
 
-    // Create free list
-    for (size_t blockNum = firstDataBlockNumber; blockNum < numBlocks; blockNum++) {
-        v6_free(sb, (uint16_t) blockNum);
-    }
+    if (numGroups > 0) {
+        // The block bitmap stands in for the free list.
+        sb->nfree = 0;
+        memset(sb->free, 0, sizeof(sb->free));
+        if (allocationGroupsInit(sb, 1) != 0) {
+            free(sb);
+            return NULL;
+        }
+    } else {
+        // Only drops the groups of the last image.
+        allocationGroupsInit(sb, 1);
 
-    // Create i-nodes (going to fill blocks allocated for i-nodes completely,
-    // no matter what the number specified was)
-    Inode inodes[16];
-    for (size_t i = 0; i < 16; i++) {
-        inodeInit(&inodes[i]);
+        // Create free list
+        for (uint32_t blockNum = firstDataBlockNumber; blockNum < numBlocks; blockNum++) {
+            v6_free(sb, blockNum);
+        }
     }
-    inodes[0].flags = FLAG_INODE_ALLOCATED | FILE_TYPE_DIRECTORY | FLAG_OWNER_PERMISSIONS
+
+    // Create i-nodes. The truncate left the whole table zero, which is a free i-node in either
+    // format, so only the root directory's block has to be written.
+    inodeInit(&rootInode);
+    rootInode.flags = FLAG_INODE_ALLOCATED | FILE_TYPE_DIRECTORY | FLAG_OWNER_PERMISSIONS
                       | FLAG_GROUP_READ | FLAG_GROUP_EXECUTE | FLAG_OTHER_READ | FLAG_OTHER_EXECUTE;
-    v6_write_block(2, inodes, 32);
-    // Reset inode so all nodes in this group are cleared for setup of all other inode blocks
-    inodeInit(&inodes[0]);
+    imageFormat.inodeToDisk(&rootInode, getInodeInBlock(block, 1));
+    v6_write_block(2, block);
 
-    // Write remaining blocks in a loop
-    for (size_t blockNum = 3; blockNum < numInodeBlocks + 2; blockNum++) {
-        v6_write_block((uint16_t) blockNum, inodes, 32);
+    if (freeInodeMapBuild(sb) != 0) {
+        free(sb);
+        return NULL;
+    }
+    if (numGroups == 0) {
+        repopulateInodeList(sb);
     }
 
-    repopulateInodeList(sb);
+    if (journalFd >= 0) {
+        // The journal takes over from here, so the new file system has to be on disk first.
+        if (deviceSync() != 0) {
+            free(sb);
+            return NULL;
+        }
+        journalSb = sb;
+        journalCapturing = 1;
+    }
 
     // Init root i-node
+    scratchEnter();
     Inode *inode = inodeLoad(sb, 1);
 
     addDirectoryEntry(sb, inode, ".", 1);
     addDirectoryEntry(sb, inode, "..", 1);
 
     inodeSave(sb, 1, inode);
+    scratchLeave();
 
     return sb;
 }
 
 int8_t v6_cpin(Superblock *sb, char *externalFilePath, char *v6FilePath) {
+    int8_t result;
+
+    beginOperation(sb);
+    result = copyFileIn(sb, externalFilePath, v6FilePath);
+
+    return endOperation(sb) == 0 ? result : E_BLOCK_WRITE_FAILURE;
+}
+
+static int8_t copyFileIn(Superblock *sb, char *externalFilePath, char *v6FilePath) {
     FILE *f = fopen(externalFilePath, "rb");
     Inode *inode;
     uint16_t inodeNumber;
-    uint16_t blockNumber;
-    uint8_t data[BLOCK_SIZE] = { 0 };
+    uint32_t blockNumber;
+    uint32_t blockIndex = 0;
+    uint32_t fileSize = 0;
+    uint8_t data[MAX_BLOCK_SIZE] = { 0 };
+    int8_t result = 0;
 
     if (f == NULL) {
         return E_FILE_OPEN_FAILURE;
@@ -170,31 +1043,82 @@ int8_t v6_cpin(Superblock *sb, char *externalFilePath, char *v6FilePath) {
     // Create i-node for the new file and any new directory i-nodes leading
     // up to the file location.
     inodeNumber = createFile(sb, v6FilePath, FILE_TYPE_PLAIN_FILE);
+
+    if (inodeNumber == 0) {
+        fclose(f);
+        return E_FILE_ALREADY_EXISTS;
+    }
+
     inode = inodeLoad(sb, inodeNumber);
+    allocateNear(inodeNumber);
+
+    // Allocate blocks and add to i-node sequentially from external file.
+    // Blocks of all zeros are left as holes, which read back as zeros.
+    while (feof(f) == 0 && result == 0) {
+        size_t numBytes = fread(data, 1, imageFormat.blockSize, f);
+        if (numBytes == 0) {
+            break;
+        }
+        if (fileSize + numBytes > imageFormat.maxFileSize) {
+            result = E_INVALID_INDEX;
+            break;
+        }
+        // Don't carry the previous block's bytes into the tail of a short last block.
+        memset(&data[numBytes], 0, imageFormat.blockSize - numBytes);
 
-    // Allocate blocks and add to i-node sequentially from external file
-    while (feof(f) == 0) {
-        blockNumber = v6_alloc(sb);
-        if (blockNumber == 0) {
-            return E_ALLOCATE_FAILURE;
+        if (imageFormat.blockIsZero(data) == 0) {
+            blockNumber = v6_alloc(sb);
+            if (blockNumber == 0) {
+                result = E_ALLOCATE_FAILURE;
+                break;
+            }
+            result = writeDataBlock(blockNumber, data);
+            if (result == 0) {
+                result = mapBlockAtIndex(sb, inode, blockIndex, blockNumber);
+            }
+            if (result != 0 && getBlockNumberAtIndex(inode, blockIndex) != blockNumber) {
+                v6_free(sb, blockNumber);
+                break;
+            }
         }
-        size_t numBytes = fread(data, 1, BLOCK_SIZE, f);
-        v6_write_block(blockNumber, data, 1);
-        addAllocatedBlockToInode(sb, inode, (uint16_t) numBytes, blockNumber);
+
+        fileSize += (uint32_t) numBytes;
+        blockIndex++;
+    }
+
+    // After a failure the file keeps what was copied, so its size covers every block it maps.
+    if (result == 0) {
+        result = extendFileSize(sb, inode, fileSize);
+    } else {
+        extendFileSize(sb, inode, fileSize);
     }
 
     inodeSave(sb, inodeNumber, inode);
+    fclose(f);
 
-    return 0;
+    return result;
 }
 
 int8_t v6_cpout(Superblock *sb, char *v6FilePath, char *externalFilePath) {
+    int8_t result;
+
+    scratchEnter();
+    result = copyFileOut(sb, v6FilePath, externalFilePath);
+    scratchLeave();
+
+    return result;
+}
+
+static int8_t copyFileOut(Superblock *sb, char *v6FilePath, char *externalFilePath) {
     FILE *f;
     Inode *inode;
     uint16_t inodeNumber;
+    uint32_t fileSize;
     uint32_t remainingBytes;
-    uint16_t blockNumber;
-    uint8_t data[BLOCK_SIZE] = { 0 };
+    uint32_t blockNumber;
+    uint32_t blockIndex = 0;
+    uint8_t data[MAX_BLOCK_SIZE] = { 0 };
+    ReadaheadState readahead = { 0 };
 
     inodeNumber = getTerminalInodeNumber(sb, v6FilePath);
 
@@ -207,23 +1131,36 @@ int8_t v6_cpout(Superblock *sb, char *v6FilePath, char *externalFilePath) {
     f = fopen(externalFilePath, "wb");
 
     if (f == NULL) {
-        free(inode);
         return E_FILE_OPEN_FAILURE;
     }
 
-    remainingBytes = getFileSize(inode);
-    blockNumber = getNextAllocatedBlockNumber(inode);
+    fileSize = getFileSize(inode);
+    remainingBytes = fileSize;
 
+    // Blocks are read by index rather than with getNextAllocatedBlockNumber, which skips holes.
     while (remainingBytes > 0) {
-        v6_read_block(blockNumber, data, 1);
-        if (remainingBytes >= 512) {
-            fwrite(data, 1, BLOCK_SIZE, f);
-            remainingBytes -= 512;
+        size_t numBytes = remainingBytes < imageFormat.blockSize ? remainingBytes : imageFormat.blockSize;
+
+        readaheadNote(inode, &readahead, blockIndex);
+        blockNumber = getBlockNumberAtIndex(inode, blockIndex);
+        if (blockNumber == 0) {
+            // Seek over holes so the external file can stay sparse too.
+            fseek(f, (long) numBytes, SEEK_CUR);
+        } else if (blockNumber == BLOCK_NUMBER_UNREADABLE || v6_read_block(blockNumber, data) != 0) {
+            fclose(f);
+            return E_BLOCK_READ_FAILURE;
         } else {
-            fwrite(data, 1, remainingBytes, f);
-            remainingBytes = 0;
+            fwrite(data, 1, numBytes, f);
         }
-        blockNumber = getNextAllocatedBlockNumber(NULL);
+        remainingBytes -= (uint32_t) numBytes;
+        blockIndex++;
+    }
+
+    // A hole at the end is only a seek, so the file has to be extended to its full size.
+    fflush(f);
+    if (ftruncate(fileno(f), (off_t) fileSize) != 0) {
+        fclose(f);
+        return E_BLOCK_WRITE_FAILURE;
     }
 
     fclose(f);
@@ -234,8 +1171,13 @@ int8_t v6_cpout(Superblock *sb, char *v6FilePath, char *externalFilePath) {
 int8_t v6_mkdir(Superblock *sb, char *v6DirectoryPath) {
     uint16_t inodeNumber;
 
+    beginOperation(sb);
+
     inodeNumber = createFile(sb, v6DirectoryPath, FILE_TYPE_DIRECTORY);
 
+    if (endOperation(sb) != 0) {
+        return E_BLOCK_WRITE_FAILURE;
+    }
     if (inodeNumber == 0) {
         return -1;
     }
@@ -243,926 +1185,6522 @@ int8_t v6_mkdir(Superblock *sb, char *v6DirectoryPath) {
 }
 
 int8_t v6_rm(Superblock *sb, char *v6FilePath) {
-    char **filePathTokens;
-    size_t numTokens = 0;
-    Inode *previousInode = inodeLoad(sb, 1);
-    Inode *inode = NULL;
-    uint16_t inodeNumber = 0, previousInodeNumber = 1;
-    uint16_t createdLastLoop = 0;
+    int8_t result;
 
-    filePathTokens = tokenizeFilePath(v6FilePath, &numTokens);
+    beginOperation(sb);
+    result = removeFile(sb, v6FilePath, 0);
 
-    for (size_t i = 0; i < numTokens - 1; i++) {
-        inodeNumber = findDirectoryEntry(previousInode, filePathTokens[i]);
-        if (inodeNumber == 0) {
-            if (inode != NULL) {
-                free(inode);
-            }
-            free(previousInode);
-            return E_NO_SUCH_FILE;
-        }
+    return endOperation(sb) == 0 ? result : E_BLOCK_WRITE_FAILURE;
+}
 
-        inode = inodeLoad(sb, inodeNumber);
+int8_t v6_rm_recursive(Superblock *sb, char *v6Path) {
+    int8_t result;
 
-        free(previousInode);
-        previousInode = inode;
-        previousInodeNumber = inodeNumber;
-    }
+    beginOperation(sb);
+    result = removeFile(sb, v6Path, 1);
 
-    inodeNumber = findDirectoryEntry(previousInode, filePathTokens[numTokens - 1]);
+    return endOperation(sb) == 0 ? result : E_BLOCK_WRITE_FAILURE;
+}
 
-    if (inodeNumber == 0) {
-        free(previousInode);
-        free(inode);
+int8_t v6_cp(Superblock *sb, char *v6SourcePath, char *v6DestinationPath) {
+    int8_t result;
+
+    beginOperation(sb);
+    result = copyFile(sb, v6SourcePath, v6DestinationPath);
+
+    return endOperation(sb) == 0 ? result : E_BLOCK_WRITE_FAILURE;
+}
 
+static int8_t copyFile(Superblock *sb, char *v6SourcePath, char *v6DestinationPath) {
+    Inode *sourceInode, *destinationInode;
+    uint16_t sourceInodeNumber, destinationInodeNumber = 0;
+    uint32_t *sourceMap = NULL, *destinationMap = NULL, *reserved = NULL;
+    size_t numBlocks, numDataBlocks = 0, numIndirectBlocks, numReserved = 0;
+    uint32_t fileSize;
+    char *destinationPathCopy;
+    int8_t result = 0;
+
+    sourceInodeNumber = getTerminalInodeNumber(sb, v6SourcePath);
+    if (sourceInodeNumber == 0) {
         return E_NO_SUCH_FILE;
-    } else {
-        removeDirectoryEntry(previousInode, filePathTokens[numTokens - 1]);
-        inodeFree(sb, inodeNumber);
+    }
 
-        return 0;
+    sourceInode = inodeLoad(sb, sourceInodeNumber);
+    if (inodeIsDirectory(sourceInode)) {
+        return E_INVALID_PATH;
     }
-}
 
-int8_t v6_quit(Superblock *sb) {
-    uint8_t superblockData[512];
-    int8_t writeSuccess;
+    fileSize = getFileSize(sourceInode);
+    numBlocks = (fileSize + imageFormat.blockSize - 1) / imageFormat.blockSize;
 
-    convertSuperblockToBytes(sb, superblockData);
+    sourceMap = calloc(numBlocks + 1, sizeof(uint32_t));
+    destinationMap = calloc(numBlocks + 1, sizeof(uint32_t));
+    // createFile tokenizes the path in place, and we may need it again to undo the create.
+    destinationPathCopy = malloc(strlen(v6DestinationPath) + 1);
 
-    writeSuccess = v6_write_block(1, superblockData, 1);
+    if (sourceMap == NULL || destinationMap == NULL || destinationPathCopy == NULL) {
+        result = E_ALLOCATE_FAILURE;
+    } else {
+        strcpy(destinationPathCopy, v6DestinationPath);
+        result = readBlockMap(sourceInode, sourceMap, numBlocks);
+    }
 
-    if (writeSuccess != 0) {
-        return writeSuccess;
+    if (result == 0) {
+        destinationInodeNumber = createFile(sb, v6DestinationPath, FILE_TYPE_PLAIN_FILE);
+        if (destinationInodeNumber == 0) {
+            result = E_FILE_ALREADY_EXISTS;
+        }
     }
 
-    fclose(v6FileSystem);
-    return 0;
-}
+    if (result == 0) {
+        // Holes in the source stay holes in the copy.
+        for (size_t i = 0; i < numBlocks; i++) {
+            if (sourceMap[i] != 0) {
+                destinationMap[i] = 1;
+                numDataBlocks++;
+            }
+        }
+        numIndirectBlocks = countIndirectBlocks(destinationMap, numBlocks);
+        allocateNear(destinationInodeNumber);
 
-/*
- * Allocates a new block number where the v6 file system can write.
- *
- * Returns 0 if a block could not be allocated.
- */
-static uint16_t v6_alloc(Superblock *sb) {
-    uint16_t freeBlockNumber;
-    // Stores data read from the next free list block.
-    // Shouldn't be allocated unless we need it.
-    uint16_t *blockData;
-    int8_t blockReadSuccess;
+        reserved = calloc(numDataBlocks + numIndirectBlocks + 1, sizeof(uint32_t));
+        if (reserved == NULL) {
+            result = E_ALLOCATE_FAILURE;
+        }
 
-    sb->nfree--;
-    freeBlockNumber = sb->free[sb->nfree];
+        // Reserve every block up front. Sorting turns the LIFO free list order back into runs.
+        while (result == 0 && numReserved < numDataBlocks + numIndirectBlocks) {
+            reserved[numReserved] = v6_alloc(sb);
+            if (reserved[numReserved] == 0) {
+                result = E_ALLOCATE_FAILURE;
+                break;
+            }
+            numReserved++;
+        }
+    }
 
-    if (sb->nfree == 0) {
-        blockData = malloc(sizeof(uint16_t) * 256);
+    if (result == 0) {
+        size_t nextReserved = 0;
 
-        blockReadSuccess = v6_read_block(freeBlockNumber, blockData, 2);
+        qsort(reserved, numReserved, sizeof(uint32_t), compareUint32);
 
-        if (blockReadSuccess != 0) {
-            free(blockData);
-            return 0;
+        for (size_t i = 0; i < numBlocks; i++) {
+            if (destinationMap[i] != 0) {
+                destinationMap[i] = reserved[nextReserved++];
+            }
         }
 
-        sb->nfree = blockData[0];
-        memcpy(sb->free, &blockData[1], sb->nfree * 2);
+        result = copyBlockRuns(sourceMap, destinationMap, numBlocks);
 
-        free(blockData);
+        if (result == 0) {
+            destinationInode = inodeLoad(sb, destinationInodeNumber);
+            result = writeBlockMap(destinationInode, destinationMap, numBlocks, &reserved[nextReserved]);
+            setFileSize(destinationInode, fileSize);
+            if (result == 0) {
+                inodeSave(sb, destinationInodeNumber, destinationInode);
+            }
+        }
     }
 
-    return freeBlockNumber;
-}
-
-/*
- * Frees the given block number. Updates the superblock accordingly.
- */
-static int8_t v6_free(Superblock *sb, uint16_t blockNumber) {
-    size_t numBytesWritten;
-    uint16_t *blockData;
-    int8_t blockWriteSuccess;
-
-    if (blockNumber < 2 || blockNumber >= sb->fsize) {
-        return E_INVALID_BLOCK_NUMBER;
+    if (result != 0) {
+        for (size_t i = 0; i < numReserved; i++) {
+            v6_free(sb, reserved[i]);
+        }
+        if (result != E_FILE_ALREADY_EXISTS && destinationPathCopy != NULL && destinationInodeNumber != 0) {
+            // Don't leave a half-made copy behind. Nothing has been mapped into it yet.
+            removeFile(sb, destinationPathCopy, 0);
+        }
     }
 
-    if (sb->nfree == 100) {
-        // Allocate one 512 byte chunk to buffer write data
-        blockData = malloc(sizeof(uint16_t) * 256);
+    free(sourceMap);
+    free(destinationMap);
+    free(reserved);
+    free(destinationPathCopy);
 
-        blockData[0] = sb->nfree;
-        memcpy(&blockData[1], sb->free, sb->nfree * 2);
+    return result;
+}
 
-        blockWriteSuccess = v6_write_block(blockNumber, blockData, 1);
-        if (blockWriteSuccess != 0) {
-            free(blockData);
-            return blockWriteSuccess;
-        }
+int8_t v6_mv(Superblock *sb, char *v6SourcePath, char *v6DestinationPath) {
+    int8_t result;
 
-        sb->nfree = 0;
+    beginOperation(sb);
+    result = moveFile(sb, v6SourcePath, v6DestinationPath);
 
-        free(blockData);
-    }
+    return endOperation(sb) == 0 ? result : E_BLOCK_WRITE_FAILURE;
+}
 
-    sb->free[sb->nfree] = blockNumber;
-    sb->nfree++;
+static int8_t moveFile(Superblock *sb, char *v6SourcePath, char *v6DestinationPath) {
+    char **sourceTokens, **destinationTokens;
+    size_t numSourceTokens = 0, numDestinationTokens = 0;
+    uint16_t sourceParentNumber, destinationParentNumber, inodeNumber, existingNumber;
+    Inode *sourceParent, *destinationParent, *inode;
+    char *sourceName, *destinationName;
+    int8_t result = 0;
 
-    return 0;
-}
+    sourceTokens = tokenizeFilePath(v6SourcePath, &numSourceTokens);
+    destinationTokens = tokenizeFilePath(v6DestinationPath, &numDestinationTokens);
 
-/*
- * Read a single block from the file system.
- * Assumes that data can hold one block's worth of bytes (defined by BLOCK_SIZE).
- *
- * blockNumber - the block number from which to read
- * data - the array where the data will be stored
- * size - the size of an element in data
- *
- * returns 0 if the entire block could be read
- */
-static int8_t v6_read_block(uint16_t blockNumber, void *data, size_t size) {
-    size_t numElementsRead;
-    size_t expectedElementsToRead = BLOCK_SIZE / size;
+    if (numSourceTokens == 0) {
+        return E_INVALID_PATH;
+    }
 
-    if (fseek(v6FileSystem, getBlockAddress(blockNumber), SEEK_SET) != 0) {
-        return E_SEEK_FAILURE;
+    sourceName = sourceTokens[numSourceTokens - 1];
+    if (strncmp(sourceName, ".", 14) == 0 || strncmp(sourceName, "..", 14) == 0) {
+        return E_INVALID_PATH;
     }
 
-    numElementsRead = fread(data, size, expectedElementsToRead, v6FileSystem);
+    sourceParentNumber = lookupPathTokens(sb, sourceTokens, numSourceTokens - 1);
+    sourceParent = inodeLoad(sb, sourceParentNumber);
+    inodeNumber = findDirectoryEntry(sourceParent, sourceName);
 
-    if (numElementsRead < expectedElementsToRead) {
-        return E_BLOCK_READ_FAILURE;
+    if (inodeNumber == 0) {
+        return E_NO_SUCH_FILE;
     }
 
-    return 0;
-}
+    // Moving onto an existing directory moves the file into it, keeping its name.
+    existingNumber = lookupPathTokens(sb, destinationTokens, numDestinationTokens);
+    if (existingNumber != 0) {
+        Inode *existing = inodeLoad(sb, existingNumber);
+        uint16_t isDirectory = inodeIsDirectory(existing);
 
-static int8_t v6_write_block(uint16_t blockNumber, void *data, size_t size) {
-    size_t numBytesWritten;
-    size_t numElementsToWrite = BLOCK_SIZE / size;
-    size_t expectedBytesWritten = numElementsToWrite * size;
+        if (isDirectory == 0) {
+            return E_FILE_ALREADY_EXISTS;
+        }
 
-    if (fseek(v6FileSystem, getBlockAddress(blockNumber), SEEK_SET) != 0) {
-        return E_SEEK_FAILURE;
+        destinationParentNumber = existingNumber;
+        destinationName = sourceName;
+    } else {
+        if (numDestinationTokens == 0) {
+            return E_INVALID_PATH;
+        }
+        destinationParentNumber = lookupPathTokens(sb, destinationTokens, numDestinationTokens - 1);
+        destinationName = destinationTokens[numDestinationTokens - 1];
     }
 
-    numBytesWritten = fwrite(data, size, numElementsToWrite, v6FileSystem);
-
-    if (numBytesWritten < expectedBytesWritten) {
-        return E_BLOCK_WRITE_FAILURE;
+    if (destinationParentNumber == 0) {
+        return E_NO_SUCH_FILE;
     }
 
-    return 0;
-}
-
-static uint16_t createFile(Superblock *sb, char *filePath, uint16_t fileType) {
-    char **filePathTokens;
-    size_t numTokens = 0;
-    Inode *previousInode = inodeLoad(sb, 1);
-    Inode *inode = NULL;
-    uint16_t inodeNumber = 0, previousInodeNumber = 1;
-    uint16_t createdLastLoop = 0;
+    inode = inodeLoad(sb, inodeNumber);
 
-    filePathTokens = tokenizeFilePath(filePath, &numTokens);
+    if (inodeIsDirectory(inode) && destinationParentNumber != sourceParentNumber
+        && directoryIsAncestor(sb, inodeNumber, destinationParentNumber)) {
+        // A directory can't be moved inside itself.
+        return E_INVALID_PATH;
+    }
 
-    for (size_t i = 0; i < numTokens - 1; i++) {
-        inodeNumber = findDirectoryEntry(previousInode, filePathTokens[i]);
+    if (destinationParentNumber == sourceParentNumber) {
+        destinationParent = sourceParent;
+    } else {
+        destinationParent = inodeLoad(sb, destinationParentNumber);
+    }
 
-        if (inodeNumber == 0) {
-            // Directory does not exist. Create.
-            inodeNumber = getNewInodeNumber(sb);
-            inode = inodeLoad(sb, inodeNumber);
-            inode->flags |= FLAG_INODE_ALLOCATED | FILE_TYPE_DIRECTORY;
+    // Link the new name before unlinking the old one, so a crash in between leaves an extra name
+    // rather than a lost file.
+    if (findDirectoryEntry(destinationParent, destinationName) != 0) {
+        result = E_FILE_ALREADY_EXISTS;
+    } else {
+        allocateNear(destinationParentNumber);
+        result = addDirectoryEntry(sb, destinationParent, destinationName, inodeNumber);
+    }
 
-            addDirectoryEntry(sb, inode, ".", inodeNumber);
-            addDirectoryEntry(sb, inode, "..", previousInodeNumber);
+    if (result == 0) {
+        inodeSave(sb, destinationParentNumber, destinationParent);
+        removeDirectoryEntry(sourceParent, sourceName);
 
+        if (inodeIsDirectory(inode) && destinationParentNumber != sourceParentNumber) {
+            // Point ".." at the new parent. The freed slot is the first empty one, so it is reused.
+            removeDirectoryEntry(inode, "..");
+            addDirectoryEntry(sb, inode, "..", destinationParentNumber);
             inodeSave(sb, inodeNumber, inode);
-
-            // Add entry to previous node
-            addDirectoryEntry(sb, previousInode, filePathTokens[i], inodeNumber);
-
-            inodeSave(sb, previousInodeNumber, previousInode);
-        } else {
-            inode = inodeLoad(sb, inodeNumber);
         }
 
-        free(previousInode);
-        previousInode = inode;
-        previousInodeNumber = inodeNumber;
+        result = compactDirectory(sb, sourceParentNumber, sourceParent, DIRECTORY_COMPACT_PERCENT, NULL);
     }
 
-    inodeNumber = findDirectoryEntry(previousInode, filePathTokens[numTokens - 1]);
+    return result;
+}
 
-    if (inodeNumber == 0) {
-        // Create the new file.
-        inodeNumber = getNewInodeNumber(sb);
+V6File * v6_open(Superblock *sb, char *v6FilePath) {
+    V6File *file = NULL;
+    Inode *inode = NULL;
+    uint16_t inodeNumber;
+
+    scratchEnter();
+
+    inodeNumber = getTerminalInodeNumber(sb, v6FilePath);
+    if (inodeNumber != 0) {
         inode = inodeLoad(sb, inodeNumber);
-        inode->flags |= FLAG_INODE_ALLOCATED | fileType;
+    }
 
-        if (fileType == FILE_TYPE_DIRECTORY) {
-            addDirectoryEntry(sb, inode, ".", inodeNumber);
-            addDirectoryEntry(sb, inode, "..", previousInodeNumber);
-        }
-        inodeSave(sb, inodeNumber, inode);
+    if (inode != NULL && inodeIsDirectory(inode) == 0) {
+        file = malloc(sizeof(V6File));
+    }
 
-        addDirectoryEntry(sb, previousInode, filePathTokens[numTokens - 1], inodeNumber);
-        inodeSave(sb, previousInodeNumber, previousInode);
-    } else {
-        // File already exists
-        return 0;
+    if (file != NULL) {
+        file->sb = sb;
+        file->inodeNumber = inodeNumber;
+        file->inode = *inode;
+        memset(&file->readahead, 0, sizeof(file->readahead));
+        file->nextOpen = openFiles;
+        openFiles = file;
     }
 
-    return inodeNumber;
+    scratchLeave();
+
+    return file;
 }
 
 /*
- * Traverses inodes along a specified path, returning the inode number of the file
+ * Reads the file's i-node again from the i-node table. Defragmenting, or a write through another
+ * handle to the same file, can remap its blocks while it is open, so the copy in the handle is only
+ * good until the next call. Returns E_NO_SUCH_FILE once the file has been removed and its i-node
+ * freed.
  */
-static uint16_t getTerminalInodeNumber(Superblock *sb, char *filename) {
-    char* filePathToken = strtok(filename, "/");
-    char delim[] = "/\0";
-    Inode *root = inodeLoad(sb, 1);
-    Inode *nextInode;
-    uint16_t terminalInodeNumber;
+static int8_t fileReloadInode(V6File *file) {
+    uint8_t *inodeBlock;
 
-    terminalInodeNumber = findDirectoryEntry(root, filePathToken);
-    filePathToken = strtok(NULL, delim);
+    if (file->inodeNumber == 0) {
+        return E_NO_SUCH_FILE;
+    }
 
-    while(filePathToken != NULL) {
-        nextInode = inodeLoad(sb, terminalInodeNumber);
-        terminalInodeNumber = findDirectoryEntry(nextInode, filePathToken);
-        if (terminalInodeNumber == 0) {
-            free(nextInode);
-            free(root);
-            return 0;
-        }
-        filePathToken = strtok(NULL, delim);
+    inodeBlock = getCachedBlock(getInodeBlockNumber(file->inodeNumber));
+    if (inodeBlock == NULL) {
+        return E_BLOCK_READ_FAILURE;
     }
+    imageFormat.inodeFromDisk(getInodeInBlock(inodeBlock, file->inodeNumber), &file->inode);
 
-    free(nextInode);
-    free(root);
-    return terminalInodeNumber;
+    return 0;
 }
 
-/*
- * Traverses the inode blocks and adds any available inodes to the inode list
- */
-static int8_t repopulateInodeList(Superblock *sb) {
-    Inode inodes[16];
-    for (size_t inodeBlockNum = 2; inodeBlockNum < sb->isize + 2; inodeBlockNum++) {
-        v6_read_block((uint16_t) inodeBlockNum, inodes, 32);
+int8_t v6_pread(V6File *file, void *buffer, size_t count, uint32_t offset, size_t *bytesRead) {
+    uint8_t *destination = buffer;
+    uint32_t fileSize;
+    size_t copied = 0;
 
-        for (size_t i = 0; i < 16; i++) {
-            if (sb->ninode == 100) {
-                // The inode array is full. Stop.
-                return 0;
-            }
+    int8_t result;
+
+    *bytesRead = 0;
+
+    result = fileReloadInode(file);
+    if (result != 0) {
+        return result;
+    }
+    fileSize = getFileSize(&file->inode);
+
+    if (offset >= fileSize) {
+        return 0;
+    }
+
+    if (count > fileSize - offset) {
+        count = fileSize - offset;
+    }
+
+    while (copied < count) {
+        uint32_t position = offset + (uint32_t) copied;
+        // The block index follows directly from the offset, so no earlier blocks are looked at.
+        uint32_t blockIndex = position >> imageFormat.blockShift;
+        size_t offsetInBlock = position & (imageFormat.blockSize - 1);
+        size_t chunk = imageFormat.blockSize - offsetInBlock;
+        uint32_t blockNumber;
+
+        if (chunk > count - copied) {
+            chunk = count - copied;
+        }
+
+        readaheadNote(&file->inode, &file->readahead, blockIndex);
+        blockNumber = getBlockNumberAtIndex(&file->inode, blockIndex);
+
+        if (blockNumber == 0) {
+            // A hole reads as zeros.
+            memset(&destination[copied], 0, chunk);
+        } else {
+            uint8_t *blockData = blockNumber == BLOCK_NUMBER_UNREADABLE ? NULL : getCachedBlock(blockNumber);
 
-            if ((inodes[i].flags & (uint16_t) FLAG_INODE_ALLOCATED) == 0) {
-                sb->inode[sb->ninode] = (uint16_t) ((inodeBlockNum - 2) * 16 + i + 1);
-                sb->ninode++;
+            if (blockData == NULL) {
+                *bytesRead = copied;
+                return E_BLOCK_READ_FAILURE;
             }
+            memcpy(&destination[copied], &blockData[offsetInBlock], chunk);
         }
+
+        copied += chunk;
     }
+
+    *bytesRead = copied;
+
     return 0;
 }
 
-static Inode* inodeLoad(Superblock *sb, uint16_t inodeNumber) {
-    Inode *inode;
-    uint16_t inodeBlockNumber, offsetInBlock;
-    uint8_t blockData[512];
+int8_t v6_pwrite(V6File *file, const void *buffer, size_t count, uint32_t offset, size_t *bytesWritten) {
+    int8_t result;
 
-    if (inodeNumber == 0 || inodeNumber > sb->isize * 16) {
-        return NULL;
+    *bytesWritten = 0;
+
+    if (offset > imageFormat.maxFileSize || count > imageFormat.maxFileSize - offset) {
+        return E_INVALID_INDEX;
     }
 
-    // Add 1 since inodes are typically indexed from 1.
-    inodeBlockNumber = (inodeNumber - 1) / 16 + 2;
-    offsetInBlock = ((inodeNumber - 1) % 16) * 32;
+    beginOperation(file->sb);
+    result = writeFileRange(file, buffer, count, offset, bytesWritten);
 
-    inode = malloc(sizeof(Inode));
+    return endOperation(file->sb) == 0 ? result : E_BLOCK_WRITE_FAILURE;
+}
 
-    v6_read_block(inodeBlockNumber, blockData, 1);
-    convertBytesToInode(&blockData[offsetInBlock], inode);
+static int8_t writeFileRange(V6File *file, const void *buffer, size_t count, uint32_t offset, size_t *bytesWritten) {
+    static const uint8_t zeroBlock[MAX_BLOCK_SIZE] = { 0 };
+    const uint8_t *source = buffer;
+    uint32_t fileSize;
+    uint32_t position;
+    size_t written = 0;
+    int8_t result = 0;
+
+    // The whole i-node is saved at the end, so it has to start out as the current one.
+    result = fileReloadInode(file);
+    if (result != 0) {
+        return result;
+    }
+    fileSize = getFileSize(&file->inode);
+    position = fileSize < offset ? fileSize : offset;
 
-    return inode;
-}
+    allocateNear(file->inodeNumber);
 
-static int8_t inodeSave(Superblock *sb, uint16_t inodeNumber, Inode *inode) {
-    uint16_t inodeBlockNumber, offsetInBlock;
-    uint8_t blockData[512];
+    // Writing past the end of the file fills the gap with zeros first.
+    while (result == 0 && position < offset + count) {
+        uint32_t blockIndex = position >> imageFormat.blockShift;
+        size_t offsetInBlock = position & (imageFormat.blockSize - 1);
+        size_t chunk = imageFormat.blockSize - offsetInBlock;
+        const uint8_t *chunkData;
 
-    if (inodeNumber > sb->isize * 16) {
-        return -1;
+        if (position < offset) {
+            if (chunk > offset - position) {
+                chunk = offset - position;
+            }
+            if (getBlockNumberAtIndex(&file->inode, blockIndex) == 0) {
+                // Unmapped blocks in the gap are left as holes.
+                position += (uint32_t) chunk;
+                continue;
+            }
+            chunkData = zeroBlock;
+        } else {
+            if (chunk > count - written) {
+                chunk = count - written;
+            }
+            chunkData = &source[written];
+        }
+
+        result = writeFileBlock(file, blockIndex, offsetInBlock, chunkData, chunk, fileSize);
+
+        if (result == 0) {
+            if (position >= offset) {
+                written += chunk;
+            }
+            position += (uint32_t) chunk;
+            if (position > fileSize) {
+                fileSize = position;
+            }
+        }
     }
 
-    // Add 1 since inodes are typically indexed from 1.
-    inodeBlockNumber = (inodeNumber - 1) / 16 + 2;
-    offsetInBlock = ((inodeNumber - 1) % 16) * 32;
+    if (result == 0) {
+        result = extendFileSize(file->sb, &file->inode, position > fileSize ? position : fileSize);
+    } else {
+        setFileSize(&file->inode, fileSize);
+    }
+    inodeSave(file->sb, file->inodeNumber, &file->inode);
 
-    v6_read_block(inodeBlockNumber, blockData, 1);
-    convertInodeToBytes(inode, &blockData[offsetInBlock]);
-    v6_write_block(inodeBlockNumber, blockData, 1);
+    *bytesWritten = written;
 
-    return 0;
+    return result;
 }
 
-static void inodeInit(Inode *inode) {
-    inode->flags = 0;
-    inode->nlinks = 0;
-    inode->uid = 0;
-    inode->gid = 0;
-    inode->size0 = 0;
-    inode->size1 = 0;
-    for (size_t i = 0; i < 8; i++) {
-        inode->addr[i] = 0;
-    }
-    inode->actime[0] = 0;
-    inode->actime[1] = 0;
-    inode->modtime[0] = 0;
-    inode->modtime[1] = 0;
-}
+int8_t v6_append(V6File *file, const void *buffer, size_t count, size_t *bytesWritten) {
+    int8_t result;
 
-/*
- * Returns a new inode
- */
-static uint16_t getNewInodeNumber(Superblock *sb){
-    uint16_t newInodeNumber = 0;
+    *bytesWritten = 0;
 
-    if(sb->ninode == 0){
-        repopulateInodeList(sb);
+    result = fileReloadInode(file);
+    if (result != 0) {
+        return result;
     }
 
-    if(sb->ninode > 0) {
-        sb->ninode--;
-        newInodeNumber = sb->inode[sb->ninode];
+    return v6_pwrite(file, buffer, count, getFileSize(&file->inode), bytesWritten);
+}
+
+void v6_close(V6File *file) {
+    for (V6File **link = &openFiles; *link != NULL; link = &(*link)->nextOpen) {
+        if (*link == file) {
+            *link = file->nextOpen;
+            break;
+        }
     }
 
-    return newInodeNumber;
+    free(file);
 }
 
-static int8_t inodeFree(Superblock *sb, uint16_t inodeNumber) {
-    if (inodeNumber < 1 || inodeNumber > sb->isize * 16) {
-        return E_INVALID_INODE_NUMBER;
-    }
+V6Directory * v6_opendir(Superblock *sb, char *v6DirectoryPath) {
+    V6Directory *directory;
+    Inode *inode = NULL;
+    BlockList indirectBlocks = { 0 };
+    uint16_t inodeNumber;
 
-    size_t blockIndex = 0;
-    Inode *inode = inodeLoad(sb, inodeNumber);
-    uint16_t nextAllocatedBlockNumber = getNextAllocatedBlockNumber(inode);
+    scratchEnter();
 
-    // Free i-node data
-    while (nextAllocatedBlockNumber != 0) {
-        v6_free(sb, nextAllocatedBlockNumber);
+    inodeNumber = getTerminalInodeNumber(sb, v6DirectoryPath);
+    if (inodeNumber != 0) {
+        inode = inodeLoad(sb, inodeNumber);
+    }
 
-        nextAllocatedBlockNumber = getNextAllocatedBlockNumber(NULL);
+    if (inode == NULL || inodeIsDirectory(inode) == 0) {
+        scratchLeave();
+        return NULL;
     }
 
-    if (inodeIsLargeFile(inode)) {
-        uint16_t singlyIndirectBlockNumber;
-        for (size_t i = 0; i < MAX_SINGLY_INDIRECT_BLOCKS_PER_INODE; i++) {
-            singlyIndirectBlockNumber = getSinglyIndirectBlockNumberAtIndex(inode, (uint16_t) i);
-            if (singlyIndirectBlockNumber != 0) {
-                v6_free(sb, singlyIndirectBlockNumber);
-            }
-        }
+    directory = calloc(1, sizeof(V6Directory));
 
-        if (inode->addr[7] != 0) {
-            v6_free(sb, inode->addr[7]);
+    if (directory == NULL || collectInodeBlocks(inode, &directory->blocks, &indirectBlocks) != 0
+        || blockListAppend(&openDirectories, inodeNumber) != 0) {
+        if (directory != NULL) {
+            free(directory->blocks.blocks);
         }
+        free(directory);
+        directory = NULL;
+    } else {
+        directory->sb = sb;
+        directory->inodeNumber = inodeNumber;
     }
 
-    // Deallocate i-node
-    inodeInit(inode);
-    inodeSave(sb, inodeNumber, inode);
+    free(indirectBlocks.blocks);
+    scratchLeave();
 
-    return 0;
+    return directory;
 }
 
-/*
- * Adds the block to the first available position.
- * This function will create indirect blocks as necessary.
- */
-static int8_t addAllocatedBlockToInode(Superblock *sb, Inode *inode, uint16_t numBytes, uint16_t blockNumber) {
-    size_t addrIndex = 0;
+int8_t v6_readdir(V6Directory *directory, V6DirectoryEntry *entries, size_t maxEntries,
+                  uint8_t withAttributes, size_t *numEntries) {
+    size_t count = 0;
 
-    if (inodeIsLargeFile(inode)) {
-        uint16_t index = 0;
-        uint16_t blockNumberAtIndex = 0;
+    *numEntries = 0;
 
-        while (index <= LAST_POSSIBLE_INODE_BLOCK) {
-            blockNumberAtIndex = getBlockNumberAtIndex(inode, index);
-            if (blockNumberAtIndex == 0) {
-                setBlockNumberAtIndex(sb, inode, blockNumber, index);
-                break;
-            }
-            index++;
+    if (maxEntries > 65535) {
+        // Attribute loading tracks entries with 16 bit indexes.
+        maxEntries = 65535;
+    }
+
+    while (count < maxEntries && directory->blockIndex < directory->blocks.count) {
+        uint8_t *blockData = getCachedBlock(directory->blocks.blocks[directory->blockIndex]);
+
+        if (blockData == NULL) {
+            return E_BLOCK_READ_FAILURE;
         }
-    } else {
-        while (addrIndex < 8) {
-            if (inode->addr[addrIndex] == 0) {
-                inode->addr[addrIndex] = blockNumber;
-                break;
+
+        // Copy entries straight out of the cached block until it runs out or the batch is full.
+        while (directory->entryIndex < imageFormat.entriesPerBlock && count < maxEntries) {
+            DiskDirectoryEntry *diskEntry = (DiskDirectoryEntry *) blockData + directory->entryIndex;
+
+            if (diskEntry->inodeNumber != 0) {
+                entries[count].inodeNumber = diskEntry->inodeNumber;
+                memcpy(entries[count].name, diskEntry->name, sizeof(diskEntry->name));
+                entries[count].name[14] = '\0';
+                count++;
             }
-            addrIndex++;
+
+            directory->entryIndex++;
         }
-        if (addrIndex == 8) {
-            // Could not add to i-node. The i-node is too small.
-            convertInodeToLargeFile(sb, inode);
-            return addAllocatedBlockToInode(sb, inode, numBytes, blockNumber);
+
+        if (directory->entryIndex == imageFormat.entriesPerBlock) {
+            directory->blockIndex++;
+            directory->entryIndex = 0;
         }
     }
 
-    uint32_t inodeSize = getFileSize(inode);
-    setFileSize(inode, inodeSize + numBytes);
+    *numEntries = count;
+
+    if (withAttributes && count > 0) {
+        return loadEntryAttributes(directory->sb, entries, count);
+    }
 
     return 0;
 }
 
-// TODO: Use setBlockNumberAtIndex function
-static int8_t convertInodeToLargeFile(Superblock *sb, Inode *inode) {
-    // The block numbers that are initially stored in inode->addr[0-7]
-    uint16_t smallFileBlockNumbers[8];
-    uint16_t newIndirectBlockNumber;
-    uint16_t indirectBlockData[256] = { 0 };
+void v6_closedir(V6Directory *directory) {
+    if (directory == NULL) {
+        return;
+    }
 
-    if (inodeIsLargeFile(inode)) {
-        // i-node is already a large file. Bam, done.
-        return 0;
+    for (size_t i = 0; i < openDirectories.count; i++) {
+        if (openDirectories.blocks[i] == directory->inodeNumber) {
+            openDirectories.blocks[i] = openDirectories.blocks[--openDirectories.count];
+            break;
+        }
     }
 
-    newIndirectBlockNumber = v6_alloc(sb);
-
-    if (newIndirectBlockNumber == 0) {
-        return E_ALLOCATE_FAILURE;
-    }
-
-    for (size_t i = 0; i < 8; i++) {
-        smallFileBlockNumbers[i] = inode->addr[i];
-        inode->addr[i] = 0;
-    }
-
-    memcpy(indirectBlockData, smallFileBlockNumbers, 8 * sizeof(uint16_t));
-    v6_write_block(newIndirectBlockNumber, indirectBlockData, 2);
-    inode->addr[0] = newIndirectBlockNumber;
-    inode->flags |= FLAG_LARGE_FILE;
-
-    return 0;
+    free(directory->blocks.blocks);
+    free(directory);
 }
 
 /*
- *
+ * Returns 1 if a V6Directory is open on the i-node, so its blocks have to stay where they are.
  */
-static uint16_t getNextAllocatedBlockNumber(Inode *inode) {
-    static Inode *persistentInode;
-    static uint16_t isLargeFile;
-    static uint16_t blockIndex;
-
-    if (inode == NULL) {
-        if (persistentInode == NULL) {
-            // No i-node was ever given.
-            return 0;
+static uint8_t directoryIsOpen(uint16_t inodeNumber) {
+    for (size_t i = 0; i < openDirectories.count; i++) {
+        if (openDirectories.blocks[i] == inodeNumber) {
+            return 1;
         }
-    } else {
-        // Set static references and start from beginning of i-node
-        persistentInode = inode;
-        isLargeFile = inodeIsLargeFile(inode);
-        blockIndex = 0;
     }
 
-    uint16_t blockNumber;
+    return 0;
+}
 
-    if (isLargeFile) {
-        while (blockIndex <= LAST_POSSIBLE_INODE_BLOCK) {
-            blockNumber = getBlockNumberAtIndex(persistentInode, blockIndex);
-            blockIndex += 1;
-            if (blockNumber != 0) {
-                return blockNumber;
-            }
-        }
-    } else {
-        if (blockIndex >= 8) {
-            return 0;
-        }
+void v6_bench_dirscan(size_t iterations, double *strncmpSeconds, double *scalarSeconds, double *vectorSeconds) {
+    uint8_t blockData[BLOCK_SIZE] = { 0 };
+    DirectoryEntryKey key;
+    struct timespec start, end;
+    volatile int sink = 0;
+    double *timings[3] = { strncmpSeconds, scalarSeconds, vectorSeconds };
 
-        while (blockIndex < 8) {
-            uint16_t blockNumber = getBlockNumberAtIndex(persistentInode, blockIndex);
-            blockIndex += 1;
-            if (blockNumber != 0) {
-                // We have a valid block number
-                return blockNumber;
+    // A full block of names that share a long prefix, so each comparison has to look far into
+    // the name. The name looked up isn't there, so every lookup scans all 32 entries.
+    for (uint16_t i = 0; i < 32; i++) {
+        uint16_t inodeNumber = i + 2;
+
+        memcpy(&blockData[i * 16], &inodeNumber, 2);
+        snprintf((char *) &blockData[i * 16 + 2], 14, "datafile_%04u", (unsigned) i);
+    }
+    makeDirectoryEntryKey("datafile_9999", &key);
+
+    for (int method = 0; method < 3; method++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (size_t n = 0; n < iterations; n++) {
+            if (method == 0) {
+                sink += findEntryInBlockStrncmp(blockData, "datafile_9999");
+            } else if (method == 1) {
+                sink += findEntryInBlockScalar(blockData, &key, 32);
+            } else {
+                sink += findEntryInBlock512(blockData, &key);
             }
         }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        *timings[method] = (double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) / 1e9;
     }
 
-    // If we haven't found a block number by this point,
-    // we've run out of places to look. There are no more blocks.
-    return 0;
+    (void) sink;
 }
 
-/*
- * Needs the Superblock since it may have to allocate new blocks.
- * Seems messy, but I'm not sure if there's a better way to do that.
- */
-static int8_t addDirectoryEntry(Superblock *sb, Inode *inode, char *filename, uint16_t inodeNumber) {
-    uint8_t blockData[BLOCK_SIZE];
-    uint16_t blockNumber;
-    uint16_t tempInodeNumber = 0;
-    char inodeFilename[15] = { 0 };
+int8_t v6_warmup(Superblock *sb, uint8_t allDirectories) {
+    int state = atomic_load(&warmupState);
 
-    if (inodeIsDirectory(inode) == 0) {
-        return -1;
+    if (state == WARMUP_RUNNING || state == WARMUP_LOADED) {
+        return E_WARMUP_IN_PROGRESS;
     }
 
-    if (findDirectoryEntry(inode, filename)) {
-        // Directory already exists
-        return -1;
+    if (v6FileSystem == NULL) {
+        return E_FILE_SYSTEM_NULL;
     }
 
-    // First, look for an empty slot in one of the allocated blocks.
-    blockNumber = getNextAllocatedBlockNumber(inode);
-    // Copy to inodeFilename for correct padding.
-    strncpy(inodeFilename, filename, 14);
+    // The warmup reads the file directly, so nothing can be left sitting in the stdio buffer.
+    if (fflush(v6FileSystem) != 0) {
+        return E_BLOCK_WRITE_FAILURE;
+    }
 
-    while (blockNumber != 0) {
-        v6_read_block(blockNumber, blockData, 1);
-        for (size_t i = 0; i < 32; i++) {
-            memcpy(&tempInodeNumber, &blockData[i * 16], 2);
-
-            if (tempInodeNumber == 0) {
-                memcpy(&blockData[i * 16], &inodeNumber, 2);
-                memcpy(&blockData[(i * 16) + 2], inodeFilename, 14);
-                v6_write_block(blockNumber, blockData, 1);
-                return 0;
-            }
+    memset(&warmupJob, 0, sizeof(warmupJob));
+    free(warmupWrittenBlocks);
+    warmupWrittenWords = sb->fsize / 64 + 1;
+    warmupWrittenBlocks = calloc(warmupWrittenWords, sizeof(uint64_t));
+    warmupJob.fd = fileno(v6FileSystem);
+    warmupJob.baseFd = overlayBaseFd;
+    warmupJob.isize = sb->isize;
+    warmupJob.allDirectories = allDirectories;
+    warmupJob.blockNumbers = malloc(BLOCK_CACHE_SIZE * sizeof(uint32_t));
+    warmupJob.blockData = malloc(BLOCK_CACHE_SIZE * imageFormat.blockSize);
+    if (overlayPresent != NULL) {
+        warmupJob.overlayPresent = malloc((overlayNumBlocks + 7) / 8);
+        if (warmupJob.overlayPresent != NULL) {
+            memcpy(warmupJob.overlayPresent, overlayPresent, (overlayNumBlocks + 7) / 8);
         }
-        blockNumber = getNextAllocatedBlockNumber(NULL);
     }
 
-    // If there isn't one, allocate a block and add it to the inode.
-    uint16_t newBlockNumber;
-    uint8_t newBlockData[BLOCK_SIZE] = { 0 };
-
-    newBlockNumber = v6_alloc(sb);
-
-    if (newBlockNumber == 0) {
+    if (warmupWrittenBlocks == NULL || warmupJob.blockNumbers == NULL || warmupJob.blockData == NULL
+        || (overlayPresent != NULL && warmupJob.overlayPresent == NULL)) {
+        free(warmupJob.blockNumbers);
+        free(warmupJob.blockData);
+        free(warmupJob.overlayPresent);
         return E_ALLOCATE_FAILURE;
     }
 
-    memcpy(&newBlockData[0], &inodeNumber, 2);
-    memcpy(&newBlockData[2], inodeFilename, 14);
-    v6_write_block(newBlockNumber, newBlockData, 1);
-    addAllocatedBlockToInode(NULL, inode, 512, newBlockNumber);
+    clock_gettime(CLOCK_MONOTONIC, &warmupJob.start);
+    atomic_store(&warmupState, WARMUP_RUNNING);
+
+    if (pthread_create(&warmupThread, NULL, warmupMain, &warmupJob) != 0) {
+        atomic_store(&warmupState, WARMUP_NOT_STARTED);
+        free(warmupJob.blockNumbers);
+        free(warmupJob.blockData);
+        free(warmupJob.overlayPresent);
+        return E_THREAD_CREATE_FAILURE;
+    }
 
     return 0;
 }
 
-static int8_t removeDirectoryEntry(Inode *inode, char *filename) {
-    uint8_t blockData[BLOCK_SIZE];
-    uint16_t blockNumber = getNextAllocatedBlockNumber(inode);
-    uint16_t inodeNumber = 0;
-    char inodeFilename[15] = { 0 };
+void v6_warmup_report(V6WarmupReport *report) {
+    int state;
 
-    if (inodeIsDirectory(inode) == 0) {
-        return -1;
+    warmupInstall();
+    state = atomic_load(&warmupState);
+
+    memset(report, 0, sizeof(V6WarmupReport));
+    report->state = (uint8_t) (state == WARMUP_LOADED ? WARMUP_RUNNING : state);
+
+    if (state == WARMUP_FINISHED) {
+        report->blocksRead = warmupJob.blocksRead;
+        report->blocksCached = warmupJob.blocksCached;
+        report->seconds = warmupJob.seconds;
     }
+}
 
-    while (blockNumber != 0) {
-        v6_read_block(blockNumber, blockData, 1);
-        for (size_t i = 0; i < 32; i++) {
-            memcpy(&inodeNumber, &blockData[i * 16], 2);
-            memcpy(inodeFilename, &blockData[(i * 16) + 2], 14);
-
-            if (inodeNumber > 0) {
-                if (strncmp(filename, inodeFilename, 14) == 0) {
-                    inodeNumber = 0;
-                    memcpy(&blockData[i * 16], &inodeNumber, 2);
-                    v6_write_block(blockNumber, blockData, 1);
-                    return 0;
-                }
-            }
-        }
-        blockNumber = getNextAllocatedBlockNumber(NULL);
+int8_t v6_journal_enable(Superblock *sb) {
+    if (journalCapturing) {
+        return 0;
     }
 
-    return -1;
+    if (v6FileSystem == NULL || journalPath == NULL) {
+        return E_FILE_SYSTEM_NULL;
+    }
+
+    // Everything written so far goes in place and must be on disk before the journal takes over.
+    if (superblockSave(sb) != 0 || deviceSync() != 0) {
+        return E_JOURNAL_FAILURE;
+    }
+
+    journalFd = open(journalPath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (journalFd < 0) {
+        return E_JOURNAL_FAILURE;
+    }
+
+    journalDiscard();
+    journalSb = sb;
+    journalCapturing = 1;
+
+    return 0;
 }
 
-/*
- * Find the inode number of the file designated by filename.
- *
- * If the directory could not be found, return 0.
- */
-static uint16_t findDirectoryEntry(Inode *inode, char *filename) {
-    uint8_t blockData[BLOCK_SIZE];
-    uint16_t blockNumber = getNextAllocatedBlockNumber(inode);
-    uint16_t inodeNumber = 0;
-    char inodeFilename[15] = { 0 };
+int8_t v6_journal_disable(Superblock *sb) {
+    int8_t result;
 
-    if (inodeIsDirectory(inode) == 0) {
+    if (journalCapturing == 0 || journalSb != sb) {
         return 0;
     }
 
-    while (blockNumber != 0) {
-        v6_read_block(blockNumber, blockData, 1);
-        for (size_t i = 0; i < 32; i++) {
-            memcpy(&inodeNumber, &blockData[i * 16], 2);
-            memcpy(inodeFilename, &blockData[(i * 16) + 2], 14);
-
-            if (inodeNumber > 0) {
-                if (strncmp(filename, inodeFilename, 14) == 0) {
-                    return inodeNumber;
-                }
-            }
-        }
-        blockNumber = getNextAllocatedBlockNumber(NULL);
+    result = journalCommit();
+    if (result == 0) {
+        result = journalCheckpoint();
     }
+    if (result != 0) {
+        return result;
+    }
+
+    journalClose();
+    unlink(journalPath);
 
     return 0;
 }
 
-static uint16_t getBlockNumberAtIndex(Inode *inode, uint16_t index) {
-    static Inode *lastInode = NULL;
-    static uint16_t cachedSinglyIndirectIndex = 0;
-    static uint16_t cachedSinglyIndirectBlock[256];
-    static uint16_t cachedDoublyIndirectBlock[256];
-    // The block number to return.
-    uint16_t blockNumber = 0;
+int8_t v6_journal_commit(Superblock *sb) {
+    if (journalCapturing == 0 || journalSb != sb) {
+        return 0;
+    }
+
+    return journalCommit();
+}
 
-    if (inodeIsLargeFile(inode)) {
-        size_t addrIndex = index / 256U;
+int8_t v6_sync(Superblock *sb) {
+    int8_t result;
 
-        if (index > LAST_POSSIBLE_INODE_BLOCK) {
-            return 0;
+    if (v6FileSystem == NULL) {
+        return E_FILE_SYSTEM_NULL;
+    }
+
+    if (journalCapturing && journalSb == sb) {
+        result = journalCommit();
+        if (result == 0) {
+            result = journalCheckpoint();
         }
+        return result;
+    }
 
-        if (addrIndex < 7) {
-            if (inode->addr[addrIndex] == 0) {
-                return 0;
-            }
+    // Blocks are written through the cache as they change, so the superblock is all that can be
+    // waiting.
+    if (sb->fmod) {
+        result = superblockSave(sb);
+        if (result != 0) {
+            return result;
+        }
+    }
 
-            uint16_t singlyIndirectBlockNumber = inode->addr[addrIndex];
-            uint16_t singlyIndirectBlockData[256];
-            size_t indexInSinglyIndirectBlock = index % 256U;
-            v6_read_block(singlyIndirectBlockNumber, singlyIndirectBlockData, 2);
+    if (deviceSync() != 0) {
+        return E_BLOCK_WRITE_FAILURE;
+    }
 
-            blockNumber = singlyIndirectBlockData[indexInSinglyIndirectBlock];
-        } else {
-            addrIndex = 7;
-            if (inode->addr[addrIndex] == 0) {
-                return 0;
-            }
+    return 0;
+}
+
+int8_t v6_clone(char *baseImageName, char *cloneImageName) {
+    OverlayTrailer trailer;
+    struct stat baseStat;
+    uint8_t extended;
+    uint32_t blockSize;
+    off_t bitmapOffset;
+    size_t bitmapBytes;
+    struct stat loadedStat;
+    int baseFd, cloneFd;
+    int8_t result = 0;
+    // Kept whole so the clone can be loaded from any directory.
+    char *basePath = realpath(baseImageName, NULL);
+
+    if (basePath == NULL) {
+        return E_FILE_OPEN_FAILURE;
+    }
 
-            // Maybe using 7 explicitly and not addrIndex is better?
-            uint16_t doublyIndirectBlockNumber = inode->addr[addrIndex];
-            uint16_t doublyIndirectBlockData[256];
-            size_t indexInDoublyIndirectBlock = index / 256U - 7U;
+    baseFd = open(basePath, O_RDONLY);
+    if (baseFd < 0 || fstat(baseFd, &baseStat) != 0) {
+        if (baseFd >= 0) {
+            close(baseFd);
+        }
+        free(basePath);
+        return E_FILE_OPEN_FAILURE;
+    }
 
-            v6_read_block(doublyIndirectBlockNumber, doublyIndirectBlockData, 2);
+    imageFormatProbe(baseFd, &extended, &blockSize);
+    bitmapOffset = baseStat.st_size;
+
+    // The base has to be a whole number of blocks, with a superblock, and not a clone itself. Nor
+    // the loaded image, which this session could still be changing, or has yet to write out.
+    if ((v6FileSystem != NULL && fstat(fileno(v6FileSystem), &loadedStat) == 0
+         && loadedStat.st_dev == baseStat.st_dev && loadedStat.st_ino == baseStat.st_ino)
+        || bitmapOffset % blockSize != 0 || bitmapOffset / blockSize < 2 || bitmapOffset / blockSize > UINT32_MAX
+        || (pread(baseFd, &trailer, sizeof(trailer), bitmapOffset - (off_t) sizeof(trailer)) == (ssize_t) sizeof(trailer)
+            && trailer.magic == OVERLAY_MAGIC)) {
+        close(baseFd);
+        free(basePath);
+        return E_INVALID_ARGUMENT;
+    }
+    close(baseFd);
 
-            uint16_t singlyIndirectBlockNumber = doublyIndirectBlockData[indexInDoublyIndirectBlock];
-            uint16_t singlyIndirectBlockData[256];
-            size_t indexInSinglyIndirectBlock = index % 256U;
+    cloneFd = open(cloneImageName, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (cloneFd < 0) {
+        free(basePath);
+        return errno == EEXIST ? E_FILE_ALREADY_EXISTS : E_FILE_OPEN_FAILURE;
+    }
 
-            if (singlyIndirectBlockNumber == 0) {
-                return 0;
-            }
+    trailer.magic = OVERLAY_MAGIC;
+    trailer.blockSize = blockSize;
+    trailer.numBlocks = (uint32_t) (bitmapOffset / blockSize);
+    trailer.pathLength = (uint32_t) strlen(basePath);
+    trailer.baseInode = (uint64_t) baseStat.st_ino;
+    trailer.baseMtimeSeconds = (int64_t) baseStat.st_mtim.tv_sec;
+    trailer.baseMtimeNanoseconds = (int64_t) baseStat.st_mtim.tv_nsec;
+    bitmapBytes = (trailer.numBlocks + 7) / 8;
+
+    // The blocks and the bitmap are left as one hole, so this costs the same for any size of base.
+    if (ftruncate(cloneFd, bitmapOffset + (off_t) bitmapBytes) != 0
+        || pwrite(cloneFd, basePath, trailer.pathLength, bitmapOffset + (off_t) bitmapBytes) != (ssize_t) trailer.pathLength
+        || pwrite(cloneFd, &trailer, sizeof(trailer), bitmapOffset + (off_t) bitmapBytes + trailer.pathLength)
+           != (ssize_t) sizeof(trailer)
+        || fdatasync(cloneFd) != 0) {
+        result = E_BLOCK_WRITE_FAILURE;
+    }
 
-            v6_read_block(singlyIndirectBlockNumber, singlyIndirectBlockData, 2);
+    close(cloneFd);
+    if (result != 0) {
+        unlink(cloneImageName);
+    }
+    free(basePath);
 
-            blockNumber = singlyIndirectBlockData[indexInSinglyIndirectBlock];
-        }
-    } else {
-        if (index > 7) {
-            return 0;
-        }
-        blockNumber = inode->addr[index];
+    return result;
+}
+
+int8_t v6_commit(Superblock *sb) {
+    int8_t result;
+
+    if (v6FileSystem == NULL) {
+        return E_FILE_SYSTEM_NULL;
     }
 
-    return blockNumber;
+    if (overlayBaseFd < 0) {
+        return 0;
+    }
+
+    // Everything journaled or held in memory goes into the delta first, so the image is complete
+    // once the base is let go.
+    result = v6_sync(sb);
+    if (result != 0) {
+        return result;
+    }
+
+    // The warmup reads the base directly.
+    warmupStop();
+
+    return overlayFlatten();
 }
 
-static int8_t setBlockNumberAtIndex(Superblock *sb, Inode *inode, uint16_t blockNumber, uint16_t index) {
-    if (inodeIsLargeFile(inode)) {
-        size_t addrIndex = index / 256U;
+int8_t v6_checkpoint(Superblock *sb, char *name) {
+    int8_t result;
 
-        if (index >= LAST_POSSIBLE_INODE_BLOCK) {
-            return E_INVALID_INDEX;
+    if (v6FileSystem == NULL || changesPath == NULL) {
+        return E_FILE_SYSTEM_NULL;
+    }
+
+    if (name == NULL || name[0] == '\0' || strlen(name) >= CHECKPOINT_NAME_SIZE) {
+        return E_INVALID_ARGUMENT;
+    }
+
+    // Everything before the checkpoint has to be on disk, so a copy taken now is what the deltas
+    // apply to.
+    result = v6_sync(sb);
+    if (result != 0) {
+        return result;
+    }
+
+    if (changesFd < 0) {
+        changesFd = open(changesPath, O_RDWR | O_CREAT, 0644);
+        if (changesFd < 0) {
+            return E_FILE_OPEN_FAILURE;
         }
+    }
 
-        if (addrIndex < 7) {
-            uint16_t singlyIndirectBlockData[256] = { 0 };
+    if (result == 0) {
+        result = changesReset(sb->fsize, name, 0);
+    }
 
-            if (inode->addr[addrIndex] == 0) {
-                // Allocate a singly indirect block
-                uint16_t newSinglyIndirectBlockNumber = v6_alloc(sb);
+    // A bitmap that may not match the image is worse than none, which at least can't be exported.
+    if (result != 0) {
+        changesClose();
+        unlink(changesPath);
+    }
 
-                if (newSinglyIndirectBlockNumber == 0) {
-                    return E_ALLOCATE_FAILURE;
-                }
+    return result;
+}
 
-                v6_write_block(newSinglyIndirectBlockNumber, singlyIndirectBlockData, 2);
-                inode->addr[addrIndex] = newSinglyIndirectBlockNumber;
-            }
+int8_t v6_export_delta(Superblock *sb, char *deltaPath, V6DeltaReport *report) {
+    DeltaHeader header;
+    uint8_t *runData;
+    FILE *delta;
+    int8_t result;
+    uint32_t numBlocks;
 
-            uint16_t singlyIndirectBlockNumber = inode->addr[addrIndex];
-            size_t indexInSinglyIndirectBlock = index % 256U;
+    memset(report, 0, sizeof(*report));
 
-            v6_read_block(singlyIndirectBlockNumber, singlyIndirectBlockData, 2);
-            singlyIndirectBlockData[indexInSinglyIndirectBlock] = blockNumber;
-            v6_write_block(singlyIndirectBlockNumber, singlyIndirectBlockData, 2);
-        } else {
-            addrIndex = 7;
-            uint16_t doublyIndirectBlockData[256] = { 0 };
-            uint16_t singlyIndirectBlockData[256] = { 0 };
+    if (v6FileSystem == NULL) {
+        return E_FILE_SYSTEM_NULL;
+    }
 
-            if (inode->addr[addrIndex] == 0) {
-                uint16_t newDoublyIndirectBlockNumber = v6_alloc(sb);
+    if (changedBlocks == NULL) {
+        return E_INVALID_ARGUMENT;
+    }
 
-                if (newDoublyIndirectBlockNumber == 0) {
-                    return E_ALLOCATE_FAILURE;
-                }
+    // Journaled blocks go in place, so every changed block can be read back from the image.
+    result = v6_sync(sb);
+    if (result != 0) {
+        return result;
+    }
 
-                v6_write_block(newDoublyIndirectBlockNumber, doublyIndirectBlockData, 2);
-                inode->addr[addrIndex] = newDoublyIndirectBlockNumber;
-            }
+    delta = fopen(deltaPath, "wb");
+    if (delta == NULL) {
+        return E_FILE_OPEN_FAILURE;
+    }
 
-            uint16_t doublyIndirectBlockNumber = inode->addr[addrIndex];
-            size_t indexInDoublyIndirectBlock = index / 256U - 7U;
+    runData = malloc((size_t) MAX_BLOCK_RUN * imageFormat.blockSize);
+    if (runData == NULL) {
+        fclose(delta);
+        return E_ALLOCATE_FAILURE;
+    }
 
-            v6_read_block(doublyIndirectBlockNumber, doublyIndirectBlockData, 2);
+    numBlocks = changesHeader.numBlocks;
+    memset(&header, 0, sizeof(header));
+    header.magic = DELTA_MAGIC;
+    header.blockSize = imageFormat.blockSize;
+    header.numBlocks = numBlocks;
+    memcpy(header.checkpoint, changesHeader.checkpoint, CHECKPOINT_NAME_SIZE);
 
-            if (doublyIndirectBlockData[indexInDoublyIndirectBlock] == 0) {
-                uint16_t newSinglyIndirectBlockNumber = v6_alloc(sb);
+    // The header goes in again at the end, once the runs are counted.
+    if (fwrite(&header, sizeof(header), 1, delta) != 1) {
+        result = E_BLOCK_WRITE_FAILURE;
+    }
 
-                if (newSinglyIndirectBlockNumber == 0) {
-                    return E_ALLOCATE_FAILURE;
-                }
+    for (uint32_t blockNumber = 0; result == 0 && blockNumber < numBlocks;) {
+        DeltaRun run;
 
-                v6_write_block(newSinglyIndirectBlockNumber, singlyIndirectBlockData, 2);
+        if (!((changedBlocks[blockNumber / 8] >> (blockNumber % 8)) & 1U)) {
+            blockNumber++;
+            continue;
+        }
 
-                doublyIndirectBlockData[indexInDoublyIndirectBlock] = newSinglyIndirectBlockNumber;
-                v6_write_block(doublyIndirectBlockNumber, doublyIndirectBlockData, 2);
-            }
+        run.firstBlock = blockNumber;
+        run.count = 1;
+        while (blockNumber + run.count < numBlocks
+               && (changedBlocks[(blockNumber + run.count) / 8] >> ((blockNumber + run.count) % 8)) & 1U) {
+            run.count++;
+        }
+
+        if (fwrite(&run, sizeof(run), 1, delta) != 1) {
+            result = E_BLOCK_WRITE_FAILURE;
+            break;
+        }
 
-            uint16_t singlyIndirectBlockNumber = doublyIndirectBlockData[indexInDoublyIndirectBlock];
-            size_t indexInSinglyIndirectBlock = index % 256U;
+        for (uint32_t done = 0; result == 0 && done < run.count; done += MAX_BLOCK_RUN) {
+            size_t count = run.count - done < MAX_BLOCK_RUN ? run.count - done : MAX_BLOCK_RUN;
 
-            v6_read_block(singlyIndirectBlockNumber, singlyIndirectBlockData, 2);
-            singlyIndirectBlockData[indexInSinglyIndirectBlock] = blockNumber;
-            v6_write_block(singlyIndirectBlockNumber, singlyIndirectBlockData, 2);
+            result = deviceReadBlocks(blockNumber + done, count, runData);
+            if (result == 0 && fwrite(runData, imageFormat.blockSize, count, delta) != count) {
+                result = E_BLOCK_WRITE_FAILURE;
+            }
         }
-    } else {
-        if (index > 7) {
-            return E_INVALID_INDEX;
+
+        header.numRuns++;
+        report->changedBlocks += run.count;
+        blockNumber += run.count;
+    }
+
+    free(runData);
+
+    if (result == 0) {
+        report->bytes = (uint64_t) ftell(delta);
+        if (fseek(delta, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, delta) != 1
+            || fflush(delta) != 0 || fdatasync(fileno(delta)) != 0) {
+            result = E_BLOCK_WRITE_FAILURE;
         }
-        inode->addr[index] = blockNumber;
     }
 
-    return 0;
+    if (fclose(delta) != 0 && result == 0) {
+        result = E_BLOCK_WRITE_FAILURE;
+    }
+
+    memcpy(report->checkpoint, header.checkpoint, CHECKPOINT_NAME_SIZE);
+    report->numBlocks = numBlocks;
+    report->blockSize = imageFormat.blockSize;
+    report->runs = header.numRuns;
+
+    return result;
 }
 
-static uint16_t getSinglyIndirectBlockNumberAtIndex(Inode *inode, uint16_t index) {
-    if (inodeIsLargeFile(inode)) {
-        if (index >= MAX_SINGLY_INDIRECT_BLOCKS_PER_INODE) {
-            return 0;
-        }
+int8_t v6_apply_delta(char *deltaPath, char *imagePath, V6DeltaReport *report) {
+    DeltaHeader header;
+    DeltaRun run;
+    OverlayTrailer trailer;
+    struct stat deltaStat, imageStat, loadedStat;
+    uint8_t *runData = NULL;
+    FILE *delta;
+    off_t position;
+    int imageFd;
+    int8_t result = 0;
+
+    memset(report, 0, sizeof(*report));
+
+    delta = fopen(deltaPath, "rb");
+    if (delta == NULL) {
+        return E_FILE_OPEN_FAILURE;
+    }
 
-        if (index < 7) {
-            return inode->addr[index];
-        } else {
-            if (inode->addr[7] == 0) {
-                return 0;
-            } else {
-                uint16_t doublyIndirectBlockData[256];
-                v6_read_block(inode->addr[7], doublyIndirectBlockData, 2);
-                return doublyIndirectBlockData[index - 7];
-            }
+    imageFd = open(imagePath, O_RDWR);
+    if (imageFd < 0 || fstat(fileno(delta), &deltaStat) != 0 || fstat(imageFd, &imageStat) != 0) {
+        if (imageFd >= 0) {
+            close(imageFd);
         }
-    } else {
-        // I-node is not a large file. There are no singly indirect blocks.
-        return 0;
+        fclose(delta);
+        return E_FILE_OPEN_FAILURE;
     }
-}
 
-static void convertBytesToSuperblock(uint8_t *data, Superblock *sb) {
-    // I'm not sure if this notation is more or less readable than
-    // just using a bunch of "memcpy"s...
-    sb->isize = (uint16_t *) &data[0];
-    sb->fsize = (uint16_t *) &data[2];
-    sb->nfree = (uint16_t *) &data[4];
-    // Copy the 100 word (200 byte) free array.
-    memcpy(sb->free, &data[6], 200);
-    sb->ninode = (uint16_t *) &data[206];
-    // Copy the 100 word (200 byte) inode array.
-    memcpy(sb->inode, &data[208], 200);
-    sb->flock = data[408];
-    sb->ilock = data[409];
-    sb->fmod = data[410];
-    // Copy the 4 byte system time.
-    memcpy(sb->time, &data[411], 4);
-}
-
-static void convertSuperblockToBytes(Superblock* sb, uint8_t *data) {
-    memcpy(&data[0], &sb->isize, 2);
-    memcpy(&data[2], &sb->fsize, 2);
-    memcpy(&data[4], &sb->nfree, 2);
-    memcpy(&data[6], sb->free, 200);
-    memcpy(&data[206], &sb->ninode, 2);
-    memcpy(&data[208], sb->inode, 200);
-    memcpy(&data[408], &sb->flock, 1);
-    memcpy(&data[409], &sb->ilock, 1);
-    memcpy(&data[410], &sb->fmod, 1);
-    memcpy(&data[411], sb->time, 4);
-}
-
-static void convertBytesToInode(uint8_t *data, Inode *inode) {
-    memcpy(&inode->flags, &data[0], 2);
-    memcpy(&inode->nlinks, &data[2], 1);
-    memcpy(&inode->uid, &data[3], 1);
-    memcpy(&inode->gid, &data[4], 1);
-    memcpy(&inode->size0, &data[5], 1);
-    memcpy(&inode->size1, &data[6], 2);
-    memcpy(inode->addr, &data[8], 16);
-    memcpy(inode->actime, &data[24], 4);
-    memcpy(inode->modtime, &data[28], 4);
-}
-
-static void convertInodeToBytes(Inode *inode, uint8_t *data) {
-    memcpy(&data[0], &inode->flags, 2);
-    memcpy(&data[2], &inode->nlinks, 1);
-    memcpy(&data[3], &inode->uid, 1);
-    memcpy(&data[4], &inode->gid, 1);
-    memcpy(&data[5], &inode->size0, 1);
-    memcpy(&data[6], &inode->size1, 2);
-    memcpy(&data[8], inode->addr, 16);
-    memcpy(&data[24], inode->actime, 4);
-    memcpy(&data[28], inode->modtime, 4);
-}
+    // Writing under the loaded image would leave the cache and the superblock in memory stale, and
+    // writing into a clone would skip its presence bitmap.
+    if ((v6FileSystem != NULL && fstat(fileno(v6FileSystem), &loadedStat) == 0
+         && loadedStat.st_dev == imageStat.st_dev && loadedStat.st_ino == imageStat.st_ino)
+        || (imageStat.st_size >= (off_t) sizeof(trailer)
+            && pread(imageFd, &trailer, sizeof(trailer), imageStat.st_size - (off_t) sizeof(trailer))
+               == (ssize_t) sizeof(trailer)
+            && trailer.magic == OVERLAY_MAGIC)) {
+        result = E_INVALID_ARGUMENT;
+    }
 
-static uint16_t inodeIsDirectory(Inode *inode) {
-    if (inode == NULL) {
-        return 0;
+    if (result == 0 && fread(&header, sizeof(header), 1, delta) != 1) {
+        result = E_BLOCK_READ_FAILURE;
     }
 
-    if ((inode->flags & FLAG_FILE_TYPE) == FILE_TYPE_DIRECTORY) {
-        return 1;
+    if (result == 0 && (header.magic != DELTA_MAGIC || header.blockSize < MIN_BLOCK_SIZE
+                        || header.blockSize > MAX_BLOCK_SIZE || (header.blockSize & (header.blockSize - 1)) != 0)) {
+        result = E_INVALID_ARGUMENT;
     }
 
-    return 0;
-}
+    // The whole delta is checked before anything is written, so a truncated one changes nothing.
+    position = (off_t) sizeof(header);
+    for (uint32_t i = 0; result == 0 && i < header.numRuns; i++) {
+        if (fread(&run, sizeof(run), 1, delta) != 1 || run.count == 0 || run.firstBlock > header.numBlocks
+            || run.count > header.numBlocks - run.firstBlock) {
+            result = E_INVALID_ARGUMENT;
+            break;
+        }
+        position += (off_t) sizeof(run) + (off_t) run.count * header.blockSize;
+        if (position > deltaStat.st_size || fseek(delta, position, SEEK_SET) != 0) {
+            result = E_INVALID_ARGUMENT;
+        }
+    }
+    if (result == 0 && position != deltaStat.st_size) {
+        result = E_INVALID_ARGUMENT;
+    }
 
-static uint16_t inodeIsLargeFile(Inode *inode) {
-    if (inode == NULL) {
-        return 0;
+    if (result == 0) {
+        runData = malloc((size_t) MAX_BLOCK_RUN * header.blockSize);
+        if (runData == NULL) {
+            result = E_ALLOCATE_FAILURE;
+        }
     }
 
-    if (inode->flags & FLAG_LARGE_FILE) {
-        return 1;
+    // The image takes the size of the one the delta came from, in case that was made over.
+    if (result == 0 && (fseek(delta, sizeof(header), SEEK_SET) != 0
+                        || (imageStat.st_size != (off_t) header.numBlocks * header.blockSize
+                            && ftruncate(imageFd, (off_t) header.numBlocks * header.blockSize) != 0))) {
+        result = E_BLOCK_WRITE_FAILURE;
     }
 
-    return 0;
-}
+    for (uint32_t i = 0; result == 0 && i < header.numRuns; i++) {
+        if (fread(&run, sizeof(run), 1, delta) != 1) {
+            result = E_BLOCK_READ_FAILURE;
+            break;
+        }
 
-static size_t getBlockAddress(uint16_t blockNumber) {
-    return blockNumber * 512U;
-}
+        for (uint32_t done = 0; result == 0 && done < run.count; done += MAX_BLOCK_RUN) {
+            size_t count = run.count - done < MAX_BLOCK_RUN ? run.count - done : MAX_BLOCK_RUN;
+            size_t runBytes = count * header.blockSize;
 
-static uint32_t getFileSize(Inode *inode) {
-    uint32_t fileSize = 0;
+            if (fread(runData, header.blockSize, count, delta) != count) {
+                result = E_BLOCK_READ_FAILURE;
+            } else if (pwrite(imageFd, runData, runBytes, (off_t) (run.firstBlock + done) * header.blockSize)
+                       != (ssize_t) runBytes) {
+                result = E_BLOCK_WRITE_FAILURE;
+            }
+        }
 
-    if (inode->flags & FLAG_FILE_SIZE_MSB) {
-        fileSize |= 1UL << 25;
+        report->changedBlocks += run.count;
+        report->runs++;
     }
 
-    fileSize |= (inode->size0 << 16) | inode->size1;
+    if (result == 0 && fdatasync(imageFd) != 0) {
+        result = E_BLOCK_WRITE_FAILURE;
+    }
 
-    return fileSize;
-}
+    free(runData);
+    close(imageFd);
+    fclose(delta);
 
-static void setFileSize(Inode *inode, uint32_t fileSize) {
-    if (fileSize & (1UL << 25)) {
-        inode->flags |= FLAG_FILE_SIZE_MSB;
+    if (result == 0) {
+        memcpy(report->checkpoint, header.checkpoint, CHECKPOINT_NAME_SIZE);
+        report->checkpoint[CHECKPOINT_NAME_SIZE - 1] = '\0';
+        report->numBlocks = header.numBlocks;
+        report->blockSize = header.blockSize;
+        report->bytes = (uint64_t) deltaStat.st_size;
     }
 
-    inode->size0 = (uint8_t) ((fileSize >> 16) & 0xFF);
-    inode->size1 = (uint16_t) fileSize;
+    return result;
 }
 
-// TODO: Fix issue with breaking after 30 path items
-static char** tokenizeFilePath(char *filePath, size_t *numPathItems) {
-    char** filePathTokens = malloc(sizeof(char*) * 30);
-    size_t count = 0;
-    char* filename = strtok(filePath, "/");
+int8_t v6_set_durability(Superblock *sb, uint8_t mode, uint32_t intervalMs) {
+    int8_t result = 0;
 
-    while (filename != NULL) {
-        filePathTokens[count] = filename;
-        count++;
+    if (mode > DURABILITY_INTERVAL || (mode == DURABILITY_INTERVAL && intervalMs == 0)) {
+        return E_INVALID_ARGUMENT;
+    }
 
-        filename = strtok(NULL, "/");
+    if (sb == NULL || v6FileSystem == NULL) {
+        return E_FILE_SYSTEM_NULL;
     }
 
-    *numPathItems = count;
+    flusherStop();
 
-    return filePathTokens;
-}
\ No newline at end of file
+    durabilityMode = mode;
+    durabilityIntervalMs = intervalMs;
+    clock_gettime(CLOCK_MONOTONIC, &durabilityLastCommit);
+
+    if (mode == DURABILITY_INTERVAL) {
+        result = flusherStart();
+        if (result != 0) {
+            durabilityMode = DURABILITY_NONE;
+        }
+    }
+
+    return result;
+}
+
+int v6_durability_fd(void) {
+    return flusherRunning ? flusherWakePipe[0] : -1;
+}
+
+int8_t v6_durability_commit(Superblock *sb) {
+    uint8_t drained[64];
+
+    if (flusherRunning) {
+        while (read(flusherWakePipe[0], drained, sizeof(drained)) > 0) {
+        }
+    }
+
+    if (atomic_exchange(&commitPending, 0) == 0 || journalCapturing == 0 || journalSb != sb) {
+        return 0;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &durabilityLastCommit);
+
+    return journalCommit();
+}
+
+int8_t v6_walk(Superblock *sb, char *v6Path, V6WalkCallback callback, void *userData) {
+    WalkDirectory *level = NULL, *nextLevel = NULL;
+    size_t levelCount = 0, nextLevelCount = 0, nextLevelCapacity = 0;
+    uint8_t *inodeTable;
+    V6DirectoryEntry entry = { 0 };
+    char *startPath;
+    uint16_t startInodeNumber;
+    int8_t result = 0;
+    int stop = 0;
+
+    // Resolve the start before anything else, since the lookup tokenizes v6Path in place.
+    startPath = malloc(strlen(v6Path) + 2);
+    if (startPath == NULL) {
+        return E_ALLOCATE_FAILURE;
+    }
+    strcpy(startPath, v6Path[0] == '/' ? "" : "/");
+    strcat(startPath, v6Path);
+    if (strlen(startPath) > 1 && startPath[strlen(startPath) - 1] == '/') {
+        startPath[strlen(startPath) - 1] = '\0';
+    }
+
+    scratchEnter();
+    startInodeNumber = getTerminalInodeNumber(sb, v6Path);
+    scratchLeave();
+    if (startInodeNumber == 0) {
+        free(startPath);
+        return E_NO_SUCH_FILE;
+    }
+
+    // Every i-node the walk needs comes out of one sequential read of the whole i-node table.
+    inodeTable = malloc((size_t) sb->isize * imageFormat.blockSize);
+    if (inodeTable == NULL) {
+        free(startPath);
+        return E_ALLOCATE_FAILURE;
+    }
+    if (deviceReadBlocks(2, sb->isize, inodeTable) != 0) {
+        free(inodeTable);
+        free(startPath);
+        return E_BLOCK_READ_FAILURE;
+    }
+
+    entry.inodeNumber = startInodeNumber;
+    strncpy(entry.name, strrchr(startPath, '/') + 1, 14);
+    imageFormat.inodeFromDisk(&inodeTable[(startInodeNumber - 1) * imageFormat.inodeSize], &entry.inode);
+    entry.size = getFileSize(&entry.inode);
+
+    stop = callback(startPath, &entry, 0, userData);
+
+    if (stop != 0 || inodeIsDirectory(&entry.inode) == 0) {
+        free(inodeTable);
+        free(startPath);
+        return 0;
+    }
+
+    level = malloc(sizeof(WalkDirectory));
+    if (level == NULL) {
+        free(inodeTable);
+        free(startPath);
+        return E_ALLOCATE_FAILURE;
+    }
+    level[0].inodeNumber = startInodeNumber;
+    level[0].path = startPath;
+    levelCount = 1;
+
+    // Walk one depth at a time so that each level's directory blocks can be read in block order.
+    for (int depth = 1; levelCount > 0 && result == 0 && stop == 0; depth++) {
+        BlockList blocks = { 0 };
+        BlockList indirectBlocks = { 0 };
+        size_t *firstBlockOfDirectory = malloc(sizeof(size_t) * (levelCount + 1));
+        uint8_t *blockData = NULL;
+
+        if (firstBlockOfDirectory == NULL) {
+            result = E_ALLOCATE_FAILURE;
+            break;
+        }
+
+        for (size_t i = 0; i < levelCount && result == 0; i++) {
+            Inode directoryInode;
+
+            imageFormat.inodeFromDisk(&inodeTable[(level[i].inodeNumber - 1) * imageFormat.inodeSize], &directoryInode);
+            firstBlockOfDirectory[i] = blocks.count;
+            result = collectInodeBlocks(&directoryInode, &blocks, &indirectBlocks);
+        }
+        firstBlockOfDirectory[levelCount] = blocks.count;
+
+        if (result == 0 && blocks.count > 0) {
+            blockData = malloc(blocks.count * imageFormat.blockSize);
+            result = blockData == NULL ? E_ALLOCATE_FAILURE : readBlocksInBlockOrder(&blocks, blockData);
+        }
+
+        for (size_t i = 0; i < levelCount && result == 0 && stop == 0; i++) {
+            size_t pathLength = strlen(level[i].path);
+
+            for (size_t b = firstBlockOfDirectory[i]; b < firstBlockOfDirectory[i + 1] && result == 0 && stop == 0; b++) {
+                for (size_t j = 0; j < imageFormat.entriesPerBlock && result == 0 && stop == 0; j++) {
+                    DiskDirectoryEntry *diskEntry = (DiskDirectoryEntry *) &blockData[b * imageFormat.blockSize] + j;
+                    char *childPath;
+
+                    entry.inodeNumber = diskEntry->inodeNumber;
+                    memcpy(entry.name, diskEntry->name, sizeof(diskEntry->name));
+                    entry.name[14] = '\0';
+
+                    if (entry.inodeNumber == 0 || entry.inodeNumber > getNumInodes(sb)
+                        || strcmp(entry.name, ".") == 0 || strcmp(entry.name, "..") == 0) {
+                        continue;
+                    }
+
+                    imageFormat.inodeFromDisk(&inodeTable[(entry.inodeNumber - 1) * imageFormat.inodeSize], &entry.inode);
+                    entry.size = getFileSize(&entry.inode);
+
+                    childPath = malloc(pathLength + strlen(entry.name) + 2);
+                    if (childPath == NULL) {
+                        result = E_ALLOCATE_FAILURE;
+                        break;
+                    }
+                    sprintf(childPath, "%s/%s", pathLength == 1 ? "" : level[i].path, entry.name);
+
+                    stop = callback(childPath, &entry, depth, userData);
+
+                    if (stop != 0 || inodeIsDirectory(&entry.inode) == 0) {
+                        free(childPath);
+                        continue;
+                    }
+
+                    if (nextLevelCount == nextLevelCapacity) {
+                        size_t newCapacity = nextLevelCapacity == 0 ? 16 : nextLevelCapacity * 2;
+                        WalkDirectory *newLevel = realloc(nextLevel, newCapacity * sizeof(WalkDirectory));
+
+                        if (newLevel == NULL) {
+                            free(childPath);
+                            result = E_ALLOCATE_FAILURE;
+                            break;
+                        }
+                        nextLevel = newLevel;
+                        nextLevelCapacity = newCapacity;
+                    }
+
+                    nextLevel[nextLevelCount].inodeNumber = entry.inodeNumber;
+                    nextLevel[nextLevelCount].path = childPath;
+                    nextLevelCount++;
+                }
+            }
+        }
+
+        for (size_t i = 0; i < levelCount; i++) {
+            free(level[i].path);
+        }
+        free(level);
+        free(firstBlockOfDirectory);
+        free(blockData);
+        free(blocks.blocks);
+        free(indirectBlocks.blocks);
+
+        level = nextLevel;
+        levelCount = nextLevelCount;
+        nextLevel = NULL;
+        nextLevelCount = 0;
+        nextLevelCapacity = 0;
+    }
+
+    for (size_t i = 0; i < levelCount; i++) {
+        free(level[i].path);
+    }
+    free(level);
+    free(inodeTable);
+
+    return result;
+}
+
+int8_t v6_defrag(Superblock *sb, uint32_t maxBlocks, uint32_t pauseMs, V6DefragCallback callback,
+                 void *userData, V6DefragReport *report) {
+    int8_t result;
+
+    beginOperation(sb);
+    result = defragImage(sb, maxBlocks, pauseMs, callback, userData, report);
+
+    return endOperation(sb) == 0 ? result : E_BLOCK_WRITE_FAILURE;
+}
+
+int8_t v6_compact(Superblock *sb, char *v6DirectoryPath, V6CompactReport *report) {
+    int8_t result;
+
+    beginOperation(sb);
+    result = compactDirectories(sb, v6DirectoryPath, report);
+
+    return endOperation(sb) == 0 ? result : E_BLOCK_WRITE_FAILURE;
+}
+
+int8_t v6_locality(Superblock *sb, char *v6Path, V6LocalityReport *report) {
+    int8_t result;
+
+    scratchEnter();
+    result = measureLocality(sb, v6Path, report);
+    scratchLeave();
+
+    return result;
+}
+
+int8_t v6_quit(Superblock *sb) {
+    int8_t writeSuccess;
+
+    warmupStop();
+    flusherStop();
+
+    scratchEnter();
+    writeSuccess = reclaimPendingInodes(sb);
+    scratchLeave();
+
+    if (writeSuccess != 0) {
+        return writeSuccess;
+    }
+
+    if (sb->fmod) {
+        writeSuccess = superblockSave(sb);
+        if (writeSuccess != 0) {
+            return writeSuccess;
+        }
+    }
+
+    if (journalCapturing) {
+        writeSuccess = journalCommit();
+        if (writeSuccess == 0) {
+            writeSuccess = journalCheckpoint();
+        }
+        if (writeSuccess != 0) {
+            return writeSuccess;
+        }
+    } else if (durabilityMode != DURABILITY_NONE && deviceSync() != 0) {
+        return E_BLOCK_WRITE_FAILURE;
+    }
+
+    // The journal file stays behind, empty, so journaling is back on the next time this is loaded.
+    journalClose();
+
+    fclose(v6FileSystem);
+    v6FileSystem = NULL;
+    overlayClose();
+    changesClose();
+
+    // Everything held for the session goes with it, so a leak checker sees nothing left behind.
+    scratchRelease();
+    free(journalBlocks);
+    journalBlocks = NULL;
+    journalCapacity = 0;
+    free(journalSlots);
+    journalSlots = NULL;
+    journalSlotCount = 0;
+    free(journalPath);
+    journalPath = NULL;
+    free(changesPath);
+    changesPath = NULL;
+    free(freeInodeMap);
+    freeInodeMap = NULL;
+    freeInodeMapWords = 0;
+    free(allocationGroups);
+    allocationGroups = NULL;
+    allocationGroupCount = 0;
+    free(blockBitmap);
+    blockBitmap = NULL;
+    free(blockBitmapDirty);
+    blockBitmapDirty = NULL;
+    blockBitmapBlocks = 0;
+    free(blockCache);
+    blockCache = NULL;
+    free(warmupWrittenBlocks);
+    warmupWrittenBlocks = NULL;
+    warmupWrittenWords = 0;
+    free(sb);
+
+    return 0;
+}
+
+/*
+ * Allocates a new block number where the v6 file system can write.
+ *
+ * Returns 0 if a block could not be allocated.
+ */
+static uint32_t v6_alloc(Superblock *sb) {
+    uint32_t freeBlockNumber;
+    // Stores data read from the next free list block.
+    uint8_t blockData[MAX_BLOCK_SIZE];
+    uint32_t nfree;
+    int8_t blockReadSuccess;
+
+    if (sb->ngroups > 0) {
+        freeBlockNumber = allocateGroupBlock(sb);
+        if (freeBlockNumber == 0 && sb->nreclaim > 0 && reclaimPendingInodes(sb) == 0) {
+            freeBlockNumber = allocateGroupBlock(sb);
+        }
+        return freeBlockNumber;
+    }
+
+    if (sb->nfree == 0 || (sb->nfree == 1 && sb->free[0] == 0)) {
+        // The free list is exhausted. Blocks of removed files may still be waiting to be reclaimed.
+        if (sb->nreclaim == 0 || reclaimPendingInodes(sb) != 0) {
+            return 0;
+        }
+        if (sb->nfree == 0 || (sb->nfree == 1 && sb->free[0] == 0)) {
+            return 0;
+        }
+    }
+
+    sb->nfree--;
+    sb->fmod = 1;
+    freeBlockNumber = sb->free[sb->nfree];
+
+    if (sb->nfree == 0) {
+        blockReadSuccess = v6_read_block(freeBlockNumber, blockData);
+
+        if (blockReadSuccess != 0) {
+            return 0;
+        }
+
+        // The chain block starts with its count, as wide as a block address.
+        nfree = getBlockAddressAt(blockData, 0);
+        if (nfree > imageFormat.freeArraySize) {
+            return 0;
+        }
+        sb->nfree = (uint16_t) nfree;
+        imageFormat.readAddresses(blockData, 1, sb->free, sb->nfree);
+
+        // The committed superblock still links to this block's free list, so whatever is written
+        // over it has to go through the journal too.
+        if (journalCapturing) {
+            journalAddBlock(freeBlockNumber, blockData);
+        }
+    }
+
+    return freeBlockNumber;
+}
+
+/*
+ * Frees the given block number. Updates the superblock accordingly.
+ */
+static int8_t v6_free(Superblock *sb, uint32_t blockNumber) {
+    // One block to buffer write data. The part past the free list is zeroed when it's written.
+    uint8_t blockData[MAX_BLOCK_SIZE];
+    int8_t blockWriteSuccess;
+
+    if (sb->ngroups > 0) {
+        return freeGroupBlock(sb, blockNumber);
+    }
+
+    if (blockNumber < 2 || blockNumber >= sb->fsize) {
+        return E_INVALID_BLOCK_NUMBER;
+    }
+
+    if (sb->nfree == imageFormat.freeArraySize) {
+        memset(blockData, 0, imageFormat.blockSize);
+        setBlockAddressAt(blockData, 0, sb->nfree);
+        imageFormat.writeAddresses(blockData, 1, sb->free, sb->nfree);
+
+        blockWriteSuccess = v6_write_block(blockNumber, blockData);
+        if (blockWriteSuccess != 0) {
+            return blockWriteSuccess;
+        }
+
+        sb->nfree = 0;
+    }
+
+    sb->free[sb->nfree] = blockNumber;
+    sb->nfree++;
+    sb->fmod = 1;
+
+    return 0;
+}
+
+/*
+ * Read a single block from the file system.
+ * Assumes that data can hold one block's worth of bytes (imageFormat.blockSize).
+ *
+ * blockNumber - the block number from which to read
+ * data - the array where the data will be stored
+ *
+ * returns 0 if the entire block could be read
+ */
+static int8_t v6_read_block(uint32_t blockNumber, void *data) {
+    uint8_t *cachedData = getCachedBlock(blockNumber);
+
+    if (cachedData == NULL) {
+        return E_BLOCK_READ_FAILURE;
+    }
+
+    memcpy(data, cachedData, imageFormat.blockSize);
+
+    return 0;
+}
+
+/*
+ * Write a single block to the file system and the block cache.
+ *
+ * data may be the block's own cache slot, changed in place through getCachedBlock. If the write
+ * fails the slot is then dropped, so the cache never holds data the disk doesn't.
+ */
+static int8_t v6_write_block(uint32_t blockNumber, void *data) {
+    uint8_t *cachedData;
+    int8_t writeSuccess;
+
+    if (journalCapturing) {
+        writeSuccess = journalAddBlock(blockNumber, data);
+    } else {
+        writeSuccess = deviceWriteBlock(blockNumber, data);
+    }
+
+    cachedData = blockCacheLookup(blockNumber);
+
+    if (writeSuccess != 0) {
+        if (cachedData != NULL && cachedData == data) {
+            blockCacheInvalidate(blockNumber);
+        }
+        return writeSuccess;
+    }
+
+    if (cachedData == NULL) {
+        cachedData = blockCacheInsert(blockNumber);
+    }
+    if (cachedData != NULL && cachedData != data) {
+        memcpy(cachedData, data, imageFormat.blockSize);
+    }
+
+    return 0;
+}
+
+/*
+ * Returns the cached contents of a block, reading it from disk first if it isn't cached.
+ * The pointer is only valid until the next block is read or written.
+ *
+ * Returns NULL if the block could not be read.
+ */
+static uint8_t* getCachedBlock(uint32_t blockNumber) {
+    static uint8_t uncachedData[MAX_BLOCK_SIZE];
+    uint8_t *cachedData;
+
+    warmupInstall();
+
+    cachedData = blockCacheLookup(blockNumber);
+
+    if (cachedData != NULL) {
+        return cachedData;
+    }
+
+    cachedData = blockCacheInsert(blockNumber);
+    if (cachedData == NULL) {
+        // The cache could not be allocated. Fall back to reading straight from disk.
+        cachedData = uncachedData;
+    }
+
+    if (deviceReadBlock(blockNumber, cachedData) != 0) {
+        if (cachedData != uncachedData) {
+            // Don't leave a slot claiming to hold data it doesn't have.
+            blockCacheReset();
+        }
+        return NULL;
+    }
+
+    return cachedData;
+}
+
+static uint8_t* blockCacheLookup(uint32_t blockNumber) {
+    int32_t slot;
+
+    if (blockCache == NULL) {
+        return NULL;
+    }
+
+    slot = blockCacheBuckets[blockNumber % BLOCK_CACHE_BUCKETS];
+
+    while (slot >= 0) {
+        if (blockCache[slot].blockNumber == blockNumber) {
+            blockCache[slot].referenced = 1;
+            return blockCache[slot].data;
+        }
+        slot = blockCache[slot].nextInBucket;
+    }
+
+    return NULL;
+}
+
+/*
+ * Claims a cache slot for the block, evicting the first unreferenced block the clock hand finds.
+ * The caller fills in the returned data.
+ */
+static uint8_t* blockCacheInsert(uint32_t blockNumber) {
+    CachedBlock *victim;
+    int32_t *link;
+    int32_t victimSlot;
+
+    if (blockCache == NULL) {
+        return NULL;
+    }
+
+    while (blockCache[blockCacheHand].valid && blockCache[blockCacheHand].referenced) {
+        blockCache[blockCacheHand].referenced = 0;
+        blockCacheHand = (blockCacheHand + 1) % BLOCK_CACHE_SIZE;
+    }
+
+    victimSlot = (int32_t) blockCacheHand;
+    victim = &blockCache[victimSlot];
+    blockCacheHand = (blockCacheHand + 1) % BLOCK_CACHE_SIZE;
+
+    if (victim->valid) {
+        // Unlink the evicted block from its bucket.
+        link = &blockCacheBuckets[victim->blockNumber % BLOCK_CACHE_BUCKETS];
+        while (*link != victimSlot) {
+            link = &blockCache[*link].nextInBucket;
+        }
+        *link = victim->nextInBucket;
+    }
+
+    victim->blockNumber = blockNumber;
+    victim->valid = 1;
+    victim->referenced = 1;
+    victim->nextInBucket = blockCacheBuckets[blockNumber % BLOCK_CACHE_BUCKETS];
+    blockCacheBuckets[blockNumber % BLOCK_CACHE_BUCKETS] = victimSlot;
+
+    return victim->data;
+}
+
+/*
+ * Drops a block from the cache, if it is there. Used when a block is written without going
+ * through v6_write_block.
+ */
+static void blockCacheInvalidate(uint32_t blockNumber) {
+    int32_t *link;
+
+    warmupNoteWrite(blockNumber);
+
+    if (blockCache == NULL) {
+        return;
+    }
+
+    link = &blockCacheBuckets[blockNumber % BLOCK_CACHE_BUCKETS];
+
+    while (*link >= 0) {
+        CachedBlock *cachedBlock = &blockCache[*link];
+
+        if (cachedBlock->blockNumber == blockNumber) {
+            *link = cachedBlock->nextInBucket;
+            cachedBlock->valid = 0;
+            cachedBlock->referenced = 0;
+            return;
+        }
+        link = &cachedBlock->nextInBucket;
+    }
+}
+
+/*
+ * Empties the block cache. Called whenever a different file system is loaded or initialized.
+ */
+static void blockCacheReset(void) {
+    if (blockCache == NULL) {
+        blockCache = malloc(sizeof(CachedBlock) * BLOCK_CACHE_SIZE);
+    }
+
+    for (size_t i = 0; i < BLOCK_CACHE_BUCKETS; i++) {
+        blockCacheBuckets[i] = -1;
+    }
+
+    if (blockCache != NULL) {
+        for (size_t i = 0; i < BLOCK_CACHE_SIZE; i++) {
+            blockCache[i].valid = 0;
+            blockCache[i].referenced = 0;
+        }
+    }
+
+    blockCacheHand = 0;
+}
+
+/*
+ * Body of the warmup thread. Only touches the job and the image files, through pread, so it never
+ * races with the block cache or the stdio stream used by everything else.
+ */
+static void *warmupMain(void *arg) {
+    WarmupJob *job = arg;
+    struct timespec end;
+    const size_t blockSize = imageFormat.blockSize;
+    uint8_t *inodeTable = malloc((size_t) job->isize * blockSize);
+
+    if (inodeTable != NULL) {
+        size_t inodeTableBlocks = 0;
+
+        // The whole i-node table in one sequential pass.
+        for (size_t runStart = 0; runStart < job->isize; runStart += MAX_BLOCK_RUN) {
+            size_t runLength = job->isize - runStart < MAX_BLOCK_RUN ? job->isize - runStart : MAX_BLOCK_RUN;
+            ssize_t bytesRead = pread(job->fd, &inodeTable[runStart * blockSize], runLength * blockSize,
+                                      (off_t) getBlockAddress((uint32_t) (runStart + 2)));
+
+            if (bytesRead != (ssize_t) (runLength * blockSize)
+                || overlayReadBase(job->overlayPresent, job->baseFd, (uint32_t) (runStart + 2), runLength,
+                                   &inodeTable[runStart * blockSize]) != 0) {
+                break;
+            }
+            inodeTableBlocks += runLength;
+        }
+        job->blocksRead += (uint32_t) inodeTableBlocks;
+
+        // Path walks start at the root directory, so it goes in first, then the i-node blocks.
+        if (inodeTableBlocks > 0) {
+            warmupStageDirectory(job, inodeTable, 1);
+        }
+        for (size_t i = 0; i < inodeTableBlocks && job->numStaged < BLOCK_CACHE_SIZE; i++) {
+            job->blockNumbers[job->numStaged] = (uint32_t) (i + 2);
+            memcpy(&job->blockData[job->numStaged * blockSize], &inodeTable[i * blockSize], blockSize);
+            job->numStaged++;
+        }
+
+        for (size_t inodeNumber = 2; job->allDirectories && inodeNumber <= inodeTableBlocks * imageFormat.inodesPerBlock
+                                     && inodeNumber <= 65535 && job->numStaged < BLOCK_CACHE_SIZE; inodeNumber++) {
+            warmupStageDirectory(job, inodeTable, (uint16_t) inodeNumber);
+        }
+
+        free(inodeTable);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    job->seconds = (double) (end.tv_sec - job->start.tv_sec) + (double) (end.tv_nsec - job->start.tv_nsec) / 1e9;
+
+    atomic_store(&warmupState, WARMUP_LOADED);
+
+    return NULL;
+}
+
+/*
+ * Reads the blocks of a directory into the warmup job until it is full. Does nothing if the
+ * i-node isn't an allocated directory.
+ */
+static void warmupStageDirectory(WarmupJob *job, uint8_t *inodeTable, uint16_t inodeNumber) {
+    uint8_t indirectBlockData[MAX_BLOCK_SIZE];
+    uint32_t blockNumbers[MAX_ADDRESSES_PER_BLOCK];
+    size_t numBlocks;
+    Inode inode;
+
+    imageFormat.inodeFromDisk(&inodeTable[(inodeNumber - 1) * imageFormat.inodeSize], &inode);
+
+    if ((inode.flags & FLAG_INODE_ALLOCATED) == 0 || inodeIsDirectory(&inode) == 0) {
+        return;
+    }
+
+    numBlocks = (getFileSize(&inode) + imageFormat.blockSize - 1) / imageFormat.blockSize;
+
+    if (inodeIsLargeFile(&inode) == 0 && numBlocks > 8) {
+        numBlocks = 8;
+    }
+
+    // Directories never grow big enough to need more than singly indirect blocks.
+    for (size_t addrIndex = 0; addrIndex < 8 && numBlocks > 0; addrIndex++) {
+        size_t count = 1;
+
+        if (inode.addr[addrIndex] == 0) {
+            break;
+        }
+
+        if (inodeIsLargeFile(&inode)) {
+            if (imageFormat.addressLevels[addrIndex] != 1
+                || warmupReadBlock(job, inode.addr[addrIndex], indirectBlockData) != 0) {
+                return;
+            }
+            count = numBlocks < imageFormat.addressesPerBlock ? numBlocks : imageFormat.addressesPerBlock;
+            imageFormat.readAddresses(indirectBlockData, 0, blockNumbers, count);
+        } else {
+            blockNumbers[0] = inode.addr[addrIndex];
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            if (job->numStaged == BLOCK_CACHE_SIZE) {
+                return;
+            }
+            if (blockNumbers[i] == 0) {
+                continue;
+            }
+            if (warmupReadBlock(job, blockNumbers[i],
+                                &job->blockData[job->numStaged * imageFormat.blockSize]) != 0) {
+                return;
+            }
+            job->blockNumbers[job->numStaged] = blockNumbers[i];
+            job->numStaged++;
+        }
+
+        numBlocks -= count;
+    }
+}
+
+static int8_t warmupReadBlock(WarmupJob *job, uint32_t blockNumber, void *data) {
+    if (pread(job->fd, data, imageFormat.blockSize, (off_t) getBlockAddress(blockNumber))
+        != (ssize_t) imageFormat.blockSize
+        || overlayReadBase(job->overlayPresent, job->baseFd, blockNumber, 1, data) != 0) {
+        return E_BLOCK_READ_FAILURE;
+    }
+
+    job->blocksRead++;
+
+    return 0;
+}
+
+/*
+ * Once the warmup thread is done, moves what it read into the block cache. Blocks written since
+ * the warmup started are skipped, since the copy read may be older than the write, and so are
+ * blocks that have been cached since.
+ */
+static void warmupInstall(void) {
+    if (atomic_load(&warmupState) != WARMUP_LOADED) {
+        return;
+    }
+
+    pthread_join(warmupThread, NULL);
+
+    for (size_t i = 0; i < warmupJob.numStaged; i++) {
+        uint32_t blockNumber = warmupJob.blockNumbers[i];
+        uint8_t *cachedData;
+
+        if (blockNumber / 64 >= warmupWrittenWords || (warmupWrittenBlocks[blockNumber / 64] >> (blockNumber % 64)) & 1U) {
+            continue;
+        }
+        // The warmup read the copy in place, which is older than a journaled one.
+        if (journalLookup(blockNumber) != NULL) {
+            continue;
+        }
+        if (blockCacheLookup(blockNumber) != NULL) {
+            continue;
+        }
+
+        cachedData = blockCacheInsert(blockNumber);
+        if (cachedData == NULL) {
+            break;
+        }
+        memcpy(cachedData, &warmupJob.blockData[i * imageFormat.blockSize], imageFormat.blockSize);
+        warmupJob.blocksCached++;
+    }
+
+    free(warmupJob.blockNumbers);
+    free(warmupJob.blockData);
+    free(warmupJob.overlayPresent);
+    warmupJob.blockNumbers = NULL;
+    warmupJob.blockData = NULL;
+    warmupJob.overlayPresent = NULL;
+    warmupJob.numStaged = 0;
+
+    atomic_store(&warmupState, WARMUP_FINISHED);
+}
+
+/*
+ * Waits for a running warmup and throws away what it read. Called before the image file is
+ * closed or replaced.
+ */
+static void warmupStop(void) {
+    int state = atomic_load(&warmupState);
+
+    if (state == WARMUP_RUNNING || state == WARMUP_LOADED) {
+        pthread_join(warmupThread, NULL);
+        free(warmupJob.blockNumbers);
+        free(warmupJob.blockData);
+        free(warmupJob.overlayPresent);
+        warmupJob.blockNumbers = NULL;
+        warmupJob.blockData = NULL;
+        warmupJob.overlayPresent = NULL;
+    }
+
+    atomic_store(&warmupState, WARMUP_NOT_STARTED);
+}
+
+/*
+ * Records that a block has been written behind the back of a warmup, from when it starts until
+ * warmupInstall has moved what it read into the cache. A finished warmup that hasn't been
+ * installed yet still holds copies older than the write.
+ */
+static void warmupNoteWrite(uint32_t blockNumber) {
+    int state = atomic_load_explicit(&warmupState, memory_order_relaxed);
+
+    if ((state == WARMUP_RUNNING || state == WARMUP_LOADED) && blockNumber / 64 < warmupWrittenWords) {
+        warmupWrittenBlocks[blockNumber / 64] |= 1ULL << (blockNumber % 64);
+    }
+}
+
+/*
+ * Called at the start of every operation that changes the file system. Operations never share a
+ * journal transaction with a half finished one, so this is where a group of them is committed once
+ * it is big enough.
+ */
+static void beginOperation(Superblock *sb) {
+    scratchEnter();
+
+    if (journalCapturing && journalSb == sb
+        && (journalRunningOperations >= JOURNAL_GROUP_OPERATIONS || journalRunningBlocks >= JOURNAL_GROUP_BLOCKS)) {
+        journalCommit();
+    }
+
+    journalRunningOperations++;
+}
+
+/*
+ * Called at the end of every operation that changes the file system, to make its changes as
+ * durable as the durability mode asks for.
+ */
+static int8_t endOperation(Superblock *sb) {
+    struct timespec now;
+    uint8_t journaling = journalCapturing && journalSb == sb;
+
+    // Nothing the operation drew from scratch memory is needed past this point.
+    scratchLeave();
+
+    if (durabilityMode == DURABILITY_PER_COMMAND) {
+        if (journaling) {
+            return journalCommit();
+        }
+        if ((sb->fmod && superblockSave(sb) != 0) || deviceSync() != 0) {
+            return E_BLOCK_WRITE_FAILURE;
+        }
+    } else if (durabilityMode == DURABILITY_INTERVAL) {
+        if (atomic_exchange(&flushFailed, 0)) {
+            return E_BLOCK_WRITE_FAILURE;
+        }
+        if (journaling) {
+            // Commits have to come from this thread, so they happen as the first operation after
+            // each interval ends, or when v6_durability_commit is called once the flusher asks.
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if ((now.tv_sec - durabilityLastCommit.tv_sec) * 1000
+                + (now.tv_nsec - durabilityLastCommit.tv_nsec) / 1000000 < durabilityIntervalMs) {
+                atomic_store(&commitPending, 1);
+                return 0;
+            }
+            durabilityLastCommit = now;
+            atomic_store(&commitPending, 0);
+            return journalCommit();
+        }
+        // superblockSave hands everything to the OS, leaving only the fdatasync for the flusher.
+        if ((sb->fmod && superblockSave(sb) != 0) || fflush(v6FileSystem) != 0) {
+            return E_BLOCK_WRITE_FAILURE;
+        }
+        atomic_store(&flushPending, 1);
+    }
+
+    return 0;
+}
+
+/*
+ * Entry point of the background flusher. Wakes up once an interval and syncs if an operation has
+ * finished since the last time.
+ */
+static void *flusherMain(void *arg) {
+    struct timespec deadline;
+
+    (void) arg;
+    pthread_mutex_lock(&flusherLock);
+
+    while (flusherStopping == 0) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += durabilityIntervalMs / 1000;
+        deadline.tv_nsec += (long) (durabilityIntervalMs % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        while (flusherStopping == 0 && pthread_cond_timedwait(&flusherWake, &flusherLock, &deadline) == 0) {
+        }
+
+        if (atomic_exchange(&flushPending, 0)) {
+            pthread_mutex_unlock(&flusherLock);
+            if (fdatasync(flusherFd) != 0) {
+                atomic_store(&flushFailed, 1);
+            }
+            pthread_mutex_lock(&flusherLock);
+        }
+
+        // A journal commit can't be made from here, so the thread using the file system is woken
+        // to make it. A full pipe already has a wakeup waiting.
+        if (flusherStopping == 0 && atomic_load(&commitPending)) {
+            ssize_t ignored = write(flusherWakePipe[1], "", 1);
+            (void) ignored;
+        }
+    }
+
+    pthread_mutex_unlock(&flusherLock);
+
+    return NULL;
+}
+
+static int8_t flusherStart(void) {
+    flusherFd = fileno(v6FileSystem);
+    flusherStopping = 0;
+    atomic_store(&flushPending, 0);
+    atomic_store(&flushFailed, 0);
+    atomic_store(&commitPending, 0);
+
+    if (pipe(flusherWakePipe) != 0) {
+        flusherWakePipe[0] = flusherWakePipe[1] = -1;
+        return E_THREAD_CREATE_FAILURE;
+    }
+    fcntl(flusherWakePipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(flusherWakePipe[1], F_SETFL, O_NONBLOCK);
+
+    if (pthread_create(&flusherThread, NULL, flusherMain, NULL) != 0) {
+        close(flusherWakePipe[0]);
+        close(flusherWakePipe[1]);
+        flusherWakePipe[0] = flusherWakePipe[1] = -1;
+        return E_THREAD_CREATE_FAILURE;
+    }
+
+    flusherRunning = 1;
+
+    return 0;
+}
+
+/*
+ * Stops the flusher, if there is one, and syncs whatever it hadn't got to yet.
+ */
+static void flusherStop(void) {
+    if (flusherRunning == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&flusherLock);
+    flusherStopping = 1;
+    pthread_cond_signal(&flusherWake);
+    pthread_mutex_unlock(&flusherLock);
+
+    pthread_join(flusherThread, NULL);
+    flusherRunning = 0;
+
+    close(flusherWakePipe[0]);
+    close(flusherWakePipe[1]);
+    flusherWakePipe[0] = flusherWakePipe[1] = -1;
+
+    if (atomic_exchange(&flushPending, 0)) {
+        fdatasync(flusherFd);
+    }
+}
+
+/*
+ * Returns size bytes of scratch memory, aligned for any type, or NULL if out of memory.
+ * Only valid until the public function that asked for it returns.
+ */
+static void *scratchAlloc(size_t size) {
+    ScratchChunk *chunk = scratchChunks;
+    void *memory;
+
+    size = (size + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1);
+
+    if (chunk == NULL || chunk->size - chunk->used < size) {
+        size_t chunkSize = size > SCRATCH_CHUNK_SIZE ? size : SCRATCH_CHUNK_SIZE;
+
+        chunk = malloc(sizeof(ScratchChunk) + chunkSize);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        chunk->next = scratchChunks;
+        chunk->size = chunkSize;
+        chunk->used = 0;
+        scratchChunks = chunk;
+    }
+
+    memory = &chunk->data[chunk->used];
+    chunk->used += size;
+
+    return memory;
+}
+
+/*
+ * Called on the way into a public function that draws on scratch memory.
+ */
+static void scratchEnter(void) {
+    scratchDepth++;
+}
+
+/*
+ * Called on the way out of a public function. Once the outermost one is done, everything is
+ * handed back, and all but the oldest chunk freed so a long session stays the same size.
+ */
+static void scratchLeave(void) {
+    if (scratchDepth > 0) {
+        scratchDepth--;
+    }
+
+    if (scratchDepth > 0 || scratchChunks == NULL) {
+        return;
+    }
+
+    while (scratchChunks->next != NULL) {
+        ScratchChunk *next = scratchChunks->next;
+
+        free(scratchChunks);
+        scratchChunks = next;
+    }
+    scratchChunks->used = 0;
+}
+
+/*
+ * Frees every chunk of scratch memory.
+ */
+static void scratchRelease(void) {
+    while (scratchChunks != NULL) {
+        ScratchChunk *next = scratchChunks->next;
+
+        free(scratchChunks);
+        scratchChunks = next;
+    }
+}
+
+/*
+ * Records the new contents of a metadata block in the running transaction. The block isn't
+ * written in place until the next checkpoint.
+ */
+static int8_t journalAddBlock(uint32_t blockNumber, const void *data) {
+    JournalBlock *journalBlock;
+    uint32_t *slot;
+
+    if (journalCount > 0 && *(slot = journalSlotFor(blockNumber)) != 0) {
+        journalBlock = &journalBlocks[*slot - 1];
+        if (journalBlock->committed) {
+            journalBlock->committed = 0;
+            journalRunningBlocks++;
+        }
+        memcpy(journalBlock->data, data, imageFormat.blockSize);
+        return 0;
+    }
+
+    if (journalCount == journalCapacity) {
+        size_t newCapacity = journalCapacity == 0 ? 64 : journalCapacity * 2;
+        JournalBlock *newBlocks = realloc(journalBlocks, newCapacity * sizeof(JournalBlock));
+
+        if (newBlocks == NULL) {
+            return E_ALLOCATE_FAILURE;
+        }
+
+        journalBlocks = newBlocks;
+        journalCapacity = newCapacity;
+    }
+
+    if ((journalCount + 1) * 2 > journalSlotCount && journalGrowSlots() != 0) {
+        return E_ALLOCATE_FAILURE;
+    }
+
+    journalBlock = &journalBlocks[journalCount];
+    journalBlock->blockNumber = blockNumber;
+    journalBlock->committed = 0;
+    memcpy(journalBlock->data, data, imageFormat.blockSize);
+    journalCount++;
+    *journalSlotFor(blockNumber) = (uint32_t) journalCount;
+    journalRunningBlocks++;
+
+    return 0;
+}
+
+/*
+ * Returns the slot of journalSlots that holds the block, or the empty slot it would go in.
+ * Slots are probed linearly from the block number's hash.
+ */
+static uint32_t *journalSlotFor(uint32_t blockNumber) {
+    size_t mask = journalSlotCount - 1;
+    size_t slot = (blockNumber * 2654435761U) & mask;
+
+    while (journalSlots[slot] != 0 && journalBlocks[journalSlots[slot] - 1].blockNumber != blockNumber) {
+        slot = (slot + 1) & mask;
+    }
+
+    return &journalSlots[slot];
+}
+
+/*
+ * Doubles journalSlots and puts every journaled block back in.
+ */
+static int8_t journalGrowSlots(void) {
+    size_t newSlotCount = journalSlotCount == 0 ? 256 : journalSlotCount * 2;
+    uint32_t *newSlots = calloc(newSlotCount, sizeof(uint32_t));
+
+    if (newSlots == NULL) {
+        return E_ALLOCATE_FAILURE;
+    }
+
+    free(journalSlots);
+    journalSlots = newSlots;
+    journalSlotCount = newSlotCount;
+
+    for (size_t i = 0; i < journalCount; i++) {
+        *journalSlotFor(journalBlocks[i].blockNumber) = (uint32_t) (i + 1);
+    }
+
+    return 0;
+}
+
+/*
+ * Returns the newest journaled contents of a block that hasn't been checkpointed yet, or NULL if
+ * the copy in place is current.
+ */
+static uint8_t *journalLookup(uint32_t blockNumber) {
+    uint32_t slot;
+
+    if (journalCount == 0) {
+        return NULL;
+    }
+
+    slot = *journalSlotFor(blockNumber);
+
+    return slot != 0 ? journalBlocks[slot - 1].data : NULL;
+}
+
+/*
+ * Writes the running transaction to the journal with a single fdatasync, along with the current
+ * superblock. File data written in place since the last commit is synced first, so a committed
+ * i-node never points at data that didn't make it to disk.
+ *
+ * A transaction is laid out as a header with the block numbers, the blocks, and a commit block
+ * holding a checksum of everything before it. Replay stops at the first transaction whose commit
+ * block is missing or doesn't match.
+ */
+static int8_t journalCommit(void) {
+    uint8_t *record;
+    uint8_t *descriptor;
+    uint32_t count, checksum, magic;
+    size_t descriptorBlocks, recordSize, nextBlock = 0;
+    const size_t blockSize = imageFormat.blockSize;
+    int8_t result;
+
+    if (journalCapturing == 0
+        || (journalRunningBlocks == 0 && journalDataWritten == 0 && journalSb->fmod == 0)) {
+        journalRunningOperations = 0;
+        return 0;
+    }
+
+    // Once journaled, the superblock is clean: the running transaction will carry it to disk.
+    if (journalSb->fmod) {
+        journalSb->fmod = 0;
+        result = superblockWrite(journalSb);
+        if (result != 0) {
+            journalSb->fmod = 1;
+            return result;
+        }
+    }
+
+    if (journalDataWritten) {
+        if (deviceSync() != 0) {
+            return E_JOURNAL_FAILURE;
+        }
+    }
+
+    count = (uint32_t) journalRunningBlocks;
+    descriptorBlocks = (12 + count * 4 + blockSize - 1) / blockSize;
+    recordSize = (descriptorBlocks + count + 1) * blockSize;
+    record = calloc(recordSize, 1);
+    if (record == NULL) {
+        return E_ALLOCATE_FAILURE;
+    }
+
+    descriptor = record;
+    magic = JOURNAL_HEADER_MAGIC;
+    memcpy(&descriptor[0], &magic, 4);
+    memcpy(&descriptor[4], &journalSequence, 4);
+    memcpy(&descriptor[8], &count, 4);
+
+    for (size_t i = 0; i < journalCount; i++) {
+        if (journalBlocks[i].committed == 0) {
+            memcpy(&descriptor[12 + nextBlock * 4], &journalBlocks[i].blockNumber, 4);
+            memcpy(&record[(descriptorBlocks + nextBlock) * blockSize], journalBlocks[i].data, blockSize);
+            nextBlock++;
+        }
+    }
+
+    checksum = journalChecksum(record, (descriptorBlocks + count) * blockSize);
+    magic = JOURNAL_COMMIT_MAGIC;
+    memcpy(&record[recordSize - blockSize], &magic, 4);
+    memcpy(&record[recordSize - blockSize + 4], &journalSequence, 4);
+    memcpy(&record[recordSize - blockSize + 8], &count, 4);
+    memcpy(&record[recordSize - blockSize + 12], &checksum, 4);
+
+    if (pwrite(journalFd, record, recordSize, journalOffset) != (ssize_t) recordSize
+        || fdatasync(journalFd) != 0) {
+        free(record);
+        return E_JOURNAL_FAILURE;
+    }
+
+    free(record);
+
+    for (size_t i = 0; i < journalCount; i++) {
+        journalBlocks[i].committed = 1;
+    }
+
+    journalOffset += (off_t) recordSize;
+    journalSequence++;
+    journalRunningBlocks = 0;
+    journalRunningOperations = 0;
+    journalDataWritten = 0;
+
+    if (journalCount >= JOURNAL_CHECKPOINT_BLOCKS || journalOffset >= JOURNAL_CHECKPOINT_BYTES) {
+        return journalCheckpoint();
+    }
+
+    return 0;
+}
+
+/*
+ * Writes every committed block in place, in block order, syncs the image and empties the journal.
+ * Only called right after a commit, when nothing is waiting in the running transaction.
+ */
+static int8_t journalCheckpoint(void) {
+    if (journalFd < 0 || journalCount == 0) {
+        return 0;
+    }
+
+    // (block number, index) pairs packed into one word, sorted so the blocks go out in disk order.
+    uint64_t *order = malloc(journalCount * sizeof(uint64_t));
+
+    if (order == NULL) {
+        return E_ALLOCATE_FAILURE;
+    }
+
+    for (size_t i = 0; i < journalCount; i++) {
+        order[i] = ((uint64_t) journalBlocks[i].blockNumber << 32) | i;
+    }
+
+    qsort(order, journalCount, sizeof(uint64_t), compareUint64);
+
+    for (size_t i = 0; i < journalCount; i++) {
+        JournalBlock *journalBlock = &journalBlocks[order[i] & 0xFFFFFFFFU];
+
+        if (deviceWriteBlock(journalBlock->blockNumber, journalBlock->data) != 0) {
+            free(order);
+            return E_BLOCK_WRITE_FAILURE;
+        }
+    }
+
+    free(order);
+
+    if (deviceSync() != 0) {
+        return E_JOURNAL_FAILURE;
+    }
+
+    if (ftruncate(journalFd, 0) != 0 || fdatasync(journalFd) != 0) {
+        return E_JOURNAL_FAILURE;
+    }
+
+    journalDiscard();
+
+    return 0;
+}
+
+/*
+ * Applies every complete transaction in the journal to the image, then empties the journal.
+ * Called on load, before the superblock is read.
+ */
+static int8_t journalReplay(void) {
+    struct stat journalStat;
+    uint8_t *journal;
+    off_t offset = 0;
+    uint8_t applied = 0;
+    const size_t blockSize = imageFormat.blockSize;
+
+    if (fstat(journalFd, &journalStat) != 0) {
+        return E_JOURNAL_FAILURE;
+    }
+
+    if (journalStat.st_size == 0) {
+        return 0;
+    }
+
+    journal = malloc((size_t) journalStat.st_size);
+    if (journal == NULL) {
+        return E_ALLOCATE_FAILURE;
+    }
+
+    if (pread(journalFd, journal, (size_t) journalStat.st_size, 0) != journalStat.st_size) {
+        free(journal);
+        return E_JOURNAL_FAILURE;
+    }
+
+    while (offset + (off_t) blockSize <= journalStat.st_size) {
+        uint8_t *record = &journal[offset];
+        uint32_t magic, sequence, count, commitMagic, commitSequence, commitCount, checksum;
+        size_t descriptorBlocks, recordSize, entrySize;
+
+        memcpy(&magic, &record[0], 4);
+        memcpy(&sequence, &record[4], 4);
+        memcpy(&count, &record[8], 4);
+
+        if ((magic != JOURNAL_HEADER_MAGIC && magic != JOURNAL_HEADER_MAGIC_NARROW)
+            || count > journalStat.st_size / blockSize) {
+            break;
+        }
+
+        entrySize = magic == JOURNAL_HEADER_MAGIC ? 4 : 2;
+        descriptorBlocks = (12 + count * entrySize + blockSize - 1) / blockSize;
+        recordSize = (descriptorBlocks + count + 1) * blockSize;
+        if (offset + (off_t) recordSize > journalStat.st_size) {
+            // The crash came before the commit block was written.
+            break;
+        }
+
+        memcpy(&commitMagic, &record[recordSize - blockSize], 4);
+        memcpy(&commitSequence, &record[recordSize - blockSize + 4], 4);
+        memcpy(&commitCount, &record[recordSize - blockSize + 8], 4);
+        memcpy(&checksum, &record[recordSize - blockSize + 12], 4);
+
+        if (commitMagic != JOURNAL_COMMIT_MAGIC || commitSequence != sequence || commitCount != count
+            || checksum != journalChecksum(record, (descriptorBlocks + count) * blockSize)) {
+            break;
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            uint32_t blockNumber = 0;
+
+            memcpy(&blockNumber, &record[12 + i * entrySize], entrySize);
+            if (deviceWriteBlock(blockNumber, &record[(descriptorBlocks + i) * blockSize]) != 0) {
+                free(journal);
+                return E_BLOCK_WRITE_FAILURE;
+            }
+        }
+
+        applied = 1;
+        journalSequence = sequence + 1;
+        offset += (off_t) recordSize;
+    }
+
+    free(journal);
+
+    if (applied && deviceSync() != 0) {
+        return E_JOURNAL_FAILURE;
+    }
+
+    if (ftruncate(journalFd, 0) != 0 || fdatasync(journalFd) != 0) {
+        return E_JOURNAL_FAILURE;
+    }
+
+    return 0;
+}
+
+/*
+ * Must be called before file data is written over a block. Returns 1 if the block still has a
+ * journaled copy from its time as metadata, in which case the data has to be journaled as well so
+ * that neither a checkpoint nor a replay can write the old copy over it. Otherwise the data can go
+ * in place, and is synced before the next commit.
+ */
+static uint8_t journalPrepareDataWrite(uint32_t blockNumber) {
+    if (journalCapturing == 0) {
+        return 0;
+    }
+
+    if (journalLookup(blockNumber) != NULL) {
+        return 1;
+    }
+
+    journalDataWritten = 1;
+
+    return 0;
+}
+
+/*
+ * Forgets every journaled block. The caller is responsible for the journal file.
+ */
+static void journalDiscard(void) {
+    if (journalSlots != NULL) {
+        memset(journalSlots, 0, journalSlotCount * sizeof(uint32_t));
+    }
+
+    journalCount = 0;
+    journalRunningBlocks = 0;
+    journalRunningOperations = 0;
+    journalDataWritten = 0;
+    journalOffset = 0;
+}
+
+static void journalClose(void) {
+    journalDiscard();
+
+    if (journalFd >= 0) {
+        close(journalFd);
+    }
+
+    journalFd = -1;
+    journalCapturing = 0;
+    journalSb = NULL;
+}
+
+/*
+ * FNV-1a, used to tell a fully written transaction from a torn one.
+ */
+static uint32_t journalChecksum(const uint8_t *data, size_t length) {
+    uint32_t hash = 2166136261U;
+
+    for (size_t i = 0; i < length; i++) {
+        hash ^= data[i];
+        hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+/*
+ * Writes a block of file contents. With a journal, file data normally goes in place straight away
+ * and is synced before the transaction that references it commits.
+ */
+static int8_t writeDataBlock(uint32_t blockNumber, void *data) {
+    uint8_t *cachedData;
+    int8_t writeSuccess;
+
+    if (journalPrepareDataWrite(blockNumber)) {
+        writeSuccess = journalAddBlock(blockNumber, data);
+    } else {
+        writeSuccess = deviceWriteBlock(blockNumber, data);
+    }
+
+    if (writeSuccess != 0) {
+        return writeSuccess;
+    }
+
+    cachedData = blockCacheLookup(blockNumber);
+    if (cachedData == NULL) {
+        cachedData = blockCacheInsert(blockNumber);
+    }
+    if (cachedData != NULL) {
+        memcpy(cachedData, data, imageFormat.blockSize);
+    }
+
+    return 0;
+}
+
+static int8_t deviceReadBlock(uint32_t blockNumber, void *data) {
+    uint8_t *journalData = journalLookup(blockNumber);
+
+    // A journaled block hasn't been written in place yet.
+    if (journalData != NULL) {
+        memcpy(data, journalData, imageFormat.blockSize);
+        return 0;
+    }
+
+    // A clone's unwritten blocks are only in its base.
+    if (!overlayHasBlock(overlayPresent, blockNumber)) {
+        return overlayReadBase(overlayPresent, overlayBaseFd, blockNumber, 1, data);
+    }
+
+    if (fseek(v6FileSystem, getBlockAddress(blockNumber), SEEK_SET) != 0) {
+        return E_SEEK_FAILURE;
+    }
+
+    if (fread(data, 1, imageFormat.blockSize, v6FileSystem) < imageFormat.blockSize) {
+        return E_BLOCK_READ_FAILURE;
+    }
+
+    return 0;
+}
+
+static int8_t deviceWriteBlock(uint32_t blockNumber, void *data) {
+    int8_t result;
+
+    // A clone's presence bitmap starts right after its last block.
+    if (overlayBaseFd >= 0 && blockNumber >= overlayNumBlocks) {
+        return E_INVALID_BLOCK_NUMBER;
+    }
+
+    warmupNoteWrite(blockNumber);
+    result = changesNoteWrite(blockNumber, 1);
+    if (result != 0) {
+        return result;
+    }
+
+    if (fseek(v6FileSystem, getBlockAddress(blockNumber), SEEK_SET) != 0) {
+        return E_SEEK_FAILURE;
+    }
+
+    if (fwrite(data, 1, imageFormat.blockSize, v6FileSystem) < imageFormat.blockSize) {
+        return E_BLOCK_WRITE_FAILURE;
+    }
+
+    return overlayMarkBlocks(blockNumber, 1);
+}
+
+/*
+ * Opens the base of the image just opened if it is a clone, and loads its presence bitmap. Does
+ * nothing for a plain image. Fails if the base is gone, or no longer the file, size or
+ * modification time it was when the clone was made.
+ */
+static int8_t overlayOpen(void) {
+    int fd = fileno(v6FileSystem);
+    OverlayTrailer trailer;
+    struct stat deltaStat, baseStat;
+    char *basePath;
+    off_t bitmapOffset;
+    size_t bitmapBytes;
+
+    if (fstat(fd, &deltaStat) != 0 || deltaStat.st_size < (off_t) sizeof(trailer)
+        || pread(fd, &trailer, sizeof(trailer), deltaStat.st_size - (off_t) sizeof(trailer)) != (ssize_t) sizeof(trailer)
+        || trailer.magic != OVERLAY_MAGIC) {
+        return 0;
+    }
+
+    bitmapOffset = (off_t) trailer.numBlocks * trailer.blockSize;
+    bitmapBytes = (trailer.numBlocks + 7) / 8;
+    if (bitmapOffset + (off_t) bitmapBytes + trailer.pathLength + (off_t) sizeof(trailer) != deltaStat.st_size) {
+        return E_SUPERBLOCK_READ_ERROR;
+    }
+
+    basePath = malloc(trailer.pathLength + 1);
+    overlayPresent = malloc(bitmapBytes);
+    if (basePath == NULL || overlayPresent == NULL) {
+        free(basePath);
+        overlayClose();
+        return E_ALLOCATE_FAILURE;
+    }
+
+    if (pread(fd, basePath, trailer.pathLength, bitmapOffset + (off_t) bitmapBytes) != (ssize_t) trailer.pathLength
+        || pread(fd, overlayPresent, bitmapBytes, bitmapOffset) != (ssize_t) bitmapBytes) {
+        free(basePath);
+        overlayClose();
+        return E_BLOCK_READ_FAILURE;
+    }
+    basePath[trailer.pathLength] = '\0';
+
+    overlayBaseFd = open(basePath, O_RDONLY);
+    free(basePath);
+    if (overlayBaseFd < 0) {
+        overlayClose();
+        return E_FILE_OPEN_FAILURE;
+    }
+
+    // Blocks that were never copied are read from the base, so it can't have changed under us.
+    if (fstat(overlayBaseFd, &baseStat) != 0 || baseStat.st_size != bitmapOffset
+        || (uint64_t) baseStat.st_ino != trailer.baseInode
+        || (int64_t) baseStat.st_mtim.tv_sec != trailer.baseMtimeSeconds
+        || (int64_t) baseStat.st_mtim.tv_nsec != trailer.baseMtimeNanoseconds) {
+        overlayClose();
+        return E_FILE_OPEN_FAILURE;
+    }
+
+    overlayNumBlocks = trailer.numBlocks;
+
+    return 0;
+}
+
+/*
+ * Lets go of the base of a clone. The image open in v6FileSystem is then read and written as a
+ * plain one.
+ */
+static void overlayClose(void) {
+    if (overlayBaseFd >= 0) {
+        close(overlayBaseFd);
+    }
+    overlayBaseFd = -1;
+    free(overlayPresent);
+    overlayPresent = NULL;
+    overlayNumBlocks = 0;
+}
+
+/*
+ * Returns nonzero if a block is in the delta file, as every block of a plain image is. Takes the
+ * bitmap so the warmup thread can check its own copy.
+ */
+static uint8_t overlayHasBlock(const uint8_t *present, uint32_t blockNumber) {
+    return present == NULL || (present[blockNumber / 8] >> (blockNumber % 8)) & 1U;
+}
+
+/*
+ * Reads the blocks in a run of count blocks that aren't in the delta file from the base image,
+ * over whatever data already holds for them. Absent blocks next to each other are read together.
+ */
+static int8_t overlayReadBase(const uint8_t *present, int baseFd, uint32_t blockNumber, size_t count, void *data) {
+    size_t runStart = 0;
+
+    if (present == NULL) {
+        return 0;
+    }
+
+    while (runStart < count) {
+        size_t runEnd;
+        size_t runBytes;
+
+        if (overlayHasBlock(present, (uint32_t) (blockNumber + runStart))) {
+            runStart++;
+            continue;
+        }
+
+        runEnd = runStart + 1;
+        while (runEnd < count && !overlayHasBlock(present, (uint32_t) (blockNumber + runEnd))) {
+            runEnd++;
+        }
+
+        runBytes = (runEnd - runStart) * imageFormat.blockSize;
+        if (pread(baseFd, (uint8_t *) data + runStart * imageFormat.blockSize, runBytes,
+                  (off_t) getBlockAddress((uint32_t) (blockNumber + runStart))) != (ssize_t) runBytes) {
+            return E_BLOCK_READ_FAILURE;
+        }
+
+        runStart = runEnd;
+    }
+
+    return 0;
+}
+
+/*
+ * Marks a run of blocks just written to a clone as being in the delta file, and writes the bytes
+ * of the bitmap that changed. Does nothing for a plain image.
+ */
+static int8_t overlayMarkBlocks(uint32_t blockNumber, size_t count) {
+    size_t firstByte = blockNumber / 8;
+    size_t lastByte = (blockNumber + count - 1) / 8;
+    uint8_t changed = 0;
+
+    if (overlayPresent == NULL || count == 0) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        uint32_t block = (uint32_t) (blockNumber + i);
+
+        if (!overlayHasBlock(overlayPresent, block)) {
+            overlayPresent[block / 8] |= (uint8_t) (1U << (block % 8));
+            changed = 1;
+        }
+    }
+
+    // Only the first write of a block since the clone was made costs anything.
+    if (!changed) {
+        return 0;
+    }
+
+    if (fseek(v6FileSystem, (long) (getBlockAddress(overlayNumBlocks) + firstByte), SEEK_SET) != 0) {
+        return E_SEEK_FAILURE;
+    }
+
+    if (fwrite(&overlayPresent[firstByte], 1, lastByte - firstByte + 1, v6FileSystem) < lastByte - firstByte + 1) {
+        return E_BLOCK_WRITE_FAILURE;
+    }
+
+    return 0;
+}
+
+/*
+ * Turns the loaded clone into a plain image: copies every block it still reads from the base into
+ * the delta file, then cuts off the bitmap and the trailer. Blocks that are zeros in the base are
+ * left as holes. Until the truncate the clone is still whole, with more of its blocks in place, so
+ * stopping part way loses nothing.
+ */
+static int8_t overlayFlatten(void) {
+    uint8_t *baseData = malloc((size_t) MAX_BLOCK_RUN * imageFormat.blockSize);
+    uint8_t *deltaData = malloc((size_t) MAX_BLOCK_RUN * imageFormat.blockSize);
+    int8_t result = 0;
+
+    if (baseData == NULL || deltaData == NULL) {
+        free(baseData);
+        free(deltaData);
+        return E_ALLOCATE_FAILURE;
+    }
+
+    for (uint32_t runStart = 0; result == 0 && runStart < overlayNumBlocks; runStart += MAX_BLOCK_RUN) {
+        size_t count = overlayNumBlocks - runStart < MAX_BLOCK_RUN ? overlayNumBlocks - runStart : MAX_BLOCK_RUN;
+        size_t runBytes = count * imageFormat.blockSize;
+
+        if (pread(overlayBaseFd, baseData, runBytes, (off_t) getBlockAddress(runStart)) != (ssize_t) runBytes) {
+            result = E_BLOCK_READ_FAILURE;
+            break;
+        }
+
+        // An unmarked block is usually a hole in the delta, but a crash can leave a write there
+        // without its bit, and the base is what that block holds.
+        if (fseek(v6FileSystem, getBlockAddress(runStart), SEEK_SET) != 0) {
+            result = E_SEEK_FAILURE;
+            break;
+        }
+        if (fread(deltaData, imageFormat.blockSize, count, v6FileSystem) < count) {
+            result = E_BLOCK_READ_FAILURE;
+            break;
+        }
+
+        for (size_t i = 0; result == 0 && i < count; i++) {
+            uint8_t *block = &baseData[i * imageFormat.blockSize];
+
+            if (overlayHasBlock(overlayPresent, (uint32_t) (runStart + i))
+                || memcmp(block, &deltaData[i * imageFormat.blockSize], imageFormat.blockSize) == 0) {
+                continue;
+            }
+            if (fseek(v6FileSystem, getBlockAddress((uint32_t) (runStart + i)), SEEK_SET) != 0) {
+                result = E_SEEK_FAILURE;
+            } else if (fwrite(block, 1, imageFormat.blockSize, v6FileSystem) < imageFormat.blockSize) {
+                result = E_BLOCK_WRITE_FAILURE;
+            }
+        }
+    }
+
+    free(baseData);
+    free(deltaData);
+
+    // The copies have to be on disk before the bitmap saying where to find them goes.
+    if (result == 0
+        && (fflush(v6FileSystem) != 0 || fdatasync(fileno(v6FileSystem)) != 0
+            || ftruncate(fileno(v6FileSystem), (off_t) getBlockAddress(overlayNumBlocks)) != 0
+            || fsync(fileno(v6FileSystem)) != 0)) {
+        result = E_BLOCK_WRITE_FAILURE;
+    }
+
+    if (result == 0) {
+        overlayClose();
+    }
+
+    return result;
+}
+
+/*
+ * Loads the changed-block bitmap of the image just opened, if it has one. Fails if the sidecar
+ * file isn't a bitmap for this block size, rather than carry on and miss changes.
+ */
+static int8_t changesOpen(void) {
+    size_t bitmapBytes;
+
+    changesFd = open(changesPath, O_RDWR);
+    if (changesFd < 0) {
+        return 0;
+    }
+
+    if (pread(changesFd, &changesHeader, sizeof(changesHeader), 0) != (ssize_t) sizeof(changesHeader)
+        || changesHeader.magic != CHANGES_MAGIC || changesHeader.blockSize != imageFormat.blockSize) {
+        changesClose();
+        return E_BLOCK_READ_FAILURE;
+    }
+    changesHeader.checkpoint[CHECKPOINT_NAME_SIZE - 1] = '\0';
+
+    bitmapBytes = (changesHeader.numBlocks + 7) / 8;
+    changedBlocks = malloc(bitmapBytes > 0 ? bitmapBytes : 1);
+    if (changedBlocks == NULL) {
+        changesClose();
+        return E_ALLOCATE_FAILURE;
+    }
+
+    if (pread(changesFd, changedBlocks, bitmapBytes, sizeof(changesHeader)) != (ssize_t) bitmapBytes) {
+        changesClose();
+        return E_BLOCK_READ_FAILURE;
+    }
+
+    return 0;
+}
+
+/*
+ * Stops tracking changes for this session. The sidecar file stays behind.
+ */
+static void changesClose(void) {
+    if (changesFd >= 0) {
+        close(changesFd);
+    }
+    changesFd = -1;
+    free(changedBlocks);
+    changedBlocks = NULL;
+}
+
+/*
+ * Starts the bitmap over for an image of numBlocks blocks, from a checkpoint named name, with
+ * every block marked as changed or none. changesFd has to be open.
+ */
+static int8_t changesReset(uint32_t numBlocks, const char *name, uint8_t allChanged) {
+    size_t bitmapBytes = (numBlocks + 7) / 8;
+    uint8_t *bitmap = malloc(bitmapBytes > 0 ? bitmapBytes : 1);
+    // name may be the checkpoint in changesHeader.
+    char checkpoint[CHECKPOINT_NAME_SIZE] = { 0 };
+
+    if (bitmap == NULL) {
+        return E_ALLOCATE_FAILURE;
+    }
+    memset(bitmap, allChanged ? 0xFF : 0, bitmapBytes);
+    strncpy(checkpoint, name, CHECKPOINT_NAME_SIZE - 1);
+
+    memset(&changesHeader, 0, sizeof(changesHeader));
+    changesHeader.magic = CHANGES_MAGIC;
+    changesHeader.blockSize = imageFormat.blockSize;
+    changesHeader.numBlocks = numBlocks;
+    memcpy(changesHeader.checkpoint, checkpoint, CHECKPOINT_NAME_SIZE);
+
+    if (ftruncate(changesFd, 0) != 0
+        || pwrite(changesFd, &changesHeader, sizeof(changesHeader), 0) != (ssize_t) sizeof(changesHeader)
+        || pwrite(changesFd, bitmap, bitmapBytes, sizeof(changesHeader)) != (ssize_t) bitmapBytes
+        || fdatasync(changesFd) != 0) {
+        free(bitmap);
+        return E_BLOCK_WRITE_FAILURE;
+    }
+
+    free(changedBlocks);
+    changedBlocks = bitmap;
+
+    return 0;
+}
+
+/*
+ * Marks a run of blocks about to be written as changed, and writes the bytes of the bitmap that
+ * changed and syncs them before returning, so the image write can't reach the disk ahead of its
+ * bit. Does nothing when changes aren't tracked.
+ */
+static int8_t changesNoteWrite(uint32_t blockNumber, size_t count) {
+    size_t firstByte = blockNumber / 8;
+    size_t lastByte = (blockNumber + count - 1) / 8;
+    uint8_t changed = 0;
+
+    if (changedBlocks == NULL || count == 0) {
+        return 0;
+    }
+
+    // A write the bitmap can't record would be missing from every delta.
+    if (blockNumber + count > changesHeader.numBlocks) {
+        return E_INVALID_BLOCK_NUMBER;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        uint32_t block = (uint32_t) (blockNumber + i);
+
+        if (!((changedBlocks[block / 8] >> (block % 8)) & 1U)) {
+            changedBlocks[block / 8] |= (uint8_t) (1U << (block % 8));
+            changed = 1;
+        }
+    }
+
+    // Only the first write of a block since the checkpoint costs anything.
+    if (changed && (pwrite(changesFd, &changedBlocks[firstByte], lastByte - firstByte + 1,
+                           (off_t) (sizeof(changesHeader) + firstByte)) != (ssize_t) (lastByte - firstByte + 1)
+                    || fdatasync(changesFd) != 0)) {
+        return E_BLOCK_WRITE_FAILURE;
+    }
+
+    return 0;
+}
+
+/*
+ * Hands everything written to the OS and waits for it to reach the disk. The changed-block bitmap
+ * is synced as it is written, so it is already there.
+ */
+static int8_t deviceSync(void) {
+    if (fflush(v6FileSystem) != 0 || fdatasync(fileno(v6FileSystem)) != 0) {
+        return E_BLOCK_WRITE_FAILURE;
+    }
+
+    return 0;
+}
+
+static uint16_t createFile(Superblock *sb, char *filePath, uint16_t fileType) {
+    char **filePathTokens;
+    size_t numTokens = 0;
+    Inode *previousInode = inodeLoad(sb, 1);
+    Inode *inode = NULL;
+    uint16_t inodeNumber = 0, previousInodeNumber = 1;
+    uint16_t createdLastLoop = 0;
+
+    filePathTokens = tokenizeFilePath(filePath, &numTokens);
+
+    if (numTokens == 0 || previousInode == NULL) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < numTokens - 1; i++) {
+        inodeNumber = findDirectoryEntry(previousInode, filePathTokens[i]);
+
+        if (inodeNumber == 0) {
+            // Directory does not exist. Create.
+            inodeNumber = getNewInodeNumber(sb, previousInodeNumber, FILE_TYPE_DIRECTORY);
+            if (inodeNumber == 0) {
+                // Out of i-nodes.
+                return 0;
+            }
+            inode = inodeLoad(sb, inodeNumber);
+            inode->flags |= FLAG_INODE_ALLOCATED | FILE_TYPE_DIRECTORY;
+
+            allocateNear(inodeNumber);
+            addDirectoryEntry(sb, inode, ".", inodeNumber);
+            addDirectoryEntry(sb, inode, "..", previousInodeNumber);
+
+            inodeSave(sb, inodeNumber, inode);
+
+            // Add entry to previous node
+            allocateNear(previousInodeNumber);
+            addDirectoryEntry(sb, previousInode, filePathTokens[i], inodeNumber);
+
+            inodeSave(sb, previousInodeNumber, previousInode);
+        } else {
+            inode = inodeLoad(sb, inodeNumber);
+        }
+
+        previousInode = inode;
+        previousInodeNumber = inodeNumber;
+    }
+
+    inodeNumber = findDirectoryEntry(previousInode, filePathTokens[numTokens - 1]);
+
+    if (inodeNumber == 0) {
+        // Create the new file.
+        inodeNumber = getNewInodeNumber(sb, previousInodeNumber, fileType);
+        if (inodeNumber == 0) {
+            // Out of i-nodes.
+            return 0;
+        }
+        inode = inodeLoad(sb, inodeNumber);
+        inode->flags |= FLAG_INODE_ALLOCATED | fileType;
+
+        if (fileType == FILE_TYPE_DIRECTORY) {
+            allocateNear(inodeNumber);
+            addDirectoryEntry(sb, inode, ".", inodeNumber);
+            addDirectoryEntry(sb, inode, "..", previousInodeNumber);
+        }
+        inodeSave(sb, inodeNumber, inode);
+
+        allocateNear(previousInodeNumber);
+        addDirectoryEntry(sb, previousInode, filePathTokens[numTokens - 1], inodeNumber);
+        inodeSave(sb, previousInodeNumber, previousInode);
+    } else {
+        // File already exists
+        return 0;
+    }
+
+    return inodeNumber;
+}
+
+/*
+ * Traverses inodes along a specified path, returning the inode number of the file
+ */
+static uint16_t getTerminalInodeNumber(Superblock *sb, char *filename) {
+    char* filePathToken = strtok(filename, "/");
+    char delim[] = "/\0";
+    Inode *root;
+    Inode *nextInode;
+    uint16_t terminalInodeNumber;
+
+    if (filePathToken == NULL) {
+        // The path names the root directory itself.
+        return 1;
+    }
+
+    root = inodeLoad(sb, 1);
+    terminalInodeNumber = findDirectoryEntry(root, filePathToken);
+    filePathToken = strtok(NULL, delim);
+
+    while(filePathToken != NULL && terminalInodeNumber != 0) {
+        nextInode = inodeLoad(sb, terminalInodeNumber);
+        terminalInodeNumber = findDirectoryEntry(nextInode, filePathToken);
+        filePathToken = strtok(NULL, delim);
+    }
+
+    return terminalInodeNumber;
+}
+
+/*
+ * Follows already tokenized path components from the root directory.
+ *
+ * Returns the i-node number of the last component, 1 if there are no components,
+ * or 0 if the path does not exist.
+ */
+static uint16_t lookupPathTokens(Superblock *sb, char **filePathTokens, size_t numTokens) {
+    uint16_t inodeNumber = 1;
+
+    for (size_t i = 0; i < numTokens && inodeNumber != 0; i++) {
+        Inode *inode = inodeLoad(sb, inodeNumber);
+
+        inodeNumber = findDirectoryEntry(inode, filePathTokens[i]);
+    }
+
+    return inodeNumber;
+}
+
+/*
+ * Returns 1 if ancestorNumber is directoryNumber itself or one of the directories above it,
+ * found by following ".." up to the root.
+ */
+static uint8_t directoryIsAncestor(Superblock *sb, uint16_t ancestorNumber, uint16_t directoryNumber) {
+    while (directoryNumber != 0) {
+        Inode *inode;
+
+        if (directoryNumber == ancestorNumber) {
+            return 1;
+        }
+
+        if (directoryNumber == 1) {
+            return 0;
+        }
+
+        inode = inodeLoad(sb, directoryNumber);
+        directoryNumber = findDirectoryEntry(inode, "..");
+    }
+
+    return 0;
+}
+
+/*
+ * Moves free inodes from the free i-node map to the inode list until the list is full.
+ *
+ * The search picks up at the word where the last one stopped and wraps around at most once,
+ * so a run of creates looks at each word of the map about once no matter how full the table is.
+ */
+static int8_t repopulateInodeList(Superblock *sb) {
+    size_t wordsSearched = 0;
+
+    while (sb->ninode < 100 && wordsSearched < freeInodeMapWords) {
+        uint64_t *word = &freeInodeMap[freeInodeMapCursor];
+
+        while (*word != 0 && sb->ninode < 100) {
+            size_t bit = (size_t) __builtin_ctzll(*word);
+
+            // Clear the lowest set bit.
+            *word &= *word - 1;
+            sb->inode[sb->ninode] = (uint16_t) (freeInodeMapCursor * 64 + bit);
+            sb->ninode++;
+            sb->fmod = 1;
+        }
+
+        if (*word == 0) {
+            freeInodeMapCursor = (freeInodeMapCursor + 1) % freeInodeMapWords;
+            wordsSearched++;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Builds the free i-node map by reading the whole i-node table in large sequential runs.
+ * I-nodes already in the superblock's i-node array are left out of the map.
+ */
+static int8_t freeInodeMapBuild(Superblock *sb) {
+    uint8_t *runData;
+    size_t numInodes = getNumInodes(sb);
+
+    // I-node numbers are 16 bits, anything past that can't be handed out.
+    if (numInodes > 65535) {
+        numInodes = 65535;
+    }
+
+    free(freeInodeMap);
+    freeInodeMapWords = numInodes / 64 + 1;
+    freeInodeMapCursor = 0;
+    freeInodeMap = calloc(freeInodeMapWords, sizeof(uint64_t));
+    runData = malloc(MAX_BLOCK_RUN * imageFormat.blockSize);
+
+    if (freeInodeMap == NULL || runData == NULL) {
+        free(runData);
+        return E_ALLOCATE_FAILURE;
+    }
+
+    for (size_t runStart = 0; runStart < sb->isize; runStart += MAX_BLOCK_RUN) {
+        size_t runLength = sb->isize - runStart < MAX_BLOCK_RUN ? sb->isize - runStart : MAX_BLOCK_RUN;
+
+        // The cache is write-through, so the disk is up to date.
+        if (deviceReadBlocks((uint32_t) (runStart + 2), runLength, runData) != 0) {
+            free(runData);
+            return E_BLOCK_READ_FAILURE;
+        }
+
+        for (size_t i = 0; i < runLength * imageFormat.inodesPerBlock; i++) {
+            size_t inodeNumber = runStart * imageFormat.inodesPerBlock + i + 1;
+            // The flags come first in both formats.
+            uint16_t flags;
+
+            memcpy(&flags, &runData[i * imageFormat.inodeSize], sizeof(flags));
+
+            if (inodeNumber > numInodes) {
+                continue;
+            }
+            if ((flags & (uint16_t) FLAG_INODE_ALLOCATED) == 0) {
+                freeInodeMap[inodeNumber / 64] |= 1ULL << (inodeNumber % 64);
+                if (allocationGroupCount > 0) {
+                    allocationGroups[getInodeGroup((uint16_t) inodeNumber)].freeInodes++;
+                }
+            } else if (allocationGroupCount > 0 && (flags & FLAG_FILE_TYPE) == FILE_TYPE_DIRECTORY) {
+                allocationGroups[getInodeGroup((uint16_t) inodeNumber)].directories++;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < sb->ninode; i++) {
+        if (sb->inode[i] <= numInodes) {
+            freeInodeMap[sb->inode[i] / 64] &= ~(1ULL << (sb->inode[i] % 64));
+        }
+    }
+
+    free(runData);
+
+    return 0;
+}
+
+static void freeInodeMapAdd(uint16_t inodeNumber) {
+    if (freeInodeMap != NULL && inodeNumber / 64U < freeInodeMapWords) {
+        if (allocationGroupCount > 0 && ((freeInodeMap[inodeNumber / 64] >> (inodeNumber % 64)) & 1U) == 0) {
+            allocationGroups[getInodeGroup(inodeNumber)].freeInodes++;
+        }
+        freeInodeMap[inodeNumber / 64] |= 1ULL << (inodeNumber % 64);
+    }
+}
+
+static Inode* inodeLoad(Superblock *sb, uint16_t inodeNumber) {
+    Inode *inode;
+    uint8_t *blockData;
+
+    if (inodeNumber == 0 || inodeNumber > getNumInodes(sb)) {
+        return NULL;
+    }
+
+    inode = scratchAlloc(sizeof(Inode));
+    if (inode == NULL) {
+        return NULL;
+    }
+
+    blockData = getCachedBlock(getInodeBlockNumber(inodeNumber));
+    if (blockData == NULL) {
+        return NULL;
+    }
+    imageFormat.inodeFromDisk(getInodeInBlock(blockData, inodeNumber), inode);
+
+    return inode;
+}
+
+static int8_t inodeSave(Superblock *sb, uint16_t inodeNumber, Inode *inode) {
+    uint32_t inodeBlockNumber;
+    uint8_t *blockData;
+
+    if (inodeNumber == 0 || inodeNumber > getNumInodes(sb)) {
+        return -1;
+    }
+
+    inodeBlockNumber = getInodeBlockNumber(inodeNumber);
+
+    // Changed in place in the cached block, which is then written back as it is.
+    blockData = getCachedBlock(inodeBlockNumber);
+    if (blockData == NULL) {
+        return E_BLOCK_READ_FAILURE;
+    }
+    imageFormat.inodeToDisk(inode, getInodeInBlock(blockData, inodeNumber));
+
+    return v6_write_block(inodeBlockNumber, blockData);
+}
+
+static void inodeInit(Inode *inode) {
+    inode->flags = 0;
+    inode->nlinks = 0;
+    inode->uid = 0;
+    inode->gid = 0;
+    inode->size = 0;
+    for (size_t i = 0; i < 8; i++) {
+        inode->addr[i] = 0;
+    }
+    inode->actime[0] = 0;
+    inode->actime[1] = 0;
+    inode->modtime[0] = 0;
+    inode->modtime[1] = 0;
+}
+
+/*
+ * Returns a new inode
+ *
+ * On a grouped image a file's i-node comes from its parent's group and a directory's from the
+ * group chooseDirectoryGroup picks. The parent and type are ignored otherwise.
+ */
+static uint16_t getNewInodeNumber(Superblock *sb, uint16_t parentNumber, uint16_t fileType){
+    uint16_t newInodeNumber = 0;
+
+    if (sb->ngroups > 0) {
+        uint16_t group = fileType == FILE_TYPE_DIRECTORY ? chooseDirectoryGroup() : getInodeGroup(parentNumber);
+
+        newInodeNumber = allocateGroupInode(group);
+        if (newInodeNumber == 0 && sb->nreclaim > 0 && reclaimPendingInodes(sb) == 0) {
+            newInodeNumber = allocateGroupInode(group);
+        }
+        if (newInodeNumber != 0 && fileType == FILE_TYPE_DIRECTORY) {
+            allocationGroups[getInodeGroup(newInodeNumber)].directories++;
+        }
+        return newInodeNumber;
+    }
+
+    if(sb->ninode == 0){
+        repopulateInodeList(sb);
+    }
+
+    if (sb->ninode == 0 && sb->nreclaim > 0) {
+        // Removed files still hold their i-nodes until they are reclaimed.
+        reclaimPendingInodes(sb);
+        if (sb->ninode == 0) {
+            repopulateInodeList(sb);
+        }
+    }
+
+    if(sb->ninode > 0) {
+        sb->ninode--;
+        sb->fmod = 1;
+        newInodeNumber = sb->inode[sb->ninode];
+    }
+
+    return newInodeNumber;
+}
+
+/*
+ * Writes length bytes of data at offsetInBlock in the file's block at blockIndex, allocating
+ * the block if there isn't one yet. A partial write to an existing block is a read-modify-write,
+ * and anything in that block past the end of the file is cleared.
+ *
+ * fileSize - the size of the file before this write.
+ */
+static int8_t writeFileBlock(V6File *file, uint32_t blockIndex, size_t offsetInBlock,
+                             const uint8_t *data, size_t length, uint32_t fileSize) {
+    uint8_t blockData[MAX_BLOCK_SIZE];
+    uint32_t blockStart = blockIndex * imageFormat.blockSize;
+    uint32_t blockNumber = getBlockNumberAtIndex(&file->inode, blockIndex);
+    int8_t result;
+
+    if (blockNumber == BLOCK_NUMBER_UNREADABLE) {
+        return E_BLOCK_READ_FAILURE;
+    }
+
+    if (blockNumber != 0 && length < imageFormat.blockSize) {
+        result = v6_read_block(blockNumber, blockData);
+        if (result != 0) {
+            return result;
+        }
+
+        if (blockStart + imageFormat.blockSize > fileSize) {
+            // The tail of the last block was never part of the file and may hold leftovers.
+            size_t validBytes = fileSize > blockStart ? fileSize - blockStart : 0;
+            memset(&blockData[validBytes], 0, imageFormat.blockSize - validBytes);
+        }
+    } else {
+        memset(blockData, 0, imageFormat.blockSize);
+    }
+
+    memcpy(&blockData[offsetInBlock], data, length);
+
+    if (blockNumber != 0) {
+        return writeDataBlock(blockNumber, blockData);
+    }
+
+    blockNumber = v6_alloc(file->sb);
+    if (blockNumber == 0) {
+        return E_ALLOCATE_FAILURE;
+    }
+
+    // Write the data before mapping the block, so the file never points at garbage.
+    result = writeDataBlock(blockNumber, blockData);
+    if (result == 0) {
+        result = mapBlockAtIndex(file->sb, &file->inode, blockIndex, blockNumber);
+    }
+    if (result != 0) {
+        v6_free(file->sb, blockNumber);
+    }
+
+    return result;
+}
+
+/*
+ * Points the i-node's block at index to blockNumber, converting the i-node to a large file and
+ * allocating indirect blocks as needed.
+ */
+static int8_t mapBlockAtIndex(Superblock *sb, Inode *inode, uint32_t index, uint32_t blockNumber) {
+    if (inodeIsLargeFile(inode) == 0 && index >= 8) {
+        int8_t convertSuccess = convertInodeToLargeFile(sb, inode);
+
+        if (convertSuccess != 0) {
+            return convertSuccess;
+        }
+    }
+
+    return setBlockNumberAtIndex(sb, inode, blockNumber, index);
+}
+
+/*
+ * Sets the size of a file that may end in holes. A file longer than 8 blocks must be a large file
+ * even if nothing past the 8th block is mapped, since small files can't address those indexes.
+ */
+static int8_t extendFileSize(Superblock *sb, Inode *inode, uint32_t fileSize) {
+    if (inodeIsLargeFile(inode) == 0 && fileSize > 8 * imageFormat.blockSize) {
+        int8_t convertSuccess = convertInodeToLargeFile(sb, inode);
+
+        if (convertSuccess != 0) {
+            return convertSuccess;
+        }
+    }
+
+    setFileSize(inode, fileSize);
+
+    return 0;
+}
+
+/*
+ * Returns 1 if every byte of the size byte block is zero.
+ *
+ * Each 64 byte chunk is ORed together a word at a time, which the compiler turns into vector
+ * instructions, and the scan stops at the first chunk with data in it.
+ */
+static inline __attribute__((always_inline)) uint8_t blockIsZeroSized(const uint8_t *data, size_t size) {
+    for (size_t chunk = 0; chunk < size; chunk += 64) {
+        uint64_t bits = 0;
+
+        for (size_t i = 0; i < 64; i += 8) {
+            uint64_t word;
+
+            memcpy(&word, &data[chunk + i], 8);
+            bits |= word;
+        }
+
+        if (bits != 0) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * blockIsZeroSized for each block size, so the loop bound is a constant the compiler can unroll.
+ */
+static uint8_t blockIsZero512(const uint8_t *data) {
+    return blockIsZeroSized(data, 512);
+}
+
+static uint8_t blockIsZero1024(const uint8_t *data) {
+    return blockIsZeroSized(data, 1024);
+}
+
+static uint8_t blockIsZero2048(const uint8_t *data) {
+    return blockIsZeroSized(data, 2048);
+}
+
+static uint8_t blockIsZero4096(const uint8_t *data) {
+    return blockIsZeroSized(data, 4096);
+}
+
+/*
+ * Adds the block to the first available position.
+ * This function will create indirect blocks as necessary.
+ */
+static int8_t addAllocatedBlockToInode(Superblock *sb, Inode *inode, uint16_t numBytes, uint32_t blockNumber) {
+    uint32_t inodeSize = getFileSize(inode);
+    // Blocks are only ever added at the end, so the index follows from the size and the block map
+    // never has to be searched.
+    uint32_t index = (inodeSize + imageFormat.blockSize - 1) / imageFormat.blockSize;
+    int8_t mapSuccess = mapBlockAtIndex(sb, inode, index, blockNumber);
+
+    if (mapSuccess != 0) {
+        return mapSuccess;
+    }
+
+    setFileSize(inode, inodeSize + numBytes);
+
+    return 0;
+}
+
+// TODO: Use setBlockNumberAtIndex function
+static int8_t convertInodeToLargeFile(Superblock *sb, Inode *inode) {
+    uint32_t newIndirectBlockNumber;
+    uint8_t indirectBlockData[MAX_BLOCK_SIZE] = { 0 };
+
+    if (inodeIsLargeFile(inode)) {
+        // i-node is already a large file. Bam, done.
+        return 0;
+    }
+
+    newIndirectBlockNumber = v6_alloc(sb);
+
+    if (newIndirectBlockNumber == 0) {
+        return E_ALLOCATE_FAILURE;
+    }
+
+    // The block numbers that are initially stored in inode->addr[0-7]
+    imageFormat.writeAddresses(indirectBlockData, 0, inode->addr, 8);
+    for (size_t i = 0; i < 8; i++) {
+        inode->addr[i] = 0;
+    }
+
+    v6_write_block(newIndirectBlockNumber, indirectBlockData);
+    inode->addr[0] = newIndirectBlockNumber;
+    inode->flags |= FLAG_LARGE_FILE;
+
+    return 0;
+}
+
+/*
+ * Walks the blocks of an i-node in order. Pass the i-node to start from the first block, then NULL
+ * for each block after that. Returns 0 when there are no more blocks.
+ *
+ * Holes are skipped, so the position of a block in the file can't be inferred from the walk.
+ * Use getBlockNumberAtIndex to read a file whose contents matter by offset.
+ */
+static uint32_t getNextAllocatedBlockNumber(Inode *inode) {
+    static Inode *persistentInode;
+    static uint32_t numBlocks;
+    static uint32_t blockIndex;
+
+    if (inode == NULL) {
+        if (persistentInode == NULL) {
+            // No i-node was ever given.
+            return 0;
+        }
+    } else {
+        // Set static references and start from beginning of i-node
+        persistentInode = inode;
+        // Nothing past the end of the file is mapped, so the walk stops there.
+        numBlocks = (getFileSize(inode) + imageFormat.blockSize - 1) / imageFormat.blockSize;
+        if (inodeIsLargeFile(inode) == 0 && numBlocks > 8) {
+            numBlocks = 8;
+        }
+        blockIndex = 0;
+    }
+
+    while (blockIndex < numBlocks) {
+        uint32_t blockNumber = getBlockNumberAtIndex(persistentInode, blockIndex);
+        blockIndex += 1;
+        if (blockNumber == BLOCK_NUMBER_UNREADABLE) {
+            // Nothing past an unreadable indirect block can be found, so the walk ends there.
+            break;
+        }
+        if (blockNumber != 0) {
+            // We have a valid block number
+            return blockNumber;
+        }
+    }
+
+    // If we haven't found a block number by this point,
+    // we've run out of places to look. There are no more blocks.
+    return 0;
+}
+
+/*
+ * Needs the Superblock since it may have to allocate new blocks.
+ * Seems messy, but I'm not sure if there's a better way to do that.
+ */
+static int8_t addDirectoryEntry(Superblock *sb, Inode *inode, char *filename, uint16_t inodeNumber) {
+    uint32_t blockNumber;
+    char inodeFilename[15] = { 0 };
+
+    if (inodeIsDirectory(inode) == 0) {
+        return -1;
+    }
+
+    if (findDirectoryEntry(inode, filename)) {
+        // Directory already exists
+        return -1;
+    }
+
+    // First, look for an empty slot in one of the allocated blocks.
+    blockNumber = getNextAllocatedBlockNumber(inode);
+    // Copy to inodeFilename for correct padding.
+    strncpy(inodeFilename, filename, 14);
+
+    while (blockNumber != 0) {
+        // The entry is filled in place in the cached block, which is then written back.
+        DiskDirectoryEntry *entries = (DiskDirectoryEntry *) getCachedBlock(blockNumber);
+
+        for (size_t i = 0; entries != NULL && i < imageFormat.entriesPerBlock; i++) {
+            if (entries[i].inodeNumber == 0) {
+                entries[i].inodeNumber = inodeNumber;
+                memcpy(entries[i].name, inodeFilename, sizeof(entries[i].name));
+                return v6_write_block(blockNumber, entries);
+            }
+        }
+        blockNumber = getNextAllocatedBlockNumber(NULL);
+    }
+
+    // If there isn't one, allocate a block and add it to the inode.
+    uint32_t newBlockNumber;
+    DiskDirectoryEntry newEntries[MAX_ENTRIES_PER_BLOCK] = { 0 };
+
+    newBlockNumber = v6_alloc(sb);
+
+    if (newBlockNumber == 0) {
+        return E_ALLOCATE_FAILURE;
+    }
+
+    newEntries[0].inodeNumber = inodeNumber;
+    memcpy(newEntries[0].name, inodeFilename, sizeof(newEntries[0].name));
+    v6_write_block(newBlockNumber, newEntries);
+    addAllocatedBlockToInode(sb, inode, (uint16_t) imageFormat.blockSize, newBlockNumber);
+
+    return 0;
+}
+
+static int8_t removeDirectoryEntry(Inode *inode, char *filename) {
+    uint32_t blockNumber = getNextAllocatedBlockNumber(inode);
+    DirectoryEntryKey key;
+
+    if (inodeIsDirectory(inode) == 0) {
+        return -1;
+    }
+
+    makeDirectoryEntryKey(filename, &key);
+
+    while (blockNumber != 0) {
+        uint8_t *blockData = getCachedBlock(blockNumber);
+        int entryIndex = blockData != NULL ? imageFormat.findEntryInBlock(blockData, &key) : -1;
+
+        if (entryIndex >= 0) {
+            ((DiskDirectoryEntry *) blockData)[entryIndex].inodeNumber = 0;
+            return v6_write_block(blockNumber, blockData);
+        }
+        blockNumber = getNextAllocatedBlockNumber(NULL);
+    }
+
+    return -1;
+}
+
+/*
+ * Packs the live entries of a directory into its first blocks, keeping their order, then frees the
+ * blocks left over at the end and any indirect blocks that no longer map anything. Does nothing
+ * unless that frees at least minPercentFreed percent of the directory's blocks, and at least one,
+ * or while the directory is open with v6_opendir, since moving entries under a listing would make
+ * it skip them.
+ *
+ * The packed blocks are written front to back, and an entry only ever moves towards the front, so
+ * every entry is in some mapped slot throughout: a crash part way through can leave a name in two
+ * slots, or leak the blocks about to be freed, but never loses one. report may be NULL.
+ */
+static int8_t compactDirectory(Superblock *sb, uint16_t inodeNumber, Inode *inode, uint8_t minPercentFreed,
+                               V6CompactReport *report) {
+    DiskDirectoryEntry entries[MAX_ENTRIES_PER_BLOCK], packed[MAX_ENTRIES_PER_BLOCK];
+    BlockList contentBlocks = { 0 }, indirectBlocks = { 0 };
+    BlockList freedBlocks = { 0 }, freedIndirectBlocks = { 0 };
+    const size_t entriesPerBlock = imageFormat.entriesPerBlock;
+    size_t numBlocks, numMapped = 0, numLive = 0, numKept, numIndirectBlocks = 0;
+    size_t packedBlock = 0, packedCount = 0, numFreed = 0;
+    uint32_t entriesMoved = 0;
+    uint32_t *blockMap;
+    int8_t result;
+
+    numBlocks = (getFileSize(inode) + imageFormat.blockSize - 1) / imageFormat.blockSize;
+    if (inodeIsDirectory(inode) == 0 || numBlocks < 2 || directoryIsOpen(inodeNumber)) {
+        return 0;
+    }
+
+    blockMap = malloc(numBlocks * sizeof(uint32_t));
+    if (blockMap == NULL) {
+        return E_ALLOCATE_FAILURE;
+    }
+
+    result = readBlockMap(inode, blockMap, numBlocks);
+
+    // Count the live entries first, straight out of the cache, since usually there's nothing to do.
+    for (size_t i = 0; i < numBlocks && result == 0; i++) {
+        DiskDirectoryEntry *blockEntries;
+
+        if (blockMap[i] == 0) {
+            continue;
+        }
+        blockMap[numMapped++] = blockMap[i];
+
+        blockEntries = (DiskDirectoryEntry *) getCachedBlock(blockMap[i]);
+        if (blockEntries == NULL) {
+            result = E_BLOCK_READ_FAILURE;
+            break;
+        }
+        for (size_t j = 0; j < entriesPerBlock; j++) {
+            numLive += blockEntries[j].inodeNumber != 0;
+        }
+    }
+
+    numKept = numLive > 0 ? (numLive + entriesPerBlock - 1) / entriesPerBlock : 1;
+    if (result != 0 || numKept >= numBlocks || numKept > numMapped
+        || (numBlocks - numKept) * 100 < numBlocks * minPercentFreed) {
+        free(blockMap);
+        return result;
+    }
+
+    memset(packed, 0, sizeof(packed));
+
+    for (size_t i = 0; i < numMapped && result == 0; i++) {
+        uint8_t *blockData = getCachedBlock(blockMap[i]);
+
+        if (blockData == NULL) {
+            result = E_BLOCK_READ_FAILURE;
+            break;
+        }
+        // Copied out, since the packed block written next may be this one.
+        memcpy(entries, blockData, imageFormat.blockSize);
+
+        for (size_t j = 0; j < entriesPerBlock && result == 0; j++) {
+            if (entries[j].inodeNumber == 0) {
+                continue;
+            }
+            if (i != packedBlock || j != packedCount) {
+                entriesMoved++;
+            }
+            packed[packedCount++] = entries[j];
+
+            if (packedCount == entriesPerBlock) {
+                result = writeBlockIfChanged(blockMap[packedBlock], packed);
+                memset(packed, 0, sizeof(packed));
+                packedBlock++;
+                packedCount = 0;
+            }
+        }
+    }
+
+    if (result == 0 && packedBlock < numKept) {
+        result = writeBlockIfChanged(blockMap[packedBlock], packed);
+    }
+
+    if (result == 0) {
+        result = collectInodeBlocks(inode, &contentBlocks, &indirectBlocks);
+    }
+
+    // The indirect blocks that are still needed are reused, and the rest freed with the tail.
+    if (result == 0) {
+        numIndirectBlocks = countIndirectBlocks(blockMap, numKept);
+        result = writeBlockMap(inode, blockMap, numKept, indirectBlocks.blocks);
+    }
+
+    if (result == 0) {
+        setFileSize(inode, (uint32_t) (numKept * imageFormat.blockSize));
+        result = inodeSave(sb, inodeNumber, inode);
+    }
+
+    if (result == 0) {
+        freedBlocks.blocks = &blockMap[numKept];
+        freedBlocks.count = numMapped - numKept;
+        if (indirectBlocks.count > numIndirectBlocks) {
+            freedIndirectBlocks.blocks = &indirectBlocks.blocks[numIndirectBlocks];
+            freedIndirectBlocks.count = indirectBlocks.count - numIndirectBlocks;
+        }
+        numFreed = freedBlocks.count + freedIndirectBlocks.count;
+        result = freeBlockBatch(sb, &freedBlocks, &freedIndirectBlocks);
+    }
+
+    // The i-node no longer maps the freed indirect blocks, so any held back can go now.
+    if (result == 0) {
+        result = freeBlockList(sb, &freedIndirectBlocks);
+    }
+
+    // Freed blocks can be handed out again right away and written in place as file data, so the
+    // frees have to be committed before that can happen.
+    if (result == 0 && journalCapturing) {
+        result = journalCommit();
+    }
+
+    if (result == 0 && report != NULL) {
+        report->directoriesCompacted++;
+        report->entriesMoved += entriesMoved;
+        report->blocksFreed += (uint32_t) numFreed;
+    }
+
+    free(blockMap);
+    free(contentBlocks.blocks);
+    free(indirectBlocks.blocks);
+
+    return result;
+}
+
+/*
+ * Compacts the directory at v6DirectoryPath, or every directory on the image if it is NULL, as far
+ * as a block can be freed. See v6_compact.
+ */
+static int8_t compactDirectories(Superblock *sb, char *v6DirectoryPath, V6CompactReport *report) {
+    uint32_t numInodes = getNumInodes(sb);
+    int8_t result = 0;
+
+    memset(report, 0, sizeof(*report));
+
+    if (v6DirectoryPath != NULL) {
+        uint16_t inodeNumber = getTerminalInodeNumber(sb, v6DirectoryPath);
+        Inode *inode = inodeLoad(sb, inodeNumber);
+
+        if (inode == NULL) {
+            return E_NO_SUCH_FILE;
+        }
+        if (inodeIsDirectory(inode) == 0) {
+            return E_INVALID_PATH;
+        }
+
+        report->directoriesScanned = 1;
+        return compactDirectory(sb, inodeNumber, inode, 0, report);
+    }
+
+    for (uint32_t inodeNumber = 1; inodeNumber <= numInodes && result == 0; inodeNumber++) {
+        uint8_t *inodeBlock = getCachedBlock(getInodeBlockNumber((uint16_t) inodeNumber));
+        Inode inode;
+
+        if (inodeBlock == NULL) {
+            return E_BLOCK_READ_FAILURE;
+        }
+        imageFormat.inodeFromDisk(getInodeInBlock(inodeBlock, (uint16_t) inodeNumber), &inode);
+
+        if ((inode.flags & FLAG_INODE_ALLOCATED) == 0 || inodeIsDirectory(&inode) == 0) {
+            continue;
+        }
+
+        report->directoriesScanned++;
+        result = compactDirectory(sb, (uint16_t) inodeNumber, &inode, 0, report);
+    }
+
+    return result;
+}
+
+/*
+ * Writes a block unless it already holds data.
+ */
+static int8_t writeBlockIfChanged(uint32_t blockNumber, void *data) {
+    uint8_t *blockData = getCachedBlock(blockNumber);
+
+    if (blockData != NULL && memcmp(blockData, data, imageFormat.blockSize) == 0) {
+        return 0;
+    }
+
+    return v6_write_block(blockNumber, data);
+}
+
+/*
+ * Find the inode number of the file designated by filename.
+ *
+ * If the directory could not be found, return 0.
+ */
+static uint16_t findDirectoryEntry(Inode *inode, char *filename) {
+    uint32_t blockNumber = getNextAllocatedBlockNumber(inode);
+    DirectoryEntryKey key;
+
+    if (inodeIsDirectory(inode) == 0) {
+        return 0;
+    }
+
+    makeDirectoryEntryKey(filename, &key);
+
+    while (blockNumber != 0) {
+        // Scanned in place in the block cache, nothing is copied out but the match.
+        uint8_t *blockData = getCachedBlock(blockNumber);
+
+        if (blockData != NULL) {
+            int entryIndex = imageFormat.findEntryInBlock(blockData, &key);
+
+            if (entryIndex >= 0) {
+                return ((DiskDirectoryEntry *) blockData)[entryIndex].inodeNumber;
+            }
+        }
+        blockNumber = getNextAllocatedBlockNumber(NULL);
+    }
+
+    return 0;
+}
+
+static void makeDirectoryEntryKey(const char *filename, DirectoryEntryKey *key) {
+    size_t nameLength = strnlen(filename, 14);
+    // The terminating zero has to match too, unless the name fills all 14 bytes.
+    size_t compareLength = nameLength < 14 ? nameLength + 1 : 14;
+
+    memset(key->bytes, 0, sizeof(key->bytes));
+    memcpy(&key->bytes[2], filename, nameLength);
+    key->mask = ((1U << compareLength) - 1U) << 2;
+}
+
+/*
+ * Returns the index of the entry in a directory block of numEntries entries whose name matches
+ * key and whose i-node number isn't 0, or -1 if there isn't one.
+ *
+ * With SSE2 each 16 byte entry is compared against the key in one instruction, four entries per
+ * iteration, and only entries whose names match have their i-node number looked at.
+ */
+static inline __attribute__((always_inline)) int findEntryInBlockSized(const uint8_t *blockData,
+                                                                       const DirectoryEntryKey *key,
+                                                                       int numEntries) {
+#if defined(__SSE2__)
+    const __m128i keyBytes = _mm_loadu_si128((const __m128i *) key->bytes);
+    const __m128i zero = _mm_setzero_si128();
+
+    for (int i = 0; i < numEntries; i += 4) {
+        __m128i entries[4];
+        uint32_t nameMatches[4];
+
+        for (int j = 0; j < 4; j++) {
+            entries[j] = _mm_loadu_si128((const __m128i *) &blockData[(i + j) * 16]);
+            nameMatches[j] = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(entries[j], keyBytes)) & key->mask;
+        }
+
+        for (int j = 0; j < 4; j++) {
+            if (nameMatches[j] == key->mask) {
+                // Both i-node number bytes being zero means the slot is free.
+                uint32_t inodeIsZero = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(entries[j], zero)) & 3U;
+
+                if (inodeIsZero != 3U) {
+                    return i + j;
+                }
+            }
+        }
+    }
+
+    return -1;
+#else
+    return findEntryInBlockScalar(blockData, key, numEntries);
+#endif
+}
+
+/*
+ * findEntryInBlockSized for each block size.
+ */
+static int findEntryInBlock512(const uint8_t *blockData, const DirectoryEntryKey *key) {
+    return findEntryInBlockSized(blockData, key, 512 / sizeof(DiskDirectoryEntry));
+}
+
+static int findEntryInBlock1024(const uint8_t *blockData, const DirectoryEntryKey *key) {
+    return findEntryInBlockSized(blockData, key, 1024 / sizeof(DiskDirectoryEntry));
+}
+
+static int findEntryInBlock2048(const uint8_t *blockData, const DirectoryEntryKey *key) {
+    return findEntryInBlockSized(blockData, key, 2048 / sizeof(DiskDirectoryEntry));
+}
+
+static int findEntryInBlock4096(const uint8_t *blockData, const DirectoryEntryKey *key) {
+    return findEntryInBlockSized(blockData, key, 4096 / sizeof(DiskDirectoryEntry));
+}
+
+/*
+ * Portable version of findEntryInBlockSized.
+ */
+static int findEntryInBlockScalar(const uint8_t *blockData, const DirectoryEntryKey *key, int numEntries) {
+    for (int i = 0; i < numEntries; i++) {
+        const uint8_t *entry = &blockData[i * 16];
+
+        if ((entry[0] | entry[1]) == 0) {
+            continue;
+        }
+
+        size_t j = 2;
+        while (j < 16 && ((key->mask >> j) & 1U) != 0 && entry[j] == key->bytes[j]) {
+            j++;
+        }
+        if (j == 16 || ((key->mask >> j) & 1U) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * The entry scan findDirectoryEntry used before findEntryInBlockSized, kept as the baseline for
+ * v6_bench_dirscan.
+ */
+static int findEntryInBlockStrncmp(const uint8_t *blockData, const char *filename) {
+    uint16_t inodeNumber = 0;
+    char inodeFilename[15] = { 0 };
+
+    for (int i = 0; i < 32; i++) {
+        memcpy(&inodeNumber, &blockData[i * 16], 2);
+        memcpy(inodeFilename, &blockData[(i * 16) + 2], 14);
+
+        if (inodeNumber > 0) {
+            if (strncmp(filename, inodeFilename, 14) == 0) {
+                return i;
+            }
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Finds which of a large file's eight addresses covers a block index, and the index relative to the
+ * start of that address's range.
+ *
+ * Returns 0 if the index is past everything the block map can hold.
+ */
+static uint8_t findAddressSlot(uint32_t index, size_t *addrIndex, uint32_t *indexInSlot) {
+    for (size_t i = 0; i < 8; i++) {
+        if (index < imageFormat.addressSpans[i]) {
+            *addrIndex = i;
+            *indexInSlot = index;
+            return 1;
+        }
+        index -= imageFormat.addressSpans[i];
+    }
+
+    return 0;
+}
+
+/*
+ * Returns the block at index in the file, 0 for a hole, or BLOCK_NUMBER_UNREADABLE if an indirect
+ * block mapping it can't be read.
+ */
+static uint32_t getBlockNumberAtIndex(Inode *inode, uint32_t index) {
+    size_t addrIndex;
+    uint32_t indexInSlot;
+    uint32_t span;
+    uint32_t blockNumber;
+    uint8_t *indirectBlockData;
+
+    if (inodeIsLargeFile(inode) == 0) {
+        if (index > 7) {
+            return 0;
+        }
+        return inode->addr[index];
+    }
+
+    if (findAddressSlot(index, &addrIndex, &indexInSlot) == 0) {
+        return 0;
+    }
+
+    blockNumber = inode->addr[addrIndex];
+    span = imageFormat.addressSpans[addrIndex];
+    for (uint8_t level = imageFormat.addressLevels[addrIndex]; level > 0 && blockNumber != 0; level--) {
+        span /= imageFormat.addressesPerBlock;
+
+        // Indirect blocks are looked at in place in the block cache, so repeat lookups cost no I/O.
+        indirectBlockData = getCachedBlock(blockNumber);
+        if (indirectBlockData == NULL) {
+            return BLOCK_NUMBER_UNREADABLE;
+        }
+        blockNumber = getBlockAddressAt(indirectBlockData, indexInSlot / span);
+        indexInSlot %= span;
+    }
+
+    return blockNumber;
+}
+
+/*
+ * Called before a reader reads the block at blockIndex. A read of the block after the last one
+ * continues a sequential stream, and once the stream reaches the end of what was read ahead, the
+ * next window is read ahead from blockIndex on, twice as large as the last. Any other read ends
+ * the stream.
+ */
+static void readaheadNote(Inode *inode, ReadaheadState *state, uint32_t blockIndex) {
+    uint32_t numFileBlocks = (getFileSize(inode) + imageFormat.blockSize - 1) / imageFormat.blockSize;
+
+    // Small reads come back to the same block several times without breaking the stream.
+    if (state->nextIndex != 0 && blockIndex == state->nextIndex - 1) {
+        return;
+    }
+
+    if (blockIndex != state->nextIndex) {
+        state->window = 0;
+        state->readaheadEnd = 0;
+    } else if (blockIndex >= state->readaheadEnd && blockIndex < numFileBlocks) {
+        if (state->window == 0) {
+            state->window = READAHEAD_MIN_BLOCKS;
+        } else if (state->window < READAHEAD_MAX_BLOCKS) {
+            state->window *= 2;
+        }
+
+        state->readaheadEnd = numFileBlocks - blockIndex < state->window ? numFileBlocks : blockIndex + state->window;
+        readaheadBlocks(inode, blockIndex, state->readaheadEnd);
+    }
+
+    state->nextIndex = blockIndex + 1;
+}
+
+/*
+ * Reads the blocks of a file from firstIndex up to endIndex into the block cache, along with the
+ * singly indirect block the next window will start in. Holes and cached blocks are skipped, and
+ * blocks that are next to each other on disk are read in one request. Only a speedup, so a block
+ * that can't be read is left for the reader to fail on.
+ */
+static void readaheadBlocks(Inode *inode, uint32_t firstIndex, uint32_t endIndex) {
+    static uint8_t runData[(READAHEAD_MAX_BLOCKS + 1) * MAX_BLOCK_SIZE];
+    uint32_t blockNumbers[READAHEAD_MAX_BLOCKS + 1];
+    size_t numBlocks = 0;
+    size_t addrIndex;
+    uint32_t indexInSlot;
+
+    // Looking the blocks up reads any indirect block the window reaches into. The window stops
+    // short of an indirect block that can't be read, leaving the reader to report it.
+    for (uint32_t index = firstIndex; index < endIndex; index++) {
+        uint32_t blockNumber = getBlockNumberAtIndex(inode, index);
+
+        if (blockNumber == BLOCK_NUMBER_UNREADABLE) {
+            break;
+        }
+        if (blockNumber != 0 && blockCacheLookup(blockNumber) == NULL) {
+            blockNumbers[numBlocks++] = blockNumber;
+        }
+    }
+
+    // A file is usually written with each indirect block just ahead of the blocks it maps, so
+    // the next one tends to join the last run.
+    if (inodeIsLargeFile(inode) && findAddressSlot(endIndex, &addrIndex, &indexInSlot)
+        && imageFormat.addressLevels[addrIndex] == 1 && inode->addr[addrIndex] != 0
+        && blockCacheLookup(inode->addr[addrIndex]) == NULL) {
+        blockNumbers[numBlocks++] = inode->addr[addrIndex];
+    }
+
+    qsort(blockNumbers, numBlocks, sizeof(uint32_t), compareUint32);
+
+    for (size_t runStart = 0, runEnd; runStart < numBlocks; runStart = runEnd) {
+        runEnd = runStart + 1;
+        while (runEnd < numBlocks && blockNumbers[runEnd] == blockNumbers[runEnd - 1] + 1) {
+            runEnd++;
+        }
+
+        if (deviceReadBlocks(blockNumbers[runStart], runEnd - runStart, runData) != 0) {
+            return;
+        }
+
+        for (size_t i = runStart; i < runEnd; i++) {
+            uint8_t *cachedData;
+
+            if (blockCacheLookup(blockNumbers[i]) != NULL) {
+                continue;
+            }
+            cachedData = blockCacheInsert(blockNumbers[i]);
+            if (cachedData == NULL) {
+                return;
+            }
+            memcpy(cachedData, &runData[(i - runStart) * imageFormat.blockSize], imageFormat.blockSize);
+        }
+    }
+}
+
+static int8_t setBlockNumberAtIndex(Superblock *sb, Inode *inode, uint32_t blockNumber, uint32_t index) {
+    uint8_t emptyBlockData[MAX_BLOCK_SIZE];
+    size_t addrIndex;
+    uint32_t indexInSlot;
+    uint32_t span;
+    uint32_t indirectBlockNumber;
+    uint8_t *indirectBlockData;
+
+    if (inodeIsLargeFile(inode) == 0) {
+        if (index > 7) {
+            return E_INVALID_INDEX;
+        }
+        inode->addr[index] = blockNumber;
+        return 0;
+    }
+
+    if (index >= imageFormat.maxFileBlocks || findAddressSlot(index, &addrIndex, &indexInSlot) == 0) {
+        return E_INVALID_INDEX;
+    }
+
+    if (inode->addr[addrIndex] == 0) {
+        uint32_t newIndirectBlockNumber = v6_alloc(sb);
+
+        if (newIndirectBlockNumber == 0) {
+            return E_ALLOCATE_FAILURE;
+        }
+
+        memset(emptyBlockData, 0, imageFormat.blockSize);
+        v6_write_block(newIndirectBlockNumber, emptyBlockData);
+        inode->addr[addrIndex] = newIndirectBlockNumber;
+    }
+
+    // Walk down to the singly indirect block, allocating any indirect block on the way that is missing.
+    indirectBlockNumber = inode->addr[addrIndex];
+    span = imageFormat.addressSpans[addrIndex];
+    for (uint8_t level = imageFormat.addressLevels[addrIndex]; level > 1; level--) {
+        uint32_t nextBlockNumber;
+
+        span /= imageFormat.addressesPerBlock;
+        indirectBlockData = getCachedBlock(indirectBlockNumber);
+        if (indirectBlockData == NULL) {
+            return E_BLOCK_READ_FAILURE;
+        }
+        nextBlockNumber = getBlockAddressAt(indirectBlockData, indexInSlot / span);
+
+        if (nextBlockNumber == 0) {
+            nextBlockNumber = v6_alloc(sb);
+            if (nextBlockNumber == 0) {
+                return E_ALLOCATE_FAILURE;
+            }
+            memset(emptyBlockData, 0, imageFormat.blockSize);
+            v6_write_block(nextBlockNumber, emptyBlockData);
+
+            // Allocating may have read other blocks, so the parent is looked up again.
+            indirectBlockData = getCachedBlock(indirectBlockNumber);
+            if (indirectBlockData == NULL) {
+                return E_BLOCK_READ_FAILURE;
+            }
+            setBlockAddressAt(indirectBlockData, indexInSlot / span, nextBlockNumber);
+            v6_write_block(indirectBlockNumber, indirectBlockData);
+        }
+
+        indirectBlockNumber = nextBlockNumber;
+        indexInSlot %= span;
+    }
+
+    indirectBlockData = getCachedBlock(indirectBlockNumber);
+    if (indirectBlockData == NULL) {
+        return E_BLOCK_READ_FAILURE;
+    }
+    setBlockAddressAt(indirectBlockData, indexInSlot, blockNumber);
+    return v6_write_block(indirectBlockNumber, indirectBlockData);
+}
+
+static uint32_t getBlockAddressAt(const uint8_t *blockData, size_t entry) {
+    uint32_t blockNumber;
+
+    imageFormat.readAddresses(blockData, entry, &blockNumber, 1);
+    return blockNumber;
+}
+
+static void setBlockAddressAt(uint8_t *blockData, size_t entry, uint32_t blockNumber) {
+    imageFormat.writeAddresses(blockData, entry, &blockNumber, 1);
+}
+
+/*
+ * Works out the format and block size of the image open on fd. The superblock is the second block
+ * whatever the block size, so an extended one is looked for at each offset a block size puts it
+ * at. Anything else, including an empty file, is taken to be a V6 image.
+ */
+static void imageFormatProbe(int fd, uint8_t *extended, uint32_t *blockSize) {
+    DiskExtendedSuperblock disk;
+
+    for (uint32_t size = MIN_BLOCK_SIZE; size <= MAX_BLOCK_SIZE; size *= 2) {
+        if (pread(fd, &disk, sizeof(disk), size) == (ssize_t) sizeof(disk)
+            && disk.magic == EXTENDED_SUPERBLOCK_MAGIC
+            && (disk.blockSize == size || (disk.blockSize == 0 && size == MIN_BLOCK_SIZE))) {
+            *extended = 1;
+            *blockSize = size;
+            return;
+        }
+    }
+
+    *extended = 0;
+    *blockSize = BLOCK_SIZE;
+}
+
+static void imageFormatInit(uint8_t extended, uint32_t blockSize) {
+    uint32_t span;
+
+    memset(&imageFormat, 0, sizeof(imageFormat));
+    imageFormat.extended = extended;
+    imageFormat.blockSize = blockSize;
+    while ((1U << imageFormat.blockShift) < blockSize) {
+        imageFormat.blockShift++;
+    }
+    imageFormat.entriesPerBlock = blockSize / sizeof(DiskDirectoryEntry);
+
+    switch (blockSize) {
+        case 1024:
+            imageFormat.blockIsZero = blockIsZero1024;
+            imageFormat.findEntryInBlock = findEntryInBlock1024;
+            break;
+        case 2048:
+            imageFormat.blockIsZero = blockIsZero2048;
+            imageFormat.findEntryInBlock = findEntryInBlock2048;
+            break;
+        case 4096:
+            imageFormat.blockIsZero = blockIsZero4096;
+            imageFormat.findEntryInBlock = findEntryInBlock4096;
+            break;
+        default:
+            imageFormat.blockIsZero = blockIsZero512;
+            imageFormat.findEntryInBlock = findEntryInBlock512;
+            break;
+    }
+
+    if (extended) {
+        // Six singly indirect addresses, a doubly indirect one and a triply indirect one.
+        static const uint8_t extendedLevels[8] = { 1, 1, 1, 1, 1, 1, 2, 3 };
+
+        imageFormat.inodeSize = sizeof(DiskExtendedInode);
+        imageFormat.addressesPerBlock = blockSize / sizeof(uint32_t);
+        memcpy(imageFormat.addressLevels, extendedLevels, sizeof(extendedLevels));
+        imageFormat.freeArraySize = EXTENDED_FREE_ARRAY_SIZE;
+        imageFormat.superblockFromDisk = extendedSuperblockFromDisk;
+        imageFormat.superblockToDisk = extendedSuperblockToDisk;
+        imageFormat.inodeFromDisk = extendedInodeFromDisk;
+        imageFormat.inodeToDisk = extendedInodeToDisk;
+        imageFormat.readAddresses = readAddresses32;
+        imageFormat.writeAddresses = writeAddresses32;
+    } else {
+        // Seven singly indirect addresses and a doubly indirect one.
+        static const uint8_t v6Levels[8] = { 1, 1, 1, 1, 1, 1, 1, 2 };
+
+        imageFormat.inodeSize = sizeof(DiskInode);
+        imageFormat.addressesPerBlock = blockSize / sizeof(uint16_t);
+        memcpy(imageFormat.addressLevels, v6Levels, sizeof(v6Levels));
+        imageFormat.freeArraySize = 100;
+        imageFormat.superblockFromDisk = superblockFromDisk;
+        imageFormat.superblockToDisk = superblockToDisk;
+        imageFormat.inodeFromDisk = inodeFromDisk;
+        imageFormat.inodeToDisk = inodeToDisk;
+        imageFormat.readAddresses = readAddresses16;
+        imageFormat.writeAddresses = writeAddresses16;
+    }
+    imageFormat.inodesPerBlock = blockSize / imageFormat.inodeSize;
+
+    imageFormat.maxFileBlocks = 0;
+    for (size_t i = 0; i < 8; i++) {
+        span = 1;
+        for (uint8_t level = 0; level < imageFormat.addressLevels[i]; level++) {
+            span *= imageFormat.addressesPerBlock;
+        }
+        imageFormat.addressSpans[i] = span;
+        imageFormat.maxFileBlocks += span;
+    }
+
+    if (extended) {
+        // Sizes are 32 bits wide in memory.
+        if (imageFormat.maxFileBlocks > UINT32_MAX / blockSize) {
+            imageFormat.maxFileBlocks = UINT32_MAX / blockSize;
+        }
+    } else {
+        // Block indexes on a V6 image are 16 bits wide.
+        imageFormat.maxFileBlocks = MAX_FILE_SIZE / blockSize;
+    }
+    imageFormat.maxFileSize = imageFormat.maxFileBlocks * blockSize;
+}
+
+static void superblockFromDisk(const uint8_t *blockData, Superblock *sb) {
+    const DiskSuperblock *disk = (const DiskSuperblock *) blockData;
+
+    sb->isize = disk->isize;
+    sb->fsize = disk->fsize;
+    sb->nfree = disk->nfree;
+    for (size_t i = 0; i < 100; i++) {
+        sb->free[i] = disk->free[i];
+    }
+    sb->ninode = disk->ninode;
+    memcpy(sb->inode, disk->inode, sizeof(disk->inode));
+    sb->flock = disk->flock;
+    sb->ilock = disk->ilock;
+    sb->fmod = disk->fmod;
+    memcpy(sb->time, disk->time, sizeof(disk->time));
+    sb->nreclaim = disk->nreclaim;
+    memcpy(sb->reclaim, disk->reclaim, sizeof(disk->reclaim));
+    sb->ngroups = disk->groupsMagic == ALLOCATION_GROUPS_MAGIC ? disk->ngroups : 0;
+    reclaimListCheck(sb);
+}
+
+/*
+ * Changes the superblock fields of a block in place. The unused bytes are left as they are.
+ */
+static void superblockToDisk(Superblock *sb, uint8_t *blockData) {
+    DiskSuperblock *disk = (DiskSuperblock *) blockData;
+
+    disk->isize = sb->isize;
+    disk->fsize = (uint16_t) sb->fsize;
+    disk->nfree = sb->nfree;
+    for (size_t i = 0; i < 100; i++) {
+        disk->free[i] = (uint16_t) sb->free[i];
+    }
+    disk->ninode = sb->ninode;
+    memcpy(disk->inode, sb->inode, sizeof(disk->inode));
+    disk->flock = sb->flock;
+    disk->ilock = sb->ilock;
+    disk->fmod = sb->fmod;
+    memcpy(disk->time, sb->time, sizeof(disk->time));
+    disk->nreclaim = sb->nreclaim;
+    memcpy(disk->reclaim, sb->reclaim, sizeof(disk->reclaim));
+    if (sb->ngroups > 0) {
+        disk->groupsMagic = ALLOCATION_GROUPS_MAGIC;
+        disk->ngroups = sb->ngroups;
+    }
+}
+
+static void extendedSuperblockFromDisk(const uint8_t *blockData, Superblock *sb) {
+    const DiskExtendedSuperblock *disk = (const DiskExtendedSuperblock *) blockData;
+
+    memset(sb->free, 0, sizeof(sb->free));
+    sb->isize = disk->isize;
+    sb->fsize = disk->fsize;
+    sb->nfree = disk->nfree;
+    memcpy(sb->free, disk->free, sizeof(disk->free));
+    sb->ninode = disk->ninode;
+    memcpy(sb->inode, disk->inode, sizeof(disk->inode));
+    sb->flock = disk->flock;
+    sb->ilock = disk->ilock;
+    sb->fmod = disk->fmod;
+    memcpy(sb->time, disk->time, sizeof(disk->time));
+    sb->nreclaim = disk->nreclaim;
+    memcpy(sb->reclaim, disk->reclaim, sizeof(disk->reclaim));
+    sb->ngroups = disk->groupsMagic == ALLOCATION_GROUPS_MAGIC ? disk->ngroups : 0;
+    if (sb->nfree > EXTENDED_FREE_ARRAY_SIZE) {
+        sb->nfree = 0;
+    }
+    reclaimListCheck(sb);
+}
+
+static void extendedSuperblockToDisk(Superblock *sb, uint8_t *blockData) {
+    DiskExtendedSuperblock *disk = (DiskExtendedSuperblock *) blockData;
+
+    disk->isize = sb->isize;
+    disk->fsize = sb->fsize;
+    disk->nfree = sb->nfree;
+    memcpy(disk->free, sb->free, sizeof(disk->free));
+    disk->ninode = sb->ninode;
+    memcpy(disk->inode, sb->inode, sizeof(disk->inode));
+    disk->flock = sb->flock;
+    disk->ilock = sb->ilock;
+    disk->fmod = sb->fmod;
+    memcpy(disk->time, sb->time, sizeof(disk->time));
+    disk->blockSize = (uint16_t) imageFormat.blockSize;
+    disk->magic = EXTENDED_SUPERBLOCK_MAGIC;
+    disk->nreclaim = sb->nreclaim;
+    memcpy(disk->reclaim, sb->reclaim, sizeof(disk->reclaim));
+    if (sb->ngroups > 0) {
+        disk->groupsMagic = ALLOCATION_GROUPS_MAGIC;
+        disk->ngroups = sb->ngroups;
+    }
+}
+
+static void reclaimListCheck(Superblock *sb) {
+    // Images written before the reclaim list existed may hold anything here.
+    if (sb->nreclaim > MAX_PENDING_RECLAIM) {
+        sb->nreclaim = 0;
+    }
+    for (size_t i = 0; i < sb->nreclaim; i++) {
+        if (sb->reclaim[i] == 0 || sb->reclaim[i] > getNumInodes(sb)) {
+            sb->nreclaim = 0;
+        }
+    }
+}
+
+static void inodeFromDisk(const uint8_t *diskInode, Inode *inode) {
+    const DiskInode *disk = (const DiskInode *) diskInode;
+
+    inode->flags = disk->flags;
+    inode->nlinks = disk->nlinks;
+    inode->uid = disk->uid;
+    inode->gid = disk->gid;
+    inode->size = ((uint32_t) disk->size0 << 16) | disk->size1;
+    if (disk->flags & FLAG_FILE_SIZE_MSB) {
+        inode->size |= 1UL << 24;
+    }
+    for (size_t i = 0; i < 8; i++) {
+        inode->addr[i] = disk->addr[i];
+    }
+    memcpy(inode->actime, disk->actime, sizeof(disk->actime));
+    memcpy(inode->modtime, disk->modtime, sizeof(disk->modtime));
+}
+
+static void inodeToDisk(Inode *inode, uint8_t *diskInode) {
+    DiskInode *disk = (DiskInode *) diskInode;
+
+    disk->flags = inode->flags;
+    if (inode->size & (1UL << 24)) {
+        disk->flags |= FLAG_FILE_SIZE_MSB;
+    } else {
+        disk->flags &= ~FLAG_FILE_SIZE_MSB;
+    }
+    disk->nlinks = inode->nlinks;
+    disk->uid = inode->uid;
+    disk->gid = inode->gid;
+    disk->size0 = (uint8_t) ((inode->size >> 16) & 0xFF);
+    disk->size1 = (uint16_t) inode->size;
+    for (size_t i = 0; i < 8; i++) {
+        disk->addr[i] = (uint16_t) inode->addr[i];
+    }
+    memcpy(disk->actime, inode->actime, sizeof(disk->actime));
+    memcpy(disk->modtime, inode->modtime, sizeof(disk->modtime));
+}
+
+static void extendedInodeFromDisk(const uint8_t *diskInode, Inode *inode) {
+    const DiskExtendedInode *disk = (const DiskExtendedInode *) diskInode;
+
+    inode->flags = disk->flags;
+    inode->nlinks = disk->nlinks;
+    inode->uid = disk->uid;
+    inode->gid = disk->gid;
+    // Nothing writes a size that doesn't fit in 32 bits.
+    inode->size = disk->size > UINT32_MAX ? UINT32_MAX : (uint32_t) disk->size;
+    memcpy(inode->addr, disk->addr, sizeof(disk->addr));
+    memcpy(inode->actime, disk->actime, sizeof(disk->actime));
+    memcpy(inode->modtime, disk->modtime, sizeof(disk->modtime));
+}
+
+static void extendedInodeToDisk(Inode *inode, uint8_t *diskInode) {
+    DiskExtendedInode *disk = (DiskExtendedInode *) diskInode;
+
+    disk->flags = inode->flags;
+    disk->nlinks = inode->nlinks;
+    disk->uid = inode->uid;
+    disk->gid = inode->gid;
+    disk->size = inode->size;
+    memcpy(disk->addr, inode->addr, sizeof(disk->addr));
+    memcpy(disk->actime, inode->actime, sizeof(disk->actime));
+    memcpy(disk->modtime, inode->modtime, sizeof(disk->modtime));
+}
+
+static void readAddresses16(const uint8_t *blockData, size_t first, uint32_t *addresses, size_t count) {
+    const uint16_t *entries = (const uint16_t *) blockData + first;
+
+    for (size_t i = 0; i < count; i++) {
+        addresses[i] = entries[i];
+    }
+}
+
+static void writeAddresses16(uint8_t *blockData, size_t first, const uint32_t *addresses, size_t count) {
+    uint16_t *entries = (uint16_t *) blockData + first;
+
+    for (size_t i = 0; i < count; i++) {
+        entries[i] = (uint16_t) addresses[i];
+    }
+}
+
+static void readAddresses32(const uint8_t *blockData, size_t first, uint32_t *addresses, size_t count) {
+    memcpy(addresses, blockData + first * sizeof(uint32_t), count * sizeof(uint32_t));
+}
+
+static void writeAddresses32(uint8_t *blockData, size_t first, const uint32_t *addresses, size_t count) {
+    memcpy(blockData + first * sizeof(uint32_t), addresses, count * sizeof(uint32_t));
+}
+
+static uint32_t getInodeBlockNumber(uint16_t inodeNumber) {
+    // Subtract 1 since i-nodes are numbered from 1.
+    return (inodeNumber - 1U) / imageFormat.inodesPerBlock + 2;
+}
+
+static uint8_t *getInodeInBlock(uint8_t *blockData, uint16_t inodeNumber) {
+    return &blockData[((inodeNumber - 1U) % imageFormat.inodesPerBlock) * imageFormat.inodeSize];
+}
+
+/*
+ * The number of i-nodes the i-node table holds. I-node numbers are 16 bits wide in both formats.
+ */
+static uint32_t getNumInodes(Superblock *sb) {
+    uint32_t numInodes = (uint32_t) sb->isize * imageFormat.inodesPerBlock;
+
+    return numInodes > UINT16_MAX ? UINT16_MAX : numInodes;
+}
+
+static uint16_t inodeIsDirectory(Inode *inode) {
+    if (inode == NULL) {
+        return 0;
+    }
+
+    if ((inode->flags & FLAG_FILE_TYPE) == FILE_TYPE_DIRECTORY) {
+        return 1;
+    }
+
+    return 0;
+}
+
+static uint16_t inodeIsLargeFile(Inode *inode) {
+    if (inode == NULL) {
+        return 0;
+    }
+
+    if (inode->flags & FLAG_LARGE_FILE) {
+        return 1;
+    }
+
+    return 0;
+}
+
+static size_t getBlockAddress(uint32_t blockNumber) {
+    return (size_t) blockNumber << imageFormat.blockShift;
+}
+
+static uint32_t getFileSize(Inode *inode) {
+    return inode->size;
+}
+
+static void setFileSize(Inode *inode, uint32_t fileSize) {
+    inode->size = fileSize;
+}
+
+static char** tokenizeFilePath(char *filePath, size_t *numPathItems) {
+    // Every item but the last takes at least two characters, counting its slash.
+    char** filePathTokens = scratchAlloc(sizeof(char*) * (strlen(filePath) / 2 + 1));
+    size_t count = 0;
+    char* filename;
+
+    *numPathItems = 0;
+    if (filePathTokens == NULL) {
+        return NULL;
+    }
+
+    filename = strtok(filePath, "/");
+
+    while (filename != NULL) {
+        filePathTokens[count] = filename;
+        count++;
+
+        filename = strtok(NULL, "/");
+    }
+
+    *numPathItems = count;
+
+    return filePathTokens;
+}
+/*
+ * Writes the superblock's fields into block 1, changing the cached block in place. The changed
+ * blocks of a grouped image's block bitmap go with it, as the free list goes with the free array.
+ */
+static int8_t superblockWrite(Superblock *sb) {
+    uint8_t *superblockData;
+
+    if (sb->ngroups > 0 && blockBitmapWrite(sb) != 0) {
+        return E_BLOCK_WRITE_FAILURE;
+    }
+
+    superblockData = getCachedBlock(1);
+    if (superblockData == NULL) {
+        return E_BLOCK_READ_FAILURE;
+    }
+
+    imageFormat.superblockToDisk(sb, superblockData);
+
+    return v6_write_block(1, superblockData);
+}
+
+static int8_t superblockSave(Superblock *sb) {
+    // The copy on disk is always written clean.
+    sb->fmod = 0;
+
+    if (superblockWrite(sb) != 0) {
+        sb->fmod = 1;
+        return E_BLOCK_WRITE_FAILURE;
+    }
+
+    // Hand the write to the OS now so it survives the process dying before the next fseek.
+    if (fflush(v6FileSystem) != 0) {
+        return E_BLOCK_WRITE_FAILURE;
+    }
+
+    return 0;
+}
+
+/*
+ * Unlinks the file at filePath and queues its i-node for reclaim.
+ *
+ * A directory is only removed when it is empty, unless recursive is set, in which case the
+ * entire subtree goes with it. Either way only the parent's directory block is written here;
+ * the subtree is walked and freed in one batch when the reclaim queue is processed.
+ */
+static int8_t removeFile(Superblock *sb, char *filePath, uint8_t recursive) {
+    char **filePathTokens;
+    size_t numTokens = 0;
+    Inode *previousInode = inodeLoad(sb, 1);
+    Inode *inode;
+    uint16_t inodeNumber = 0, parentNumber = 1;
+    char *filename;
+    int8_t result;
+
+    filePathTokens = tokenizeFilePath(filePath, &numTokens);
+
+    if (numTokens == 0) {
+        // Refuse to remove the root directory.
+        return E_INVALID_PATH;
+    }
+
+    filename = filePathTokens[numTokens - 1];
+
+    if (strncmp(filename, ".", 14) == 0 || strncmp(filename, "..", 14) == 0) {
+        return E_INVALID_PATH;
+    }
+
+    for (size_t i = 0; i < numTokens - 1; i++) {
+        inodeNumber = findDirectoryEntry(previousInode, filePathTokens[i]);
+
+        if (inodeNumber == 0) {
+            return E_NO_SUCH_FILE;
+        }
+
+        previousInode = inodeLoad(sb, inodeNumber);
+        parentNumber = inodeNumber;
+    }
+
+    inodeNumber = findDirectoryEntry(previousInode, filename);
+
+    if (inodeNumber == 0) {
+        return E_NO_SUCH_FILE;
+    }
+
+    inode = inodeLoad(sb, inodeNumber);
+    result = 0;
+
+    if (recursive == 0 && inodeIsDirectory(inode) && directoryIsEmpty(inode) == 0) {
+        result = E_DIRECTORY_NOT_EMPTY;
+    }
+
+    if (result == 0) {
+        removeDirectoryEntry(previousInode, filename);
+        result = compactDirectory(sb, parentNumber, previousInode, DIRECTORY_COMPACT_PERCENT, NULL);
+    }
+
+    if (result != 0) {
+        return result;
+    }
+
+    // The blocks are freed later, in a batch with other removed files.
+    return queueInodeForReclaim(sb, inodeNumber);
+}
+
+/*
+ * Returns 1 if the directory holds nothing but "." and "..".
+ */
+static int8_t directoryIsEmpty(Inode *inode) {
+    uint32_t blockNumber = getNextAllocatedBlockNumber(inode);
+
+    while (blockNumber != 0) {
+        DiskDirectoryEntry *entries = (DiskDirectoryEntry *) getCachedBlock(blockNumber);
+
+        // A block that can't be read might hold anything, so don't call it empty.
+        if (entries == NULL) {
+            return 0;
+        }
+
+        for (size_t i = 0; i < imageFormat.entriesPerBlock; i++) {
+            if (entries[i].inodeNumber > 0 && strncmp(entries[i].name, ".", 14) != 0
+                && strncmp(entries[i].name, "..", 14) != 0) {
+                return 0;
+            }
+        }
+        blockNumber = getNextAllocatedBlockNumber(NULL);
+    }
+
+    return 1;
+}
+
+/*
+ * Queues an unlinked i-node so its blocks can be freed later in a batch.
+ *
+ * The i-node keeps its block map until it is reclaimed, and the queue is written with the
+ * superblock, so a crash before the batch runs only delays the reclaim until the next load.
+ */
+static int8_t queueInodeForReclaim(Superblock *sb, uint16_t inodeNumber) {
+    int8_t reclaimSuccess;
+
+    if (inodeNumber < 1 || inodeNumber > getNumInodes(sb)) {
+        return E_INVALID_INODE_NUMBER;
+    }
+
+    if (sb->nreclaim == MAX_PENDING_RECLAIM) {
+        reclaimSuccess = reclaimPendingInodes(sb);
+        if (reclaimSuccess != 0) {
+            return reclaimSuccess;
+        }
+    }
+
+    sb->reclaim[sb->nreclaim] = inodeNumber;
+    sb->nreclaim++;
+    sb->fmod = 1;
+
+    return superblockSave(sb);
+}
+
+/*
+ * Frees the blocks and i-nodes of every file in the reclaim queue. A queued directory takes its
+ * whole subtree with it.
+ *
+ * All block maps are read before anything is freed, since freeing a block may overwrite it with
+ * a free list chain. The superblock is written before the i-nodes are cleared: a crash before that
+ * write replays the whole batch on the next load, and a crash after it can only leak i-nodes.
+ */
+static int8_t reclaimPendingInodes(Superblock *sb) {
+    BlockList dataBlocks = { 0 };
+    BlockList metadataBlocks = { 0 };
+    BlockList reclaimedInodes = { 0 };
+    int8_t result = 0;
+
+    if (sb->nreclaim == 0) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < sb->nreclaim && result == 0; i++) {
+        result = collectReclaimableBlocks(sb, sb->reclaim[i], &dataBlocks, &metadataBlocks, &reclaimedInodes);
+    }
+
+    if (result == 0) {
+        result = freeBlockBatch(sb, &dataBlocks, &metadataBlocks);
+    }
+
+    if (result == 0) {
+        sb->nreclaim = 0;
+        result = superblockSave(sb);
+    }
+
+    // The batch can no longer be replayed, so the held back block maps are free to be overwritten.
+    if (result == 0) {
+        result = freeBlockList(sb, &metadataBlocks);
+    }
+
+    free(dataBlocks.blocks);
+    free(metadataBlocks.blocks);
+
+    if (result == 0) {
+        result = clearInodes(sb, reclaimedInodes.blocks, reclaimedInodes.count);
+    }
+
+    // Hand the cleared i-nodes straight back to the free i-node list where there is room,
+    // and to the free i-node map otherwise. A grouped image allocates from the map alone.
+    for (size_t i = 0; result == 0 && i < reclaimedInodes.count; i++) {
+        if (sb->ngroups == 0 && sb->ninode < 100) {
+            sb->inode[sb->ninode] = (uint16_t) reclaimedInodes.blocks[i];
+            sb->ninode++;
+            sb->fmod = 1;
+        } else {
+            freeInodeMapAdd((uint16_t) reclaimedInodes.blocks[i]);
+        }
+    }
+
+    free(reclaimedInodes.blocks);
+
+    // Freed blocks can be handed out again right away and written in place as file data, so the
+    // frees have to be committed before that can happen.
+    if (result == 0 && journalCapturing) {
+        result = journalCommit();
+    }
+
+    return result;
+}
+
+/*
+ * Gathers the blocks of an i-node, and for a directory everything below it, in a single pass over
+ * an explicit stack, so a deep tree can't run out of C stack. Each directory block is read once,
+ * and the i-nodes it names are loaded in i-node number order so that neighbouring i-nodes come out
+ * of the same i-node block.
+ *
+ * File contents go to dataBlocks. Indirect blocks and directory contents go to metadataBlocks.
+ * Every i-node visited, including inodeNumber itself, is added to inodeNumbers.
+ */
+static int8_t collectReclaimableBlocks(Superblock *sb, uint16_t inodeNumber, BlockList *dataBlocks,
+                                       BlockList *metadataBlocks, BlockList *inodeNumbers) {
+    BlockList stack = { 0 };
+    BlockList directoryBlocks = { 0 };
+    BlockList children = { 0 };
+    int8_t result;
+
+    result = blockListAppend(&stack, inodeNumber);
+
+    while (stack.count > 0 && result == 0) {
+        uint16_t visitNumber = (uint16_t) stack.blocks[--stack.count];
+        Inode *inode = inodeLoad(sb, visitNumber);
+
+        if (inode == NULL) {
+            result = E_INVALID_INODE_NUMBER;
+            break;
+        }
+
+        result = blockListAppend(inodeNumbers, visitNumber);
+
+        if (result != 0 || inodeIsDirectory(inode) == 0) {
+            if (result == 0) {
+                result = collectInodeBlocks(inode, dataBlocks, metadataBlocks);
+            }
+            continue;
+        }
+
+        directoryBlocks.count = 0;
+        children.count = 0;
+        result = collectInodeBlocks(inode, &directoryBlocks, metadataBlocks);
+
+        for (size_t i = 0; i < directoryBlocks.count && result == 0; i++) {
+            DiskDirectoryEntry *entries = (DiskDirectoryEntry *) getCachedBlock(directoryBlocks.blocks[i]);
+
+            if (entries == NULL) {
+                result = E_BLOCK_READ_FAILURE;
+                break;
+            }
+
+            for (size_t j = 0; j < imageFormat.entriesPerBlock && result == 0; j++) {
+                if (entries[j].inodeNumber == 0 || strncmp(entries[j].name, ".", 14) == 0
+                    || strncmp(entries[j].name, "..", 14) == 0) {
+                    continue;
+                }
+
+                result = blockListAppend(&children, entries[j].inodeNumber);
+            }
+
+            if (result == 0) {
+                result = blockListAppend(metadataBlocks, directoryBlocks.blocks[i]);
+            }
+        }
+
+        if (children.count > 1) {
+            qsort(children.blocks, children.count, sizeof(uint32_t), compareUint32);
+        }
+
+        // Pushed in reverse so they come back off the stack in i-node number order.
+        for (size_t i = children.count; i > 0 && result == 0; i--) {
+            result = blockListAppend(&stack, children.blocks[i - 1]);
+        }
+    }
+
+    free(stack.blocks);
+    free(directoryBlocks.blocks);
+    free(children.blocks);
+
+    return result;
+}
+
+/*
+ * Gathers every block owned by the i-node, reading each indirect block exactly once.
+ *
+ * Blocks holding the file's contents are added to contentBlocks and the indirect blocks that map
+ * them are added to indirectBlocks, each after the blocks below it.
+ */
+static int8_t collectInodeBlocks(Inode *inode, BlockList *contentBlocks, BlockList *indirectBlocks) {
+    int8_t result = 0;
+
+    if (inodeIsLargeFile(inode) == 0) {
+        for (size_t i = 0; i < 8 && result == 0; i++) {
+            if (inode->addr[i] != 0) {
+                result = blockListAppend(contentBlocks, inode->addr[i]);
+            }
+        }
+        return result;
+    }
+
+    for (size_t addrIndex = 0; addrIndex < 8 && result == 0; addrIndex++) {
+        if (inode->addr[addrIndex] != 0) {
+            result = collectIndirectBlocks(inode->addr[addrIndex], imageFormat.addressLevels[addrIndex],
+                                           contentBlocks, indirectBlocks);
+        }
+    }
+
+    return result;
+}
+
+/*
+ * Gathers the blocks below an indirect block that is level levels above the file's contents, then
+ * the indirect block itself.
+ */
+static int8_t collectIndirectBlocks(uint32_t blockNumber, uint8_t level, BlockList *contentBlocks,
+                                    BlockList *indirectBlocks) {
+    uint8_t blockData[MAX_BLOCK_SIZE];
+    uint32_t addresses[MAX_ADDRESSES_PER_BLOCK];
+    int8_t result = 0;
+
+    if (v6_read_block(blockNumber, blockData) != 0) {
+        return E_BLOCK_READ_FAILURE;
+    }
+    imageFormat.readAddresses(blockData, 0, addresses, imageFormat.addressesPerBlock);
+
+    for (size_t i = 0; i < imageFormat.addressesPerBlock && result == 0; i++) {
+        if (addresses[i] == 0) {
+            continue;
+        }
+        if (level > 1) {
+            result = collectIndirectBlocks(addresses[i], level - 1, contentBlocks, indirectBlocks);
+        } else {
+            result = blockListAppend(contentBlocks, addresses[i]);
+        }
+    }
+
+    if (result == 0) {
+        result = blockListAppend(indirectBlocks, blockNumber);
+    }
+
+    return result;
+}
+
+/*
+ * Returns a batch of blocks to the free list.
+ *
+ * Metadata blocks only ever go into an empty slot of the superblock free array. Free list chain
+ * blocks are written over the block being freed, so this keeps the chain on file contents and
+ * leaves the block maps intact for a replay if we crash before the superblock is written. When the
+ * array is full and only metadata blocks are left, they are held back in metadataBlocks, and the
+ * caller frees them with freeBlockList once the superblock no longer needs them for a replay.
+ */
+static int8_t freeBlockBatch(Superblock *sb, BlockList *dataBlocks, BlockList *metadataBlocks) {
+    size_t dataIndex = 0, metadataIndex = 0, heldCount = 0;
+    uint32_t blockNumber;
+    int8_t freeSuccess;
+
+    while (dataIndex < dataBlocks->count || metadataIndex < metadataBlocks->count) {
+        if (metadataIndex < metadataBlocks->count
+            && (sb->nfree < imageFormat.freeArraySize || sb->ngroups > 0)) {
+            blockNumber = metadataBlocks->blocks[metadataIndex++];
+        } else if (dataIndex < dataBlocks->count) {
+            blockNumber = dataBlocks->blocks[dataIndex++];
+        } else {
+            metadataBlocks->blocks[heldCount++] = metadataBlocks->blocks[metadataIndex++];
+            continue;
+        }
+
+        freeSuccess = v6_free(sb, blockNumber);
+        if (freeSuccess != 0) {
+            return freeSuccess;
+        }
+    }
+
+    metadataBlocks->count = heldCount;
+
+    return 0;
+}
+
+/*
+ * Returns every block in the list to the free list, in order.
+ */
+static int8_t freeBlockList(Superblock *sb, BlockList *blocks) {
+    int8_t freeSuccess;
+
+    for (size_t i = 0; i < blocks->count; i++) {
+        freeSuccess = v6_free(sb, blocks->blocks[i]);
+        if (freeSuccess != 0) {
+            return freeSuccess;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Clears the given i-nodes, rewriting each i-node block once no matter how many of them it holds.
+ * Sorts inodeNumbers in place.
+ */
+static int8_t clearInodes(Superblock *sb, uint32_t *inodeNumbers, size_t numInodes) {
+    size_t i = 0;
+
+    if (numInodes > 1) {
+        qsort(inodeNumbers, numInodes, sizeof(uint32_t), compareUint32);
+    }
+
+    while (i < numInodes) {
+        uint32_t inodeBlockNumber;
+
+        if (inodeNumbers[i] < 1 || inodeNumbers[i] > getNumInodes(sb)) {
+            return E_INVALID_INODE_NUMBER;
+        }
+        inodeBlockNumber = getInodeBlockNumber((uint16_t) inodeNumbers[i]);
+
+        // Cleared in place in the cached block.
+        uint8_t *inodes = getCachedBlock(inodeBlockNumber);
+
+        if (inodes == NULL) {
+            return E_BLOCK_READ_FAILURE;
+        }
+
+        while (i < numInodes && getInodeBlockNumber((uint16_t) inodeNumbers[i]) == inodeBlockNumber) {
+            uint8_t *diskInode = getInodeInBlock(inodes, (uint16_t) inodeNumbers[i]);
+            // The flags come first in both formats.
+            uint16_t flags;
+
+            memcpy(&flags, diskInode, sizeof(flags));
+            if (allocationGroupCount > 0 && (flags & FLAG_INODE_ALLOCATED) != 0
+                && (flags & FLAG_FILE_TYPE) == FILE_TYPE_DIRECTORY) {
+                allocationGroups[getInodeGroup((uint16_t) inodeNumbers[i])].directories--;
+            }
+            memset(diskInode, 0, imageFormat.inodeSize);
+            for (V6File *file = openFiles; file != NULL; file = file->nextOpen) {
+                if (file->inodeNumber == inodeNumbers[i]) {
+                    file->inodeNumber = 0;
+                }
+            }
+            i++;
+        }
+
+        if (v6_write_block(inodeBlockNumber, inodes) != 0) {
+            return E_BLOCK_WRITE_FAILURE;
+        }
+    }
+
+    return 0;
+}
+
+static int8_t blockListAppend(BlockList *list, uint32_t blockNumber) {
+    if (list->count == list->capacity) {
+        size_t newCapacity = list->capacity == 0 ? 256 : list->capacity * 2;
+        uint32_t *newBlocks = realloc(list->blocks, newCapacity * sizeof(uint32_t));
+
+        if (newBlocks == NULL) {
+            return E_ALLOCATE_FAILURE;
+        }
+
+        list->blocks = newBlocks;
+        list->capacity = newCapacity;
+    }
+
+    list->blocks[list->count] = blockNumber;
+    list->count++;
+
+    return 0;
+}
+
+/*
+ * Fills in the i-node of every entry in the batch. Entries are visited in i-node number order,
+ * so each i-node block is read once no matter how many of the entries live in it.
+ */
+static int8_t loadEntryAttributes(Superblock *sb, V6DirectoryEntry *entries, size_t numEntries) {
+    // Sort (inode number, entry index) pairs packed into one word, so the sort is a plain integer sort.
+    uint32_t *order = malloc(sizeof(uint32_t) * numEntries);
+    uint8_t *blockData = NULL;
+    uint32_t loadedBlockNumber = 0;
+
+    if (order == NULL) {
+        return E_ALLOCATE_FAILURE;
+    }
+
+    for (size_t i = 0; i < numEntries; i++) {
+        order[i] = ((uint32_t) entries[i].inodeNumber << 16) | (uint32_t) i;
+    }
+
+    qsort(order, numEntries, sizeof(uint32_t), compareUint32);
+
+    for (size_t i = 0; i < numEntries; i++) {
+        V6DirectoryEntry *entry = &entries[order[i] & 0xFFFF];
+        uint32_t inodeBlockNumber = getInodeBlockNumber(entry->inodeNumber);
+
+        if (entry->inodeNumber > getNumInodes(sb)) {
+            free(order);
+            return E_INVALID_INODE_NUMBER;
+        }
+
+        if (blockData == NULL || inodeBlockNumber != loadedBlockNumber) {
+            blockData = getCachedBlock(inodeBlockNumber);
+            loadedBlockNumber = inodeBlockNumber;
+
+            if (blockData == NULL) {
+                free(order);
+                return E_BLOCK_READ_FAILURE;
+            }
+        }
+
+        imageFormat.inodeFromDisk(getInodeInBlock(blockData, entry->inodeNumber), &entry->inode);
+        entry->size = getFileSize(&entry->inode);
+    }
+
+    free(order);
+
+    return 0;
+}
+
+static int compareUint32(const void *a, const void *b) {
+    uint32_t first = *(const uint32_t *) a;
+    uint32_t second = *(const uint32_t *) b;
+
+    return (first > second) - (first < second);
+}
+
+static int compareUint64(const void *a, const void *b) {
+    uint64_t first = *(const uint64_t *) a;
+    uint64_t second = *(const uint64_t *) b;
+
+    return (first > second) - (first < second);
+}
+
+/*
+ * Reads a list of blocks into data, where block i of the list lands at data[i * block size].
+ * The blocks are read in ascending block number order, and runs of consecutive block numbers
+ * are read with a single request.
+ */
+static int8_t readBlocksInBlockOrder(BlockList *blocks, uint8_t *data) {
+    const size_t blockSize = imageFormat.blockSize;
+    // (block number, list index) pairs packed into one word, sorted by block number.
+    uint64_t *order = malloc(sizeof(uint64_t) * blocks->count);
+    uint8_t *runData = malloc(MAX_BLOCK_RUN * blockSize);
+    size_t i = 0;
+    int8_t result = 0;
+
+    if (order == NULL || runData == NULL) {
+        free(order);
+        free(runData);
+        return E_ALLOCATE_FAILURE;
+    }
+
+    for (size_t j = 0; j < blocks->count; j++) {
+        order[j] = ((uint64_t) blocks->blocks[j] << 32) | (uint64_t) j;
+    }
+
+    qsort(order, blocks->count, sizeof(uint64_t), compareUint64);
+
+    while (i < blocks->count && result == 0) {
+        uint32_t runStart = (uint32_t) (order[i] >> 32);
+        size_t runLength = 1;
+        size_t runEnd = i + 1;
+
+        // Extend the run over following blocks that are consecutive on disk. Repeats share a slot.
+        while (runEnd < blocks->count && runLength < MAX_BLOCK_RUN) {
+            uint32_t nextBlockNumber = (uint32_t) (order[runEnd] >> 32);
+
+            if (nextBlockNumber == runStart + runLength) {
+                runLength++;
+            } else if (nextBlockNumber != runStart + runLength - 1) {
+                break;
+            }
+            runEnd++;
+        }
+
+        result = deviceReadBlocks(runStart, runLength, runData);
+
+        for (; result == 0 && i < runEnd; i++) {
+            uint32_t blockNumber = (uint32_t) (order[i] >> 32);
+            memcpy(&data[(order[i] & 0xFFFFFFFF) * blockSize], &runData[(size_t) (blockNumber - runStart) * blockSize],
+                   blockSize);
+        }
+    }
+
+    free(order);
+    free(runData);
+
+    return result;
+}
+
+/*
+ * Reads count consecutive blocks starting at blockNumber with a single request, bypassing the
+ * block cache. The cache is write-through, so disk always holds the latest data.
+ */
+static int8_t deviceReadBlocks(uint32_t blockNumber, size_t count, void *data) {
+    if (fseek(v6FileSystem, getBlockAddress(blockNumber), SEEK_SET) != 0) {
+        return E_SEEK_FAILURE;
+    }
+
+    if (fread(data, imageFormat.blockSize, count, v6FileSystem) < count
+        || overlayReadBase(overlayPresent, overlayBaseFd, blockNumber, count, data) != 0) {
+        return E_BLOCK_READ_FAILURE;
+    }
+
+    // A journaled block hasn't been written in place yet.
+    for (size_t i = 0; i < count; i++) {
+        uint8_t *journalData = journalLookup((uint32_t) (blockNumber + i));
+
+        if (journalData != NULL) {
+            memcpy((uint8_t *) data + (size_t) i * imageFormat.blockSize, journalData, imageFormat.blockSize);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Reads the block number at every index of a file into blockMap, which must hold numBlocks
+ * entries. Holes are returned as 0. Each indirect block is read once.
+ */
+static int8_t readBlockMap(Inode *inode, uint32_t *blockMap, size_t numBlocks) {
+    size_t offset = 0;
+    int8_t result = 0;
+
+    memset(blockMap, 0, numBlocks * sizeof(uint32_t));
+
+    if (inodeIsLargeFile(inode) == 0) {
+        for (size_t i = 0; i < numBlocks && i < 8; i++) {
+            blockMap[i] = inode->addr[i];
+        }
+        return 0;
+    }
+
+    for (size_t i = 0; i < 8 && offset < numBlocks && result == 0; i++) {
+        size_t count = numBlocks - offset < imageFormat.addressSpans[i] ? numBlocks - offset
+                                                                        : imageFormat.addressSpans[i];
+
+        if (inode->addr[i] != 0) {
+            result = readIndirectBlockMap(inode->addr[i], imageFormat.addressLevels[i], &blockMap[offset], count);
+        }
+        offset += imageFormat.addressSpans[i];
+    }
+
+    return result;
+}
+
+/*
+ * Reads the numBlocks block numbers mapped below an indirect block that is level levels above
+ * the file's contents.
+ */
+static int8_t readIndirectBlockMap(uint32_t blockNumber, uint8_t level, uint32_t *blockMap, size_t numBlocks) {
+    uint32_t addresses[MAX_ADDRESSES_PER_BLOCK];
+    size_t span = 1;
+    uint8_t *blockData = getCachedBlock(blockNumber);
+
+    if (blockData == NULL) {
+        return E_BLOCK_READ_FAILURE;
+    }
+
+    if (level == 1) {
+        imageFormat.readAddresses(blockData, 0, blockMap, numBlocks);
+        return 0;
+    }
+
+    // Copied out, since reading the blocks below replaces the cached block.
+    imageFormat.readAddresses(blockData, 0, addresses, imageFormat.addressesPerBlock);
+    for (uint8_t i = 1; i < level; i++) {
+        span *= imageFormat.addressesPerBlock;
+    }
+
+    for (size_t i = 0; i * span < numBlocks; i++) {
+        size_t count = numBlocks - i * span < span ? numBlocks - i * span : span;
+
+        if (addresses[i] != 0 && readIndirectBlockMap(addresses[i], level - 1, &blockMap[i * span], count) != 0) {
+            return E_BLOCK_READ_FAILURE;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Returns the number of indirect blocks writeBlockMap needs for this map. An indirect block whose
+ * whole range is holes isn't needed.
+ */
+static size_t countIndirectBlocks(uint32_t *blockMap, size_t numBlocks) {
+    size_t numIndirectBlocks = 0;
+    size_t offset = 0;
+
+    if (numBlocks <= 8) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < 8 && offset < numBlocks; i++) {
+        size_t count = numBlocks - offset < imageFormat.addressSpans[i] ? numBlocks - offset
+                                                                        : imageFormat.addressSpans[i];
+
+        numIndirectBlocks += countIndirectBlocksBelow(&blockMap[offset], count, imageFormat.addressLevels[i]);
+        offset += imageFormat.addressSpans[i];
+    }
+
+    return numIndirectBlocks;
+}
+
+static size_t countIndirectBlocksBelow(uint32_t *blockMap, size_t numBlocks, uint8_t level) {
+    size_t numIndirectBlocks = 1;
+    size_t span = 1;
+
+    if (blockMapRangeIsEmpty(blockMap, numBlocks)) {
+        return 0;
+    }
+    if (level == 1) {
+        return 1;
+    }
+
+    for (uint8_t i = 1; i < level; i++) {
+        span *= imageFormat.addressesPerBlock;
+    }
+    for (size_t i = 0; i < numBlocks; i += span) {
+        numIndirectBlocks += countIndirectBlocksBelow(&blockMap[i], numBlocks - i < span ? numBlocks - i : span,
+                                                      level - 1);
+    }
+
+    return numIndirectBlocks;
+}
+
+static uint8_t blockMapRangeIsEmpty(uint32_t *blockMap, size_t numBlocks) {
+    for (size_t i = 0; i < numBlocks; i++) {
+        if (blockMap[i] != 0) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * Replaces the block map of an empty i-node with blockMap in one go. Each indirect block is
+ * filled in memory and written exactly once. indirectBlocks must hold the
+ * countIndirectBlocks(blockMap, numBlocks) blocks that have been allocated for the map.
+ * The file size is left to the caller.
+ */
+static int8_t writeBlockMap(Inode *inode, uint32_t *blockMap, size_t numBlocks, uint32_t *indirectBlocks) {
+    size_t nextIndirectBlock = 0;
+    size_t offset = 0;
+    int8_t writeSuccess = 0;
+
+    for (size_t i = 0; i < 8; i++) {
+        inode->addr[i] = 0;
+    }
+
+    if (numBlocks <= 8) {
+        inode->flags &= ~FLAG_LARGE_FILE;
+        memcpy(inode->addr, blockMap, numBlocks * sizeof(uint32_t));
+        return 0;
+    }
+
+    inode->flags |= FLAG_LARGE_FILE;
+
+    for (size_t i = 0; i < 8 && offset < numBlocks && writeSuccess == 0; i++) {
+        size_t count = numBlocks - offset < imageFormat.addressSpans[i] ? numBlocks - offset
+                                                                        : imageFormat.addressSpans[i];
+
+        writeSuccess = writeIndirectBlockMap(&blockMap[offset], count, imageFormat.addressLevels[i],
+                                             indirectBlocks, &nextIndirectBlock, &inode->addr[i]);
+        offset += imageFormat.addressSpans[i];
+    }
+
+    return writeSuccess;
+}
+
+/*
+ * Writes the indirect block that maps numBlocks entries of blockMap from level levels up, after the
+ * blocks below it, taking each from indirectBlocks. Sets blockNumber to the indirect block, or to
+ * 0 if the range is all holes.
+ */
+static int8_t writeIndirectBlockMap(uint32_t *blockMap, size_t numBlocks, uint8_t level, uint32_t *indirectBlocks,
+                                    size_t *nextIndirectBlock, uint32_t *blockNumber) {
+    uint8_t blockData[MAX_BLOCK_SIZE] = { 0 };
+    uint32_t addresses[MAX_ADDRESSES_PER_BLOCK] = { 0 };
+    size_t span = 1;
+    int8_t writeSuccess;
+
+    *blockNumber = 0;
+    if (blockMapRangeIsEmpty(blockMap, numBlocks)) {
+        return 0;
+    }
+
+    if (level == 1) {
+        memcpy(addresses, blockMap, numBlocks * sizeof(uint32_t));
+    } else {
+        for (uint8_t i = 1; i < level; i++) {
+            span *= imageFormat.addressesPerBlock;
+        }
+        for (size_t i = 0; i * span < numBlocks; i++) {
+            size_t count = numBlocks - i * span < span ? numBlocks - i * span : span;
+
+            writeSuccess = writeIndirectBlockMap(&blockMap[i * span], count, level - 1, indirectBlocks,
+                                                 nextIndirectBlock, &addresses[i]);
+            if (writeSuccess != 0) {
+                return writeSuccess;
+            }
+        }
+    }
+
+    imageFormat.writeAddresses(blockData, 0, addresses, imageFormat.addressesPerBlock);
+    writeSuccess = v6_write_block(indirectBlocks[*nextIndirectBlock], blockData);
+    if (writeSuccess != 0) {
+        return writeSuccess;
+    }
+    *blockNumber = indirectBlocks[*nextIndirectBlock];
+    (*nextIndirectBlock)++;
+
+    return 0;
+}
+
+/*
+ * Copies the data of every mapped index from its source block to its destination block. Runs
+ * that are consecutive in both maps are copied with one request, using copy_file_range where
+ * the kernel supports it and a single read and write otherwise.
+ */
+static int8_t copyBlockRuns(uint32_t *sourceMap, uint32_t *destinationMap, size_t numBlocks) {
+    uint8_t *runData = NULL;
+    size_t i = 0;
+    int8_t result = 0;
+
+    while (i < numBlocks && result == 0) {
+        size_t runLength = 1;
+
+        if (sourceMap[i] == 0) {
+            i++;
+            continue;
+        }
+
+        // A block that is still in the journal is copied through the journal, since its copy on
+        // disk is out of date or will be written over at the checkpoint.
+        if (journalCapturing && (journalLookup(sourceMap[i]) != NULL || journalLookup(destinationMap[i]) != NULL)) {
+            if (runData == NULL) {
+                runData = malloc(MAX_BLOCK_RUN * imageFormat.blockSize);
+            }
+            if (runData == NULL) {
+                result = E_ALLOCATE_FAILURE;
+                break;
+            }
+            result = deviceReadBlock(sourceMap[i], runData);
+            if (result == 0) {
+                result = writeDataBlock(destinationMap[i], runData);
+            }
+            i++;
+            continue;
+        }
+
+        while (i + runLength < numBlocks && runLength < MAX_BLOCK_RUN
+               && sourceMap[i + runLength] == sourceMap[i] + runLength
+               && destinationMap[i + runLength] == destinationMap[i] + runLength
+               && (journalCapturing == 0 || (journalLookup(sourceMap[i + runLength]) == NULL
+                                             && journalLookup(destinationMap[i + runLength]) == NULL))) {
+            runLength++;
+        }
+
+        // The destination blocks are written behind the cache's back.
+        for (size_t j = 0; j < runLength; j++) {
+            journalPrepareDataWrite(destinationMap[i + j]);
+            blockCacheInvalidate(destinationMap[i + j]);
+        }
+
+        if (copyBlocksInKernel(sourceMap[i], destinationMap[i], runLength) != 0) {
+            if (runData == NULL) {
+                runData = malloc(MAX_BLOCK_RUN * imageFormat.blockSize);
+            }
+            if (runData == NULL) {
+                result = E_ALLOCATE_FAILURE;
+                break;
+            }
+            result = deviceReadBlocks(sourceMap[i], runLength, runData);
+            if (result == 0) {
+                result = deviceWriteBlocks(destinationMap[i], runLength, runData);
+            }
+        }
+
+        i += runLength;
+    }
+
+    free(runData);
+
+    return result;
+}
+
+/*
+ * Asks the kernel to copy count blocks within the image file without moving them through user
+ * space. Returns nonzero if that isn't possible here, in which case nothing needs undoing.
+ */
+static int8_t copyBlocksInKernel(uint32_t sourceBlockNumber, uint32_t destinationBlockNumber, size_t count) {
+#if defined(__linux__)
+    int fd = fileno(v6FileSystem);
+    loff_t sourceOffset = (loff_t) getBlockAddress(sourceBlockNumber);
+    loff_t destinationOffset = (loff_t) getBlockAddress(destinationBlockNumber);
+    size_t remaining = count * imageFormat.blockSize;
+
+    // In a clone the source may only be in the base, and the copies would need marking anyway.
+    if (overlayBaseFd >= 0) {
+        return -1;
+    }
+
+    // Anything still sitting in the stdio buffer has to reach the file first.
+    if (fflush(v6FileSystem) != 0 || changesNoteWrite(destinationBlockNumber, count) != 0) {
+        return -1;
+    }
+
+    while (remaining > 0) {
+        ssize_t copied = copy_file_range(fd, &sourceOffset, fd, &destinationOffset, remaining, 0);
+
+        if (copied <= 0) {
+            // The caller copies the whole run again the slow way, so a partial copy is harmless.
+            return -1;
+        }
+        remaining -= (size_t) copied;
+    }
+
+    // Drop anything stdio buffered from before the copy.
+    if (fflush(v6FileSystem) != 0) {
+        return -1;
+    }
+
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/*
+ * Writes count consecutive blocks starting at blockNumber with a single request, bypassing the
+ * block cache. Callers must invalidate any cached copies of the blocks.
+ */
+static int8_t deviceWriteBlocks(uint32_t blockNumber, size_t count, void *data) {
+    int8_t result;
+
+    if (overlayBaseFd >= 0 && blockNumber + count > overlayNumBlocks) {
+        return E_INVALID_BLOCK_NUMBER;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        warmupNoteWrite((uint32_t) (blockNumber + i));
+    }
+    result = changesNoteWrite(blockNumber, count);
+    if (result != 0) {
+        return result;
+    }
+
+    if (fseek(v6FileSystem, getBlockAddress(blockNumber), SEEK_SET) != 0) {
+        return E_SEEK_FAILURE;
+    }
+
+    if (fwrite(data, imageFormat.blockSize, count, v6FileSystem) < count) {
+        return E_BLOCK_WRITE_FAILURE;
+    }
+
+    return overlayMarkBlocks(blockNumber, count);
+}
+
+/*
+ * Scans every file for fragmentation, then moves the fragmented ones from defragNextInode on
+ * until the block budget runs out. See v6_defrag.
+ */
+static int8_t defragImage(Superblock *sb, uint32_t maxBlocks, uint32_t pauseMs, V6DefragCallback callback,
+                          void *userData, V6DefragReport *report) {
+    DefragCandidate *candidates = NULL;
+    size_t numCandidates = 0, candidatesCapacity = 0;
+    uint32_t *blockMap = NULL;
+    size_t blockMapCapacity = 0;
+    uint64_t *freeMap;
+    uint64_t totalSteps = 0, totalBreaks = 0;
+    uint32_t numInodes = getNumInodes(sb);
+    size_t next;
+    int8_t result = 0;
+
+    memset(report, 0, sizeof(*report));
+
+    // Blocks of removed files still waiting in the queue would look like they belong to no one.
+    if (sb->nreclaim > 0) {
+        result = reclaimPendingInodes(sb);
+        if (result != 0) {
+            return result;
+        }
+    }
+
+    freeMap = calloc(sb->fsize / 64 + 1, sizeof(uint64_t));
+    if (freeMap == NULL) {
+        return E_ALLOCATE_FAILURE;
+    }
+    result = freeMapBuild(sb, freeMap);
+
+    // Score every file, so the report covers the whole image however far the moves get.
+    for (uint32_t inodeNumber = 1; inodeNumber <= numInodes && result == 0; inodeNumber++) {
+        uint8_t *inodeBlock = getCachedBlock(getInodeBlockNumber((uint16_t) inodeNumber));
+        Inode inode;
+        size_t numBlocks;
+        uint32_t numDataBlocks, numBreaks;
+
+        if (inodeBlock == NULL) {
+            result = E_BLOCK_READ_FAILURE;
+            break;
+        }
+        imageFormat.inodeFromDisk(getInodeInBlock(inodeBlock, (uint16_t) inodeNumber), &inode);
+
+        numBlocks = (getFileSize(&inode) + imageFormat.blockSize - 1) / imageFormat.blockSize;
+        if ((inode.flags & FLAG_INODE_ALLOCATED) == 0 || numBlocks == 0) {
+            continue;
+        }
+
+        if (numBlocks > blockMapCapacity) {
+            uint32_t *newBlockMap = realloc(blockMap, numBlocks * sizeof(uint32_t));
+
+            if (newBlockMap == NULL) {
+                result = E_ALLOCATE_FAILURE;
+                break;
+            }
+            blockMap = newBlockMap;
+            blockMapCapacity = numBlocks;
+        }
+
+        result = readBlockMap(&inode, blockMap, numBlocks);
+        if (result != 0) {
+            break;
+        }
+
+        report->filesScanned++;
+        numBreaks = countBlockMapBreaks(blockMap, numBlocks, &numDataBlocks);
+        if (numDataBlocks > 1) {
+            totalSteps += numDataBlocks - 1;
+            totalBreaks += numBreaks;
+        }
+        if (numBreaks == 0) {
+            continue;
+        }
+
+        if (numCandidates == candidatesCapacity) {
+            size_t newCapacity = candidatesCapacity == 0 ? 64 : candidatesCapacity * 2;
+            DefragCandidate *newCandidates = realloc(candidates, newCapacity * sizeof(DefragCandidate));
+
+            if (newCandidates == NULL) {
+                result = E_ALLOCATE_FAILURE;
+                break;
+            }
+            candidates = newCandidates;
+            candidatesCapacity = newCapacity;
+        }
+        candidates[numCandidates].inodeNumber = (uint16_t) inodeNumber;
+        candidates[numCandidates].numDataBlocks = numDataBlocks;
+        candidates[numCandidates].numBreaks = numBreaks;
+        candidates[numCandidates].numBlocksNeeded = numDataBlocks + (uint32_t) countIndirectBlocks(blockMap, numBlocks);
+        numCandidates++;
+    }
+
+    free(blockMap);
+
+    report->filesFragmented = (uint32_t) numCandidates;
+    report->scoreBefore = totalSteps > 0 ? 100.0 * (double) totalBreaks / (double) totalSteps : 0.0;
+
+    next = 0;
+    while (next < numCandidates && candidates[next].inodeNumber < defragNextInode) {
+        next++;
+    }
+
+    for (; next < numCandidates && result == 0; next++) {
+        DefragCandidate *candidate = &candidates[next];
+        V6DefragFile file = { 0 };
+        uint32_t runStart, numBreaks = candidate->numBreaks;
+
+        if (maxBlocks != 0 && report->blocksMoved > 0 && report->blocksMoved + candidate->numBlocksNeeded > maxBlocks) {
+            break;
+        }
+
+        if (pauseMs > 0 && report->filesMoved > 0) {
+            struct timespec pause = { pauseMs / 1000, (long) (pauseMs % 1000) * 1000000L };
+
+            nanosleep(&pause, NULL);
+        }
+
+        // On a grouped image, a file is moved within its own group where there is room.
+        // An open listing would go on reading the old blocks once they are freed.
+        runStart = directoryIsOpen(candidate->inodeNumber) ? 0
+                   : freeMapFindRun(sb, freeMap, candidate->numBlocksNeeded,
+                                    allocationGroupCount > 0
+                                    ? allocationGroups[getInodeGroup(candidate->inodeNumber)].firstBlock
+                                    : getFirstDataBlock(sb));
+        if (runStart != 0) {
+            result = defragMoveFile(sb, candidate->inodeNumber, runStart, freeMap, &numBreaks);
+            if (result != 0) {
+                break;
+            }
+            totalBreaks -= candidate->numBreaks - numBreaks;
+            report->filesMoved++;
+            report->blocksMoved += candidate->numBlocksNeeded;
+            file.moved = 1;
+        }
+
+        if (callback != NULL) {
+            file.inodeNumber = candidate->inodeNumber;
+            file.numBlocks = candidate->numDataBlocks;
+            file.scoreBefore = 100.0 * candidate->numBreaks / (candidate->numDataBlocks - 1);
+            file.scoreAfter = 100.0 * numBreaks / (candidate->numDataBlocks - 1);
+            callback(&file, userData);
+        }
+    }
+
+    if (result == 0) {
+        report->finished = next == numCandidates;
+        defragNextInode = report->finished ? 1 : candidates[next].inodeNumber;
+    }
+    report->nextInode = defragNextInode;
+    report->scoreAfter = totalSteps > 0 ? 100.0 * (double) totalBreaks / (double) totalSteps : 0.0;
+
+    // Even after a failure, whatever did move has to be reflected in the free list.
+    if (report->filesMoved > 0) {
+        int8_t rebuildResult = freeListRebuild(sb, freeMap);
+
+        if (result == 0) {
+            result = rebuildResult;
+        }
+
+        // The old blocks can be handed out again right away and written in place as file data,
+        // so the moves have to be committed before that can happen.
+        if (result == 0 && journalCapturing) {
+            result = journalCommit();
+        }
+    }
+
+    free(candidates);
+    free(freeMap);
+
+    return result;
+}
+
+/*
+ * Moves a file into the free run of blocks starting at runStart: its indirect blocks first, then
+ * its data blocks in file order. The data is copied and the new indirect blocks written before
+ * the i-node is switched over, so the old blocks are only given up once nothing refers to them.
+ * freeMap is updated to match, and numBreaks set to the breaks left in the new layout.
+ */
+static int8_t defragMoveFile(Superblock *sb, uint16_t inodeNumber, uint32_t runStart, uint64_t *freeMap,
+                             uint32_t *numBreaks) {
+    BlockList contentBlocks = { 0 }, indirectBlocks = { 0 };
+    uint32_t *sourceMap, *destinationMap, *newIndirectBlocks = NULL;
+    size_t numBlocks, numIndirectBlocks = 0, runLength = 0;
+    uint32_t numDataBlocks;
+    Inode *inode = inodeLoad(sb, inodeNumber);
+    int8_t result;
+
+    if (inode == NULL) {
+        return E_BLOCK_READ_FAILURE;
+    }
+
+    numBlocks = (getFileSize(inode) + imageFormat.blockSize - 1) / imageFormat.blockSize;
+    sourceMap = calloc(numBlocks + 1, sizeof(uint32_t));
+    destinationMap = calloc(numBlocks + 1, sizeof(uint32_t));
+    if (sourceMap == NULL || destinationMap == NULL) {
+        free(sourceMap);
+        free(destinationMap);
+        return E_ALLOCATE_FAILURE;
+    }
+
+    result = readBlockMap(inode, sourceMap, numBlocks);
+    if (result == 0) {
+        result = collectInodeBlocks(inode, &contentBlocks, &indirectBlocks);
+    }
+
+    if (result == 0) {
+        numIndirectBlocks = countIndirectBlocks(sourceMap, numBlocks);
+        newIndirectBlocks = calloc(numIndirectBlocks + 1, sizeof(uint32_t));
+        if (newIndirectBlocks == NULL) {
+            result = E_ALLOCATE_FAILURE;
+        }
+    }
+
+    if (result == 0) {
+        uint32_t nextBlock = runStart;
+
+        for (size_t i = 0; i < numIndirectBlocks; i++) {
+            newIndirectBlocks[i] = nextBlock++;
+        }
+        for (size_t i = 0; i < numBlocks; i++) {
+            if (sourceMap[i] != 0) {
+                destinationMap[i] = nextBlock++;
+            }
+        }
+        runLength = nextBlock - runStart;
+
+        result = copyBlockRuns(sourceMap, destinationMap, numBlocks);
+    }
+
+    if (result == 0) {
+        result = writeBlockMap(inode, destinationMap, numBlocks, newIndirectBlocks);
+    }
+
+    if (result == 0) {
+        result = inodeSave(sb, inodeNumber, inode);
+    }
+
+    if (result == 0) {
+        for (size_t i = 0; i < runLength; i++) {
+            freeMap[(runStart + i) / 64] &= ~(1ULL << ((runStart + i) % 64));
+        }
+        for (size_t i = 0; i < contentBlocks.count; i++) {
+            freeMap[contentBlocks.blocks[i] / 64] |= 1ULL << (contentBlocks.blocks[i] % 64);
+        }
+        for (size_t i = 0; i < indirectBlocks.count; i++) {
+            freeMap[indirectBlocks.blocks[i] / 64] |= 1ULL << (indirectBlocks.blocks[i] % 64);
+        }
+        *numBreaks = countBlockMapBreaks(destinationMap, numBlocks, &numDataBlocks);
+    }
+
+    free(sourceMap);
+    free(destinationMap);
+    free(newIndirectBlocks);
+    free(contentBlocks.blocks);
+    free(indirectBlocks.blocks);
+
+    return result;
+}
+
+/*
+ * Returns how many times a file's data blocks, taken in file order, don't follow on from the one
+ * before, and sets numDataBlocks to the number of data blocks. Holes are skipped over.
+ */
+static uint32_t countBlockMapBreaks(const uint32_t *blockMap, size_t numBlocks, uint32_t *numDataBlocks) {
+    uint32_t numBreaks = 0;
+    uint32_t previous = 0;
+
+    *numDataBlocks = 0;
+    for (size_t i = 0; i < numBlocks; i++) {
+        if (blockMap[i] == 0) {
+            continue;
+        }
+        if (*numDataBlocks > 0 && blockMap[i] != previous + 1) {
+            numBreaks++;
+        }
+        previous = blockMap[i];
+        (*numDataBlocks)++;
+    }
+
+    return numBreaks;
+}
+
+/*
+ * Sets the bit of every block on the free list in freeMap, which must have room for sb->fsize
+ * bits. With the journal on, each chain block is journaled as it is read: the committed
+ * superblock still leads to it, so anything written over it before the next commit has to go
+ * through the journal. A grouped image's block bitmap is copied as it is.
+ */
+static int8_t freeMapBuild(Superblock *sb, uint64_t *freeMap) {
+    uint8_t blockData[MAX_BLOCK_SIZE];
+    uint32_t addresses[MAX_ADDRESSES_PER_BLOCK];
+    uint32_t count = sb->nfree;
+    uint32_t firstDataBlock = getFirstDataBlock(sb);
+
+    if (sb->ngroups > 0) {
+        memcpy(freeMap, blockBitmap, ((size_t) sb->fsize + 63) / 64 * sizeof(uint64_t));
+        return 0;
+    }
+
+    memcpy(addresses, sb->free, count * sizeof(uint32_t));
+
+    while (count > 0) {
+        // Entry 0 links to the next chain block, or is 0 at the end of the list.
+        for (uint32_t i = 0; i < count; i++) {
+            if (addresses[i] == 0 && i == 0) {
+                continue;
+            }
+            if (addresses[i] < firstDataBlock || addresses[i] >= sb->fsize
+                || (freeMap[addresses[i] / 64] >> (addresses[i] % 64)) & 1U) {
+                return E_INVALID_BLOCK_NUMBER;
+            }
+            freeMap[addresses[i] / 64] |= 1ULL << (addresses[i] % 64);
+        }
+
+        if (addresses[0] == 0) {
+            break;
+        }
+
+        if (v6_read_block(addresses[0], blockData) != 0) {
+            return E_BLOCK_READ_FAILURE;
+        }
+        if (journalCapturing && journalAddBlock(addresses[0], blockData) != 0) {
+            return E_JOURNAL_FAILURE;
+        }
+
+        count = getBlockAddressAt(blockData, 0);
+        if (count > imageFormat.freeArraySize) {
+            return E_INVALID_BLOCK_NUMBER;
+        }
+        imageFormat.readAddresses(blockData, 1, addresses, count);
+    }
+
+    return 0;
+}
+
+/*
+ * Returns the first block of the lowest run of length free blocks in freeMap at or after
+ * startBlock, or failing that anywhere in the image, or 0 if there isn't one. Words with no free
+ * blocks in them are skipped whole.
+ */
+static uint32_t freeMapFindRun(Superblock *sb, const uint64_t *freeMap, uint32_t length, uint32_t startBlock) {
+    uint32_t firstDataBlock = getFirstDataBlock(sb);
+
+    if (startBlock < firstDataBlock) {
+        startBlock = firstDataBlock;
+    }
+
+    // From startBlock on, then over again from the first data block if that found nothing.
+    for (uint32_t searchStart = startBlock;; searchStart = firstDataBlock) {
+        uint32_t runStart = 0, runLength = 0;
+        uint32_t blockNumber = searchStart;
+
+        while (blockNumber < sb->fsize) {
+            if (blockNumber % 64 == 0 && freeMap[blockNumber / 64] == 0) {
+                runLength = 0;
+                blockNumber += 64;
+                continue;
+            }
+
+            if ((freeMap[blockNumber / 64] >> (blockNumber % 64)) & 1U) {
+                if (runLength == 0) {
+                    runStart = blockNumber;
+                }
+                if (++runLength == length) {
+                    return runStart;
+                }
+            } else {
+                runLength = 0;
+            }
+            blockNumber++;
+        }
+
+        if (searchStart == firstDataBlock) {
+            return 0;
+        }
+    }
+}
+
+/*
+ * Replaces the free list with the blocks set in freeMap. They're freed from the top of the image
+ * down, so v6_alloc hands them out again in ascending order and new files come out in runs.
+ * A grouped image takes freeMap as its block bitmap.
+ */
+static int8_t freeListRebuild(Superblock *sb, const uint64_t *freeMap) {
+    uint32_t firstDataBlock = getFirstDataBlock(sb);
+    int8_t result;
+
+    if (sb->ngroups > 0) {
+        memcpy(blockBitmap, freeMap, ((size_t) sb->fsize + 63) / 64 * sizeof(uint64_t));
+        memset(blockBitmapDirty, 0xff, ((size_t) blockBitmapBlocks + 63) / 64 * sizeof(uint64_t));
+        allocationGroupsCount();
+        sb->fmod = 1;
+        return 0;
+    }
+
+    sb->nfree = 1;
+    sb->free[0] = 0;
+    sb->fmod = 1;
+
+    for (uint32_t blockNumber = sb->fsize; blockNumber > firstDataBlock; blockNumber--) {
+        if ((freeMap[(blockNumber - 1) / 64] >> ((blockNumber - 1) % 64)) & 1U) {
+            result = v6_free(sb, blockNumber - 1);
+            if (result != 0) {
+                return result;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Lays out the allocation groups of a grouped image and reads in its block bitmap, or for a new
+ * image marks every data block free. Blocks and i-nodes are each split as evenly as they go.
+ * Only drops the groups of the last image when sb->ngroups is 0. The i-node counts of the groups
+ * are filled in by freeInodeMapBuild.
+ */
+static int8_t allocationGroupsInit(Superblock *sb, uint8_t newImage) {
+    uint32_t numInodes = getNumInodes(sb);
+    uint32_t firstDataBlock, numDataBlocks;
+    uint32_t bitsPerBitmapBlock = imageFormat.blockSize * 8;
+
+    free(allocationGroups);
+    free(blockBitmap);
+    free(blockBitmapDirty);
+    allocationGroups = NULL;
+    blockBitmap = NULL;
+    blockBitmapDirty = NULL;
+    allocationGroupCount = 0;
+    allocationGroupHint = 0;
+    blockBitmapBlocks = 0;
+
+    if (sb->ngroups == 0) {
+        return 0;
+    }
+
+    // I-node numbers are 16 bits, anything past that can't be handed out.
+    if (numInodes > 65535) {
+        numInodes = 65535;
+    }
+
+    blockBitmapBlocks = (uint32_t) (((uint64_t) sb->fsize + bitsPerBitmapBlock - 1) / bitsPerBitmapBlock);
+    firstDataBlock = getFirstDataBlock(sb);
+    if (firstDataBlock >= sb->fsize || sb->ngroups > numInodes || sb->ngroups > sb->fsize - firstDataBlock) {
+        return E_SUPERBLOCK_READ_ERROR;
+    }
+    numDataBlocks = sb->fsize - firstDataBlock;
+
+    allocationGroups = calloc(sb->ngroups, sizeof(AllocationGroup));
+    blockBitmap = calloc((size_t) blockBitmapBlocks * imageFormat.blockSize, 1);
+    blockBitmapDirty = calloc(((size_t) blockBitmapBlocks + 63) / 64, sizeof(uint64_t));
+    if (allocationGroups == NULL || blockBitmap == NULL || blockBitmapDirty == NULL) {
+        return E_ALLOCATE_FAILURE;
+    }
+
+    if (newImage) {
+        for (uint32_t blockNumber = firstDataBlock; blockNumber < sb->fsize; blockNumber++) {
+            blockBitmap[blockNumber / 64] |= 1ULL << (blockNumber % 64);
+        }
+        memset(blockBitmapDirty, 0xff, ((size_t) blockBitmapBlocks + 63) / 64 * sizeof(uint64_t));
+    } else {
+        for (uint32_t runStart = 0; runStart < blockBitmapBlocks; runStart += MAX_BLOCK_RUN) {
+            uint32_t runLength = blockBitmapBlocks - runStart < MAX_BLOCK_RUN ? blockBitmapBlocks - runStart : MAX_BLOCK_RUN;
+
+            // The cache is write-through, so the disk is up to date.
+            if (deviceReadBlocks(2 + sb->isize + runStart, runLength,
+                                 (uint8_t *) blockBitmap + (size_t) runStart * imageFormat.blockSize) != 0) {
+                return E_BLOCK_READ_FAILURE;
+            }
+        }
+
+        // Only data blocks can be free, whatever the bitmap says.
+        for (uint32_t blockNumber = 0; blockNumber < firstDataBlock; blockNumber++) {
+            blockBitmap[blockNumber / 64] &= ~(1ULL << (blockNumber % 64));
+        }
+        for (uint32_t blockNumber = sb->fsize; blockNumber < blockBitmapBlocks * bitsPerBitmapBlock; blockNumber++) {
+            blockBitmap[blockNumber / 64] &= ~(1ULL << (blockNumber % 64));
+        }
+    }
+
+    for (uint16_t i = 0; i < sb->ngroups; i++) {
+        AllocationGroup *group = &allocationGroups[i];
+
+        group->firstBlock = firstDataBlock + (uint32_t) ((uint64_t) numDataBlocks * i / sb->ngroups);
+        group->numBlocks = firstDataBlock + (uint32_t) ((uint64_t) numDataBlocks * (i + 1) / sb->ngroups)
+                           - group->firstBlock;
+        group->firstInode = (uint16_t) (numInodes * i / sb->ngroups + 1);
+        group->numInodes = (uint16_t) (numInodes * (i + 1) / sb->ngroups + 1 - group->firstInode);
+    }
+    allocationGroupCount = sb->ngroups;
+    allocationGroupsCount();
+
+    // Free i-nodes are only taken from the free i-node map, group by group.
+    sb->ninode = 0;
+
+    return 0;
+}
+
+/*
+ * Counts the free blocks of every group from the block bitmap, and starts each group's search
+ * over from its first block.
+ */
+static void allocationGroupsCount(void) {
+    for (uint16_t i = 0; i < allocationGroupCount; i++) {
+        AllocationGroup *group = &allocationGroups[i];
+        uint32_t end = group->firstBlock + group->numBlocks;
+        uint32_t blockNumber = group->firstBlock;
+
+        group->freeBlocks = 0;
+        group->cursor = group->firstBlock;
+        while (blockNumber < end) {
+            if (blockNumber % 64 == 0 && end - blockNumber >= 64) {
+                group->freeBlocks += (uint32_t) __builtin_popcountll(blockBitmap[blockNumber / 64]);
+                blockNumber += 64;
+            } else {
+                group->freeBlocks += (blockBitmap[blockNumber / 64] >> (blockNumber % 64)) & 1U;
+                blockNumber++;
+            }
+        }
+    }
+}
+
+/*
+ * Returns the first block past the i-node table and, on a grouped image, the block bitmap.
+ */
+static uint32_t getFirstDataBlock(Superblock *sb) {
+    return 2 + sb->isize + (sb->ngroups > 0 ? blockBitmapBlocks : 0);
+}
+
+/*
+ * Returns the allocation group an i-node belongs to, or 0 on an image without groups.
+ */
+static uint16_t getInodeGroup(uint16_t inodeNumber) {
+    const AllocationGroup *lastGroup;
+    uint16_t group;
+
+    if (allocationGroupCount == 0 || inodeNumber == 0) {
+        return 0;
+    }
+
+    // The groups split the i-nodes evenly, so this lands on the right group or next to it.
+    lastGroup = &allocationGroups[allocationGroupCount - 1];
+    group = (uint16_t) ((uint32_t) (inodeNumber - 1) * allocationGroupCount
+                        / (lastGroup->firstInode + lastGroup->numInodes - 1U));
+    if (group >= allocationGroupCount) {
+        group = allocationGroupCount - 1;
+    }
+    while (group > 0 && inodeNumber < allocationGroups[group].firstInode) {
+        group--;
+    }
+    while (group + 1 < allocationGroupCount && inodeNumber >= allocationGroups[group + 1].firstInode) {
+        group++;
+    }
+
+    return group;
+}
+
+/*
+ * Returns the allocation group a data block belongs to, or 0 on an image without groups.
+ */
+static uint16_t getBlockGroup(uint32_t blockNumber) {
+    const AllocationGroup *firstGroup, *lastGroup;
+    uint64_t numDataBlocks;
+    uint16_t group = 0;
+
+    if (allocationGroupCount == 0) {
+        return 0;
+    }
+
+    firstGroup = &allocationGroups[0];
+    lastGroup = &allocationGroups[allocationGroupCount - 1];
+    numDataBlocks = lastGroup->firstBlock + lastGroup->numBlocks - firstGroup->firstBlock;
+    if (blockNumber > firstGroup->firstBlock) {
+        group = (uint16_t) ((blockNumber - firstGroup->firstBlock) * (uint64_t) allocationGroupCount / numDataBlocks);
+    }
+    if (group >= allocationGroupCount) {
+        group = allocationGroupCount - 1;
+    }
+    while (group > 0 && blockNumber < allocationGroups[group].firstBlock) {
+        group--;
+    }
+    while (group + 1 < allocationGroupCount && blockNumber >= allocationGroups[group + 1].firstBlock) {
+        group++;
+    }
+
+    return group;
+}
+
+/*
+ * Makes v6_alloc look for blocks in the group of the given i-node first, from now until the next
+ * call. Each operation calls it for the file or directory whose blocks it is about to allocate.
+ */
+static void allocateNear(uint16_t inodeNumber) {
+    if (allocationGroupCount > 0) {
+        allocationGroupHint = getInodeGroup(inodeNumber);
+    }
+}
+
+/*
+ * Takes the lowest free block of the hinted group, or of the groups after it when that one is
+ * full. Taking the lowest keeps the blocks of a file written in one go next to each other.
+ *
+ * Returns 0 if every group is full.
+ */
+static uint32_t allocateGroupBlock(Superblock *sb) {
+    for (uint16_t i = 0; i < allocationGroupCount; i++) {
+        AllocationGroup *group = &allocationGroups[(allocationGroupHint + i) % allocationGroupCount];
+        uint32_t end = group->firstBlock + group->numBlocks;
+        uint32_t blockNumber = group->cursor;
+
+        if (group->freeBlocks == 0) {
+            continue;
+        }
+
+        while (blockNumber < end) {
+            uint64_t word = blockBitmap[blockNumber / 64] >> (blockNumber % 64);
+
+            if (word != 0) {
+                blockNumber += (uint32_t) __builtin_ctzll(word);
+                break;
+            }
+            blockNumber += 64 - blockNumber % 64;
+        }
+
+        if (blockNumber >= end) {
+            group->cursor = end;
+            continue;
+        }
+
+        blockBitmap[blockNumber / 64] &= ~(1ULL << (blockNumber % 64));
+        blockBitmapMarkDirty(blockNumber);
+        group->freeBlocks--;
+        group->cursor = blockNumber + 1;
+        sb->fmod = 1;
+
+        return blockNumber;
+    }
+
+    return 0;
+}
+
+/*
+ * Marks a block free in the block bitmap. Freeing a block that is already free does nothing.
+ */
+static int8_t freeGroupBlock(Superblock *sb, uint32_t blockNumber) {
+    AllocationGroup *group;
+
+    if (blockNumber < getFirstDataBlock(sb) || blockNumber >= sb->fsize) {
+        return E_INVALID_BLOCK_NUMBER;
+    }
+
+    if ((blockBitmap[blockNumber / 64] >> (blockNumber % 64)) & 1U) {
+        return 0;
+    }
+
+    blockBitmap[blockNumber / 64] |= 1ULL << (blockNumber % 64);
+    blockBitmapMarkDirty(blockNumber);
+    group = &allocationGroups[getBlockGroup(blockNumber)];
+    group->freeBlocks++;
+    if (blockNumber < group->cursor) {
+        group->cursor = blockNumber;
+    }
+    sb->fmod = 1;
+
+    return 0;
+}
+
+/*
+ * Takes the lowest free i-node of the given group, or of the groups after it when that one has
+ * none left.
+ *
+ * Returns 0 if there are no free i-nodes.
+ */
+static uint16_t allocateGroupInode(uint16_t group) {
+    for (uint16_t i = 0; i < allocationGroupCount; i++) {
+        AllocationGroup *candidate = &allocationGroups[(group + i) % allocationGroupCount];
+        uint32_t end = (uint32_t) candidate->firstInode + candidate->numInodes;
+        uint32_t inodeNumber = candidate->firstInode;
+
+        if (candidate->freeInodes == 0) {
+            continue;
+        }
+
+        while (inodeNumber < end) {
+            uint64_t word = freeInodeMap[inodeNumber / 64] >> (inodeNumber % 64);
+
+            if (word != 0) {
+                inodeNumber += (uint32_t) __builtin_ctzll(word);
+                break;
+            }
+            inodeNumber += 64 - inodeNumber % 64;
+        }
+
+        if (inodeNumber >= end) {
+            continue;
+        }
+
+        freeInodeMap[inodeNumber / 64] &= ~(1ULL << (inodeNumber % 64));
+        candidate->freeInodes--;
+
+        return (uint16_t) inodeNumber;
+    }
+
+    return 0;
+}
+
+/*
+ * Picks the group for a new directory the way the Fast File System does: of the groups with at
+ * least their share of free i-nodes and free blocks, the one with the fewest directories. When
+ * none has both, the one with the most free i-nodes.
+ */
+static uint16_t chooseDirectoryGroup(void) {
+    uint64_t totalFreeInodes = 0, totalFreeBlocks = 0;
+    uint64_t averageFreeInodes, averageFreeBlocks;
+    int32_t best = -1;
+
+    for (uint16_t i = 0; i < allocationGroupCount; i++) {
+        totalFreeInodes += allocationGroups[i].freeInodes;
+        totalFreeBlocks += allocationGroups[i].freeBlocks;
+    }
+    averageFreeInodes = totalFreeInodes / allocationGroupCount;
+    averageFreeBlocks = totalFreeBlocks / allocationGroupCount;
+
+    for (uint16_t i = 0; i < allocationGroupCount; i++) {
+        const AllocationGroup *group = &allocationGroups[i];
+
+        if (group->freeInodes > 0 && group->freeInodes >= averageFreeInodes && group->freeBlocks >= averageFreeBlocks
+            && (best < 0 || group->directories < allocationGroups[best].directories)) {
+            best = i;
+        }
+    }
+
+    if (best < 0) {
+        best = 0;
+        for (uint16_t i = 1; i < allocationGroupCount; i++) {
+            if (allocationGroups[i].freeInodes > allocationGroups[best].freeInodes) {
+                best = i;
+            }
+        }
+    }
+
+    return (uint16_t) best;
+}
+
+/*
+ * Notes that the bitmap block holding blockNumber's bit has to be written.
+ */
+static void blockBitmapMarkDirty(uint32_t blockNumber) {
+    uint32_t bitmapBlock = blockNumber >> (imageFormat.blockShift + 3);
+
+    blockBitmapDirty[bitmapBlock / 64] |= 1ULL << (bitmapBlock % 64);
+}
+
+/*
+ * Writes the blocks of the block bitmap that have changed since they were last written.
+ */
+static int8_t blockBitmapWrite(Superblock *sb) {
+    for (uint32_t i = 0; i < blockBitmapBlocks; i++) {
+        if (i % 64 == 0 && blockBitmapDirty[i / 64] == 0) {
+            i += 63;
+            continue;
+        }
+        if (((blockBitmapDirty[i / 64] >> (i % 64)) & 1U) == 0) {
+            continue;
+        }
+
+        if (v6_write_block(2 + sb->isize + i, (uint8_t *) blockBitmap + (size_t) i * imageFormat.blockSize) != 0) {
+            return E_BLOCK_WRITE_FAILURE;
+        }
+        blockBitmapDirty[i / 64] &= ~(1ULL << (i % 64));
+    }
+
+    return 0;
+}
+
+/*
+ * Walks the tree below v6Path depth first, counting the reads reading it would take. See
+ * v6_locality.
+ */
+static int8_t measureLocality(Superblock *sb, char *v6Path, V6LocalityReport *report) {
+    uint16_t *stack = NULL;
+    size_t stackCount = 0, stackCapacity = 0;
+    uint32_t *blockMap = NULL;
+    size_t blockMapCapacity = 0;
+    uint8_t directoryBlock[MAX_BLOCK_SIZE];
+    uint32_t lastBlock = 0;
+    uint16_t inodeNumber;
+    Inode *inode;
+    int8_t result = 0;
+
+    memset(report, 0, sizeof(*report));
+
+    inodeNumber = v6Path == NULL ? 1 : getTerminalInodeNumber(sb, v6Path);
+    if (inodeNumber == 0) {
+        return E_NO_SUCH_FILE;
+    }
+    inode = inodeLoad(sb, inodeNumber);
+    if (inode == NULL || inodeIsDirectory(inode) == 0) {
+        return E_INVALID_PATH;
+    }
+
+    stack = malloc(64 * sizeof(uint16_t));
+    if (stack == NULL) {
+        return E_ALLOCATE_FAILURE;
+    }
+    stackCapacity = 64;
+    stack[stackCount++] = inodeNumber;
+
+    while (stackCount > 0 && result == 0) {
+        uint16_t directoryNumber = stack[--stackCount];
+        size_t firstChild = stackCount;
+        uint8_t *inodeBlock = getCachedBlock(getInodeBlockNumber(directoryNumber));
+        Inode directory;
+        uint32_t numBlocks;
+
+        if (inodeBlock == NULL) {
+            result = E_BLOCK_READ_FAILURE;
+            break;
+        }
+        imageFormat.inodeFromDisk(getInodeInBlock(inodeBlock, directoryNumber), &directory);
+        numBlocks = getFileSize(&directory) / imageFormat.blockSize;
+
+        report->directories++;
+        localityRead(getInodeBlockNumber(directoryNumber), &lastBlock, report);
+
+        for (uint32_t i = 0; i < numBlocks && result == 0; i++) {
+            uint32_t blockNumber = getBlockNumberAtIndex(&directory, i);
+            uint8_t *cachedData;
+
+            if (blockNumber == 0) {
+                continue;
+            }
+            if (blockNumber == BLOCK_NUMBER_UNREADABLE) {
+                result = E_BLOCK_READ_FAILURE;
+                break;
+            }
+            localityRead(blockNumber, &lastBlock, report);
+
+            // The block is only good until the next read, and each entry reads its i-node.
+            cachedData = getCachedBlock(blockNumber);
+            if (cachedData == NULL) {
+                result = E_BLOCK_READ_FAILURE;
+                break;
+            }
+            memcpy(directoryBlock, cachedData, imageFormat.blockSize);
+
+            for (size_t e = 0; e < imageFormat.entriesPerBlock && result == 0; e++) {
+                const DiskDirectoryEntry *entry = (const DiskDirectoryEntry *) &directoryBlock[e * sizeof(DiskDirectoryEntry)];
+                Inode child;
+                size_t numFileBlocks;
+
+                if (entry->inodeNumber == 0 || entry->inodeNumber > getNumInodes(sb)
+                    || strncmp(entry->name, ".", 14) == 0 || strncmp(entry->name, "..", 14) == 0) {
+                    continue;
+                }
+
+                inodeBlock = getCachedBlock(getInodeBlockNumber(entry->inodeNumber));
+                if (inodeBlock == NULL) {
+                    result = E_BLOCK_READ_FAILURE;
+                    break;
+                }
+                imageFormat.inodeFromDisk(getInodeInBlock(inodeBlock, entry->inodeNumber), &child);
+                localityRead(getInodeBlockNumber(entry->inodeNumber), &lastBlock, report);
+
+                if (inodeIsDirectory(&child)) {
+                    if (stackCount == stackCapacity) {
+                        uint16_t *newStack = realloc(stack, stackCapacity * 2 * sizeof(uint16_t));
+
+                        if (newStack == NULL) {
+                            result = E_ALLOCATE_FAILURE;
+                            break;
+                        }
+                        stack = newStack;
+                        stackCapacity *= 2;
+                    }
+                    stack[stackCount++] = entry->inodeNumber;
+                    continue;
+                }
+
+                report->files++;
+                numFileBlocks = (getFileSize(&child) + imageFormat.blockSize - 1) / imageFormat.blockSize;
+                if (numFileBlocks > blockMapCapacity) {
+                    uint32_t *newBlockMap = realloc(blockMap, numFileBlocks * sizeof(uint32_t));
+
+                    if (newBlockMap == NULL) {
+                        result = E_ALLOCATE_FAILURE;
+                        break;
+                    }
+                    blockMap = newBlockMap;
+                    blockMapCapacity = numFileBlocks;
+                }
+                result = readBlockMap(&child, blockMap, numFileBlocks);
+                for (size_t b = 0; b < numFileBlocks && result == 0; b++) {
+                    if (blockMap[b] != 0) {
+                        localityRead(blockMap[b], &lastBlock, report);
+                    }
+                }
+            }
+        }
+
+        // The stack pops last first, so turn the subdirectories around to visit them in order.
+        for (size_t low = firstChild, high = stackCount; high > low + 1; low++, high--) {
+            uint16_t swap = stack[low];
+
+            stack[low] = stack[high - 1];
+            stack[high - 1] = swap;
+        }
+    }
+
+    free(stack);
+    free(blockMap);
+
+    return result;
+}
+
+/*
+ * Counts a read of blockNumber for measureLocality. Reading the block just read again costs
+ * nothing, and reading any block but the next one is a seek.
+ */
+static void localityRead(uint32_t blockNumber, uint32_t *lastBlock, V6LocalityReport *report) {
+    if (blockNumber == *lastBlock) {
+        return;
+    }
+
+    report->blocksRead++;
+    if (*lastBlock != 0 && blockNumber != *lastBlock + 1) {
+        report->seeks++;
+        report->seekDistance += blockNumber > *lastBlock ? blockNumber - *lastBlock : *lastBlock - blockNumber;
+    }
+    *lastBlock = blockNumber;
+}
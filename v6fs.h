@@ -5,14 +5,44 @@
 #include <stdio.h>
 
 /*
- * Block size in bytes
+ * Block size in bytes of a V6 image
  */
 #define BLOCK_SIZE                          512
 
+/*
+ * Smallest and largest block size of an extended image. The block size is a power of two in this
+ * range, and is kept in the superblock.
+ */
+#define MIN_BLOCK_SIZE                      512
+#define MAX_BLOCK_SIZE                      4096
+
 #define LAST_POSSIBLE_INODE_BLOCK           65535
 
+/*
+ * Room for a checkpoint name given to v6_checkpoint, including the terminator.
+ */
+#define CHECKPOINT_NAME_SIZE                32
+
 #define MAX_SINGLY_INDIRECT_BLOCKS_PER_INODE 263
 
+/*
+ * Largest file size in bytes on a V6 image. Block indexes are 16 bits wide, so a file can hold at
+ * most 65535 blocks even though a large file's block map has room for more.
+ */
+#define MAX_FILE_SIZE                       (65535UL * BLOCK_SIZE)
+
+/*
+ * Largest file size in bytes on an extended image with 512 byte blocks, the most its triply indirect
+ * block map can hold. With larger blocks the limit is the largest 32 bit size.
+ */
+#define MAX_EXTENDED_FILE_SIZE              ((6UL * 128 + 128UL * 128 + 128UL * 128 * 128) * BLOCK_SIZE)
+
+/*
+ * Maximum number of removed i-nodes whose blocks can be waiting to be reclaimed.
+ * The list lives in the otherwise unused tail of the superblock.
+ */
+#define MAX_PENDING_RECLAIM                 31
+
 /*
  * I-node flags bits (in octal).
  */
@@ -92,40 +122,206 @@
 #define E_INVALID_INDEX                     10
 #define E_INVALID_INODE_NUMBER              11
 #define E_FILE_ALREADY_EXISTS               12
+#define E_DIRECTORY_NOT_EMPTY               13
+#define E_INVALID_PATH                      14
+#define E_WARMUP_IN_PROGRESS                15
+#define E_THREAD_CREATE_FAILURE             16
+#define E_JOURNAL_FAILURE                   17
+#define E_INVALID_ARGUMENT                  18
+
+/*
+ * Progress of a cache warmup started with v6_warmup.
+ */
+#define WARMUP_NOT_STARTED                  0
+#define WARMUP_RUNNING                      1
+#define WARMUP_FINISHED                     2
+
+/*
+ * Durability modes for v6_set_durability.
+ */
+#define DURABILITY_NONE                     0
+#define DURABILITY_ON_QUIT                  1
+#define DURABILITY_PER_COMMAND              2
+#define DURABILITY_INTERVAL                 3
 
 
+/*
+ * The superblock as the file system works with it, whichever format the image is in. Block numbers
+ * are 32 bits wide here. On a V6 image they fit in 16, and an extended image's free array only
+ * uses the first 50 entries.
+ */
 typedef struct Superblock {
     uint16_t isize;
-    uint16_t fsize;
+    uint32_t fsize;
     uint16_t nfree;
-    uint16_t free[100];
+    uint32_t free[100];
     uint16_t ninode;
     uint16_t inode[100];
     uint8_t flock;
     uint8_t ilock;
+    // Set whenever the copy in memory differs from the one on disk.
     uint8_t fmod;
     uint16_t time[2];
+    // I-nodes that have been unlinked but whose blocks have not yet been freed.
+    uint16_t nreclaim;
+    uint16_t reclaim[MAX_PENDING_RECLAIM];
+    // The number of allocation groups, or 0 for an image that hands out blocks from the free list.
+    uint16_t ngroups;
 } Superblock;
 
+/*
+ * An i-node as the file system works with it, whichever format the image is in. The size is
+ * unpacked from size0, size1 and FLAG_FILE_SIZE_MSB on a V6 image.
+ */
 typedef struct Inode {
     uint16_t flags;
     uint8_t nlinks;
     uint8_t uid;
     uint8_t gid;
-    uint8_t size0;
-    uint16_t size1;
-    uint16_t addr[8];
+    uint32_t size;
+    uint32_t addr[8];
     uint16_t actime[2];
     uint16_t modtime[2];
 } Inode;
 
+/*
+ * One entry returned by v6_readdir.
+ */
+typedef struct V6DirectoryEntry {
+    uint16_t inodeNumber;
+    // The entry name, always null terminated.
+    char name[15];
+    // Only filled in when attributes are requested.
+    Inode inode;
+    uint32_t size;
+} V6DirectoryEntry;
+
+/*
+ * A directory opened for listing. Created by v6_opendir and released by v6_closedir.
+ */
+typedef struct V6Directory V6Directory;
+
+/*
+ * A file opened for random access reads and writes. Created by v6_open and released by v6_close.
+ */
+typedef struct V6File V6File;
+
+/*
+ * What a cache warmup did. Filled in by v6_warmup_report.
+ */
+typedef struct V6WarmupReport {
+    // One of the WARMUP_ values. The other fields are only set once it is WARMUP_FINISHED.
+    uint8_t state;
+    // Blocks read from the image.
+    uint32_t blocksRead;
+    // Blocks that went into the block cache. Fewer than were read when the cache is too small to
+    // hold them all, or when a block was written while the warmup was running.
+    uint32_t blocksCached;
+    // Time taken to read them.
+    double seconds;
+} V6WarmupReport;
+
+/*
+ * Called by v6_walk for every file and directory it visits.
+ *
+ * path - the full path of the file, starting with "/".
+ * entry - the file's directory entry, with its i-node and size filled in.
+ * depth - 0 for the path the walk started at, 1 for its children, and so on.
+ * userData - passed through from v6_walk.
+ *
+ * Return 0 to continue the walk, anything else to stop it.
+ */
+typedef int (*V6WalkCallback)(const char *path, const V6DirectoryEntry *entry, int depth, void *userData);
+
+/*
+ * How one file came out of v6_defrag. A fragmentation score is the percentage of steps from one
+ * data block of a file to the next, in file order, that don't go to the adjacent block: 0 for a
+ * file laid out in a single run, 100 for one with no two blocks side by side. Holes and indirect
+ * blocks don't count.
+ */
+typedef struct V6DefragFile {
+    uint16_t inodeNumber;
+    // Data blocks in the file.
+    uint32_t numBlocks;
+    double scoreBefore;
+    double scoreAfter;
+    // 0 if the file was left where it was because no free run was long enough to hold it, or
+    // because it is a directory open with v6_opendir.
+    uint8_t moved;
+} V6DefragFile;
+
+/*
+ * What a call to v6_defrag did. The scores cover every file on the image, weighted by size.
+ */
+typedef struct V6DefragReport {
+    uint32_t filesScanned;
+    uint32_t filesFragmented;
+    uint32_t filesMoved;
+    // Data and indirect blocks written to new places.
+    uint32_t blocksMoved;
+    double scoreBefore;
+    double scoreAfter;
+    // 1 if the call got through the last i-node. 0 if it stopped at its block budget, in which
+    // case the next call carries on from nextInode.
+    uint8_t finished;
+    uint16_t nextInode;
+} V6DefragReport;
+
+/*
+ * Called by v6_defrag for every fragmented file it gets to.
+ */
+typedef void (*V6DefragCallback)(const V6DefragFile *file, void *userData);
+
+/*
+ * What a call to v6_compact did.
+ */
+typedef struct V6CompactReport {
+    uint32_t directoriesScanned;
+    uint32_t directoriesCompacted;
+    // Entries that ended up in a different slot.
+    uint32_t entriesMoved;
+    // Directory and indirect blocks given back to the free list.
+    uint32_t blocksFreed;
+} V6CompactReport;
+
+/*
+ * What v6_locality measured. A seek is a block read that isn't of the block just read or the one
+ * after it, and its distance is how many blocks away from the last read it lands.
+ */
+typedef struct V6LocalityReport {
+    uint32_t directories;
+    uint32_t files;
+    uint64_t blocksRead;
+    uint64_t seeks;
+    uint64_t seekDistance;
+} V6LocalityReport;
+
+/*
+ * What v6_export_delta wrote or v6_apply_delta applied.
+ */
+typedef struct V6DeltaReport {
+    // The checkpoint the delta holds the changes since.
+    char checkpoint[CHECKPOINT_NAME_SIZE];
+    // Size of the image in blocks.
+    uint32_t numBlocks;
+    uint32_t blockSize;
+    uint32_t changedBlocks;
+    // Runs of consecutive changed blocks, each stored as one record.
+    uint32_t runs;
+    // Size of the delta.
+    uint64_t bytes;
+} V6DeltaReport;
+
 /*
  * Declared globally so we can have a consistent place to store between functions.
  */
 extern FILE *v6FileSystem;
 
 /*
- * Loads the superblock from the given file system location.
+ * Loads the superblock from the given file system location. A clone made by v6_clone is opened
+ * along with its base, and NULL is returned if the base is missing or no longer matches the size,
+ * i-node number and modification time it had when the clone was made, as it would after being
+ * written or replaced.
  *
  * sb - the variable to store the newly loaded superblock.
  */
@@ -140,6 +336,51 @@ extern Superblock * v6_loadfs(char *v6FileSystemName);
  */
 extern Superblock * v6_initfs(uint16_t numBlocks, uint16_t numInodes);
 
+/*
+ * Initializes a new, empty file system in the extended format, for images past the 32 MB a V6
+ * image can address. Everything else works on it the same way.
+ *
+ * An extended image is told apart by a magic number in the superblock. Block numbers are 32 bits
+ * wide, i-nodes are 64 bytes with a 64 bit size, and a large file's last address is triply
+ * indirect, so files can grow to MAX_EXTENDED_FILE_SIZE. The i-node numbers, directory entries
+ * and reclaim queue are the same as on a V6 image.
+ *
+ * The block size is chosen here and kept in the superblock. Larger blocks mean fewer block reads
+ * and writes for bulk data and fewer indirect blocks per file, at the cost of more space lost at
+ * the end of small files.
+ *
+ * numBlocks - the number of blocks to create in the file system.
+ * numInodes - the number of i-nodes contained within this filesystem.
+ * blockSize - the block size in bytes, a power of two from MIN_BLOCK_SIZE to MAX_BLOCK_SIZE.
+ *
+ * Returns NULL if the block size isn't one of those.
+ */
+extern Superblock * v6_initfs_extended(uint32_t numBlocks, uint16_t numInodes, uint32_t blockSize);
+
+/*
+ * Initializes a new, empty file system, V6 or extended, whose blocks and i-nodes are split into
+ * numGroups allocation groups, after the cylinder groups of the Berkeley Fast File System.
+ *
+ * Each group is a run of data blocks and a slice of the i-node table. A new file's i-node is taken
+ * from its directory's group and its blocks from its own group, so a directory, the i-nodes of its
+ * files and their data sit close together. A new directory goes to a group with a fair share of
+ * free i-nodes and blocks and the fewest directories, so directories are spread over the image.
+ * Allocation moves on to the next group when one fills up.
+ *
+ * Instead of the free list, such an image keeps a bitmap of free blocks right after the i-node
+ * table, which is how a block can be taken from a chosen group.
+ *
+ * extended - 0 for a V6 image, 1 for an extended one.
+ * numBlocks - the number of blocks to create in the file system.
+ * numInodes - the number of i-nodes contained within this filesystem.
+ * blockSize - the block size in bytes. Must be BLOCK_SIZE for a V6 image.
+ * numGroups - from 1 up to the number of i-nodes and of data blocks.
+ *
+ * Returns NULL if any of those are out of range.
+ */
+extern Superblock * v6_initfs_grouped(uint8_t extended, uint32_t numBlocks, uint16_t numInodes, uint32_t blockSize,
+                                      uint16_t numGroups);
+
 
 /*
  * Reads a file from an external file location and writes it to a location within the V6 file system.
@@ -168,15 +409,384 @@ extern int8_t v6_cpout(Superblock *sb, char *v6FilePath, char *externalFilePath)
 extern int8_t v6_mkdir(Superblock *sb, char *v6DirectoryPath);
 
 /*
- * Removes a file in the V6 file system. (TODO: determine if this should also remove directories)
+ * Removes a file in the V6 file system. Directories are only removed when they are empty.
+ *
+ * Only the directory entry is removed right away. The i-node is queued in the superblock and
+ * its blocks are reclaimed later in a batch, when the queue fills up, when the file system runs
+ * out of blocks or i-nodes, or on quit. A queue left behind by a crash is processed on load.
  *
  * sb - the superblock that represents the V6 file system.
  * v6Filename - the name of the file to be removed.
  */
 extern int8_t v6_rm(Superblock *sb, char *v6FilePath);
 
+/*
+ * Removes a file or a directory along with everything below it (rm -r).
+ *
+ * Only the entry in the parent directory is removed right away. The subtree is walked once,
+ * in post-order, when the reclaim queue is processed, and all of its blocks and i-nodes are
+ * freed in that same batch.
+ *
+ * sb - the superblock that represents the V6 file system.
+ * v6Path - the file or directory to be removed.
+ */
+extern int8_t v6_rm_recursive(Superblock *sb, char *v6Path);
+
+/*
+ * Copies a file to a new path inside the V6 file system, without going through the host.
+ *
+ * All of the copy's blocks are reserved up front and handed out in block order, so they form
+ * runs wherever the free list allows. Data is copied image to image one run at a time, and the
+ * copy's block map is built in memory and written once.
+ *
+ * sb - the superblock that represents the V6 file system.
+ * v6SourcePath - the file to copy.
+ * v6DestinationPath - the path of the new copy. Must not exist yet.
+ */
+extern int8_t v6_cp(Superblock *sb, char *v6SourcePath, char *v6DestinationPath);
+
+/*
+ * Renames or moves a file or directory without touching its data. Only the two directory
+ * entries change, plus the ".." entry when a directory moves to a new parent.
+ *
+ * sb - the superblock that represents the V6 file system.
+ * v6SourcePath - the file or directory to move.
+ * v6DestinationPath - the new path. If this is an existing directory, the source is moved into
+ *                     it under its current name.
+ */
+extern int8_t v6_mv(Superblock *sb, char *v6SourcePath, char *v6DestinationPath);
+
+/*
+ * Opens a file for random access reads and writes.
+ *
+ * sb - the superblock that represents the V6 file system.
+ * v6FilePath - the file to open.
+ *
+ * Returns NULL if the path does not exist or is a directory. Once the file is removed and its
+ * i-node freed, reads and writes through the handle fail with E_NO_SUCH_FILE, even if the i-node
+ * has been reused for another file.
+ */
+extern V6File * v6_open(Superblock *sb, char *v6FilePath);
+
+/*
+ * Reads up to count bytes starting at offset into buffer, stopping at the end of the file.
+ *
+ * The block index is computed straight from the offset and resolved through the i-node's
+ * direct, indirect or doubly indirect addresses, with indirect blocks taken from the block
+ * cache. A small cold read costs at most three block reads, four for the triply indirect range of
+ * an extended image, and a warm one none.
+ *
+ * file - the file returned by v6_open.
+ * buffer - where the data is stored. Must hold count bytes.
+ * count - the largest number of bytes to read.
+ * offset - the byte offset in the file to start at.
+ * bytesRead - set to the number of bytes read. 0 at or past the end of the file.
+ */
+extern int8_t v6_pread(V6File *file, void *buffer, size_t count, uint32_t offset, size_t *bytesRead);
+
+/*
+ * Writes up to count bytes from buffer into an open file, starting at offset.
+ *
+ * Blocks are allocated as the file grows, converting it to a large file when it passes 8 blocks.
+ * Writing part of an existing block reads the block first. Writing past the end of the file fills
+ * the gap with zeros. Each block written costs a constant number of block map lookups, so
+ * appending does not get slower as the file grows.
+ *
+ * file - the file returned by v6_open.
+ * buffer - the data to write.
+ * count - the number of bytes to write.
+ * offset - the byte offset in the file to start at.
+ * bytesWritten - set to the number of bytes of buffer written, which is less than count only on
+ *                error.
+ *
+ * Returns E_INVALID_INDEX if the write would grow the file past MAX_FILE_SIZE, or
+ * MAX_EXTENDED_FILE_SIZE on an extended image.
+ */
+extern int8_t v6_pwrite(V6File *file, const void *buffer, size_t count, uint32_t offset, size_t *bytesWritten);
+
+/*
+ * Writes count bytes from buffer to the end of an open file. See v6_pwrite.
+ */
+extern int8_t v6_append(V6File *file, const void *buffer, size_t count, size_t *bytesWritten);
+
+/*
+ * Releases a file opened with v6_open.
+ */
+extern void v6_close(V6File *file);
+
+/*
+ * Opens a directory for listing. The directory's block map is resolved once, here, and the
+ * directory isn't compacted until it is closed, so removing entries while listing it is safe.
+ *
+ * sb - the superblock that represents the V6 file system.
+ * v6DirectoryPath - the directory to list. "/" lists the root directory.
+ *
+ * Returns NULL if the path does not exist or is not a directory.
+ */
+extern V6Directory * v6_opendir(Superblock *sb, char *v6DirectoryPath);
+
+/*
+ * Reads the next batch of entries from an open directory, including "." and "..".
+ * Entries are copied straight out of cached directory blocks.
+ *
+ * directory - the directory returned by v6_opendir.
+ * entries - where the entries are stored. Must hold maxEntries entries.
+ * maxEntries - the largest number of entries to return.
+ * withAttributes - when nonzero, also fill in each entry's i-node and size. The i-nodes of the
+ *                  whole batch are loaded in one pass, one read per distinct i-node block.
+ * numEntries - set to the number of entries returned. 0 once the directory is exhausted.
+ */
+extern int8_t v6_readdir(V6Directory *directory, V6DirectoryEntry *entries, size_t maxEntries,
+                         uint8_t withAttributes, size_t *numEntries);
+
+/*
+ * Releases a directory opened with v6_opendir.
+ */
+extern void v6_closedir(V6Directory *directory);
+
+/*
+ * Starts reading file system metadata into the block cache on a background thread, so the first
+ * path walks after loading don't have to seek for every i-node and directory block.
+ *
+ * The whole i-node table is read in one sequential pass, followed by the blocks of the root
+ * directory, or of every directory if allDirectories is set. What fits in the block cache is moved
+ * into it the next time the file system reads a block after the thread finishes. The root
+ * directory goes in first, then the i-node blocks, then the other directories.
+ *
+ * sb - the superblock that represents the V6 file system.
+ * allDirectories - 0 to read only the root directory's blocks, 1 to read every directory's.
+ *
+ * Returns E_WARMUP_IN_PROGRESS if a warmup is already running.
+ */
+extern int8_t v6_warmup(Superblock *sb, uint8_t allDirectories);
+
+/*
+ * Reports on the last warmup started with v6_warmup. Never waits for it.
+ */
+extern void v6_warmup_report(V6WarmupReport *report);
+
+/*
+ * Turns on metadata journaling for a file system loaded with v6_loadfs. The journal is a sidecar
+ * file named after the image with ".journal" appended, and journaling stays on across loads for
+ * as long as that file exists.
+ *
+ * While journaling, i-node, directory, indirect, free list and superblock writes are held in
+ * memory and logged to the journal. The changes of up to 32 operations are committed together
+ * with a single fdatasync, and written in place later, in block order, once enough have built up.
+ * File contents are written in place and synced just before the commit that references them,
+ * unless they land on a block that still has a journaled copy, in which case they're journaled too.
+ * After a crash, v6_loadfs replays every committed transaction and drops a torn last one, so the
+ * image always comes back as of the last commit.
+ *
+ * A commit only ever happens between operations, except when an operation frees blocks through
+ * the reclaim queue.
+ */
+extern int8_t v6_journal_enable(Superblock *sb);
+
+/*
+ * Writes everything journaled in place, turns journaling off and removes the journal file. Does
+ * nothing unless sb is the file system the journal belongs to.
+ */
+extern int8_t v6_journal_disable(Superblock *sb);
+
+/*
+ * Commits the running journal transaction now instead of waiting for it to fill up.
+ * Does nothing if journaling is off.
+ */
+extern int8_t v6_journal_commit(Superblock *sb);
+
+/*
+ * Checkpoints the file system: writes the superblock if it has changed since it was last written,
+ * and syncs the image. With the journal on, commits the running transaction and writes everything
+ * journaled in place instead. Cheap enough to call often in a long session.
+ */
+extern int8_t v6_sync(Superblock *sb);
+
+/*
+ * Starts tracking changed blocks from a checkpoint named name, at most CHECKPOINT_NAME_SIZE - 1
+ * characters. The file system is synced first, so a copy of the image taken now is the full backup
+ * the next deltas apply to. From then on every block written to the image, including what the
+ * journal writes in place, is marked in a bitmap kept in a sidecar file named after the image with
+ * ".changes" appended, and tracking stays on across loads for as long as that file exists. Taking
+ * another checkpoint clears the bitmap. initfs marks every block.
+ *
+ * sb - the superblock that represents the V6 file system.
+ * name - recorded with the bitmap and in every delta exported from it.
+ */
+extern int8_t v6_checkpoint(Superblock *sb, char *name);
+
+/*
+ * Writes every block changed since the checkpoint to deltaPath, after syncing the file system, so
+ * an incremental backup costs what changed rather than the size of the image. The delta is a
+ * header followed by one record per run of consecutive changed blocks: its first block number, its
+ * length and the blocks themselves. The checkpoint stays as it is; take a new one once the delta
+ * is safe.
+ *
+ * Returns E_INVALID_ARGUMENT if no checkpoint has been taken.
+ *
+ * sb - the superblock that represents the V6 file system.
+ * deltaPath - the external file to write. Replaced if it exists.
+ * report - filled in with what was written.
+ */
+extern int8_t v6_export_delta(Superblock *sb, char *deltaPath, V6DeltaReport *report);
+
+/*
+ * Applies a delta made by v6_export_delta to an image that isn't loaded, bringing a copy of the
+ * image as it was at the checkpoint up to date with the image the delta was exported from. The
+ * image is resized if the delta comes from a different size of image.
+ *
+ * Returns E_INVALID_ARGUMENT if the image is the one loaded or a clone.
+ *
+ * deltaPath - the delta to apply.
+ * imagePath - the image to write it to. Must exist.
+ * report - filled in with what was applied.
+ */
+extern int8_t v6_apply_delta(char *deltaPath, char *imagePath, V6DeltaReport *report);
+
+/*
+ * Makes a copy-on-write clone of an image in constant time and space. The clone is a sparse
+ * delta file that starts out empty: v6_loadfs on it opens the base read-only as well, blocks
+ * written from then on go into the delta and are marked in a bitmap kept in it, and every other
+ * block is read from the base. Many clones can share one base, which must not change while any of
+ * them is in use, and must not be a clone itself. The base's size, i-node number and modification
+ * time are recorded in the clone, and v6_loadfs refuses the clone once any of them has changed.
+ *
+ * Returns E_INVALID_ARGUMENT if the base is the loaded image or a clone.
+ *
+ * baseImageName - the image to clone. Its full path is recorded in the clone.
+ * cloneImageName - the file to create. Must not exist yet.
+ */
+extern int8_t v6_clone(char *baseImageName, char *cloneImageName);
+
+/*
+ * Flattens a clone loaded from a file made by v6_clone: syncs it, copies in every block still read
+ * from the base, and drops the bitmap, leaving a plain image that no longer needs the base. Blocks
+ * that are zeros in the base stay holes. A running warmup is stopped. Does nothing if the loaded
+ * image isn't a clone.
+ *
+ * sb - the superblock that represents the V6 file system.
+ */
+extern int8_t v6_commit(Superblock *sb);
+
+/*
+ * Chooses when changes are forced onto the disk, trading latency for durability:
+ *
+ * DURABILITY_NONE          Never synced. Whatever the OS gets to is what survives a crash.
+ * DURABILITY_ON_QUIT       Synced once by v6_quit.
+ * DURABILITY_PER_COMMAND   The superblock is written and everything synced as each operation ends.
+ * DURABILITY_INTERVAL      The superblock is written as each operation ends, and a background
+ *                          thread syncs once every intervalMs milliseconds if anything changed.
+ *
+ * With the journal on, syncing means committing the running transaction, so the per command and
+ * interval modes set how often that happens rather than waiting for a group to fill up. Commits
+ * only happen on the calling thread, so in the interval mode the commit comes at the end of the
+ * first operation after an interval has passed. When the session goes idle with changes left
+ * uncommitted, the background thread makes v6_durability_fd readable at the end of the interval,
+ * and the caller commits them with v6_durability_commit.
+ *
+ * The setting lasts until the next v6_loadfs, which goes back to DURABILITY_NONE.
+ */
+extern int8_t v6_set_durability(Superblock *sb, uint8_t mode, uint32_t intervalMs);
+
+/*
+ * Returns a file descriptor that becomes readable when a journal commit is due in the interval
+ * durability mode, for the caller to wait on alongside its own input, or -1 outside that mode.
+ * The descriptor changes whenever the durability mode is set.
+ */
+extern int v6_durability_fd(void);
+
+/*
+ * Commits the running journal transaction if the interval durability mode left one waiting, and
+ * clears v6_durability_fd. Call it once v6_durability_fd is readable.
+ *
+ * sb - the superblock that represents the V6 file system.
+ */
+extern int8_t v6_durability_commit(Superblock *sb);
+
+/*
+ * Microbenchmark for directory lookups. Times iterations lookups of a missing name in a full,
+ * in-memory directory block with the original strncmp loop, the portable matcher and the SSE2
+ * matcher used by the file system. Without SSE2 the last two run the same code.
+ *
+ * Each time is set to the total in seconds.
+ */
+extern void v6_bench_dirscan(size_t iterations, double *strncmpSeconds, double *scalarSeconds, double *vectorSeconds);
+
+/*
+ * Visits a file, or a directory and everything below it, calling callback for each one.
+ *
+ * The walk reads the whole i-node table in one sequential pass up front, then goes one depth at a
+ * time: the directory blocks of a whole level are read in block number order, with consecutive
+ * blocks read together, before any of their entries are visited. Entries are therefore visited
+ * breadth first, and "." and ".." are skipped.
+ *
+ * sb - the superblock that represents the V6 file system.
+ * v6Path - where to start. "/" walks the whole file system. Tokenized in place.
+ * callback - called for every file and directory visited.
+ * userData - passed to every callback.
+ */
+extern int8_t v6_walk(Superblock *sb, char *v6Path, V6WalkCallback callback, void *userData);
+
+/*
+ * Defragments the loaded image in place. Each fragmented file or directory is copied into the
+ * first free run long enough to hold its indirect blocks followed by its data blocks in file
+ * order, its i-node is switched over to the copy, and only then are its old blocks freed. Once
+ * the files are moved the free list is rebuilt in block order, so files written afterwards are
+ * laid out in runs as well.
+ *
+ * A call is a single operation, so with the journal on it is applied whole or not at all. To keep
+ * it short, a call stops before a file that would take it past maxBlocks moved blocks (0 for no
+ * limit, and the first file is always moved), and the next call resumes from there. Files that
+ * are already contiguous only cost a read of their block map, so starting over is cheap as well.
+ *
+ * Files open with v6_open keep their old block map and have to be closed first. Directories open
+ * with v6_opendir are left where they are, as v6_compact does, until they are closed.
+ *
+ * sb - the superblock that represents the V6 file system.
+ * maxBlocks - the block budget of this call.
+ * pauseMs - milliseconds to sleep between files, to leave the disk to other work.
+ * callback - called for each fragmented file visited, or NULL.
+ * userData - passed to every callback.
+ * report - filled in with what the call did.
+ */
+extern int8_t v6_defrag(Superblock *sb, uint32_t maxBlocks, uint32_t pauseMs, V6DefragCallback callback,
+                        void *userData, V6DefragReport *report);
+
+/*
+ * Compacts directories. Removing an entry only clears its slot, so a directory that once held many
+ * entries keeps all of its blocks and every lookup keeps scanning them. Compacting packs the live
+ * entries into the directory's first blocks, keeping their order, then frees the blocks left over
+ * at the end along with any indirect blocks that no longer map anything, and shrinks the directory.
+ *
+ * Removing or moving a file out of a directory does this on its own once a quarter of the
+ * directory's blocks could be freed. This compacts whenever at least one block can be.
+ *
+ * Directories open with v6_opendir are left alone, by this and by removals, until they are closed.
+ *
+ * sb - the superblock that represents the V6 file system.
+ * v6DirectoryPath - the directory to compact, or NULL for every directory on the image.
+ * report - filled in with what the call did.
+ */
+extern int8_t v6_compact(Superblock *sb, char *v6DirectoryPath, V6CompactReport *report);
+
+/*
+ * Measures how well a tree is laid out for reading. Models reading every directory below v6Path
+ * depth first: the directory's i-node and blocks, then for each entry its i-node, and for a file
+ * its data blocks in order, before moving on to the subdirectories. Every block that isn't next
+ * to the one before it counts as a seek, and reading the block just read again is free. The blocks
+ * are only read through the block cache.
+ *
+ * Run it on images built the same way with and without allocation groups to compare them.
+ *
+ * sb - the superblock that represents the V6 file system.
+ * v6Path - the directory to start from. Tokenized in place.
+ * report - filled in with the totals.
+ */
+extern int8_t v6_locality(Superblock *sb, char *v6Path, V6LocalityReport *report);
+
 /*
  * Exits the program and saves all changes to the superblock back to the V6 file system.
+ * Frees sb along with everything else held for the session.
  *
  * sb - the superblock that represents the V6 file system.
  */